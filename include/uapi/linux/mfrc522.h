@@ -0,0 +1,200 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+
+#ifndef _UAPI_LINUX_MFRC522_H
+#define _UAPI_LINUX_MFRC522_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define MFRC522_IOC_MAGIC 0xB5
+
+/* Maximum size of a request's payload, and of the answer written back */
+#define MFRC522_IOC_DATA_SIZE 1024
+
+/*
+ * Opcodes of the binary interface. They map one to one to the commands of the
+ * text interface and take the same arguments, without the length field:
+ *
+ * - MFRC522_OP_MEM_WRITE: payload is the data to write, up to 25 bytes, padded
+ *   with zeroes. NUL bytes are written as is
+ * - MFRC522_OP_MEM_READ: answer is the content of the internal memory
+ * - MFRC522_OP_GET_VERSION: answer is the version, as a decimal string
+ * - MFRC522_OP_GEN_RANDOM: no payload, no answer
+ * - MFRC522_OP_DEBUG: payload is "on" or "off"
+ * - MFRC522_OP_POLL: payload is "on" or "off", see struct mfrc522_tag_event
+ * - MFRC522_OP_READ_UID: answer is the UID and SAK of the tag in the field, as
+ *   hexadecimal strings separated by a colon. Empty if there is no tag
+ * - MFRC522_OP_MF_KEY: payload is "<sector>,<A|B>,<key>", the sector being "*"
+ *   for every sector without a key of its own, and the key being 12 hexadecimal
+ *   digits
+ * - MFRC522_OP_MF_READ: payload is "<first sector>[-<last sector>]", answer is
+ *   the raw content of every block of these sectors
+ * - MFRC522_OP_MF_WRITE: payload is "<block>,<data>", the data being 32
+ *   hexadecimal digits
+ * - MFRC522_OP_NTAG_READ: payload is "<first page>[-<last page>]", answer is
+ *   the raw content of these pages of an NFC Forum Type 2 tag. Empty if there
+ *   is no tag
+ */
+enum mfrc522_opcode {
+	MFRC522_OP_MEM_WRITE = 0x00,
+	MFRC522_OP_MEM_READ,
+	MFRC522_OP_GET_VERSION,
+	MFRC522_OP_GEN_RANDOM,
+	MFRC522_OP_DEBUG,
+	MFRC522_OP_POLL,
+	MFRC522_OP_READ_UID,
+	MFRC522_OP_MF_KEY,
+	MFRC522_OP_MF_READ,
+	MFRC522_OP_MF_WRITE,
+	MFRC522_OP_NTAG_READ,
+};
+
+/**
+ * struct mfrc522_ioc_cmd - Request and answer of MFRC522_IOC_EXEC
+ * @opcode: Command to execute, one of enum mfrc522_opcode
+ * @status: Set by the driver: 0 on success, a negative errno otherwise
+ * @len: Length of the payload in @data. Set by the driver to the length of the
+ *	answer
+ * @reserved: Must be zero
+ * @data: Payload, then answer
+ *
+ * Only the first @len bytes of @data are copied in each direction.
+ */
+struct mfrc522_ioc_cmd {
+	__u32 opcode;
+	__s32 status;
+	__u32 len;
+	__u32 reserved;
+	__u8 data[MFRC522_IOC_DATA_SIZE];
+};
+
+enum mfrc522_tag_event_type {
+	MFRC522_TAG_ARRIVED = 1,
+	MFRC522_TAG_LEFT,
+	/* Only reported through the shared ring, see struct mfrc522_ring_record */
+	MFRC522_TAG_SCAN_FAILED,
+};
+
+/**
+ * struct mfrc522_tag_event - Tag event, read from the device while polling
+ * @timestamp_ns: CLOCK_MONOTONIC time of the scan which noticed the event
+ * @dropped: Amount of events dropped right before this one, because the queue
+ *	was full
+ * @type: One of enum mfrc522_tag_event_type
+ * @sak: SAK answered by the tag
+ * @uid_len: Size of the tag's UID: 4, 7 or 10 bytes
+ * @uid: UID of the tag
+ * @reserved: Zero
+ *
+ * While polling is on, the device scans for tags periodically, and queues an
+ * event whenever a tag enters or leaves the field. A tag staying in the field
+ * only produces one event. Once any pending text answer has been read, read()
+ * returns whole events, and poll() reports the device as readable as long as
+ * events are queued.
+ */
+struct mfrc522_tag_event {
+	__u64 timestamp_ns;
+	__u32 dropped;
+	__u8 type;
+	__u8 sak;
+	__u8 uid_len;
+	__u8 uid[10];
+	__u8 reserved[7];
+};
+
+#define MFRC522_RING_RECORDS 512
+
+/**
+ * struct mfrc522_ring_record - Tag event, as found in the shared ring
+ * @timestamp_ns: CLOCK_MONOTONIC time of the scan which noticed the event
+ * @dropped: Amount of events dropped right before this one, because the ring
+ *	was full
+ * @status: 0, or the negative errno of the scan if @type is
+ *	MFRC522_TAG_SCAN_FAILED
+ * @reader: Index of the reader, N in /dev/mfrc522_misc<N>
+ * @type: One of enum mfrc522_tag_event_type
+ * @sak: SAK answered by the tag
+ * @uid_len: Size of the tag's UID: 4, 7 or 10 bytes, 0 if the scan failed
+ * @uid: UID of the tag
+ * @reserved: Zero
+ */
+struct mfrc522_ring_record {
+	__u64 timestamp_ns;
+	__u32 dropped;
+	__s16 status;
+	__u16 reader;
+	__u8 type;
+	__u8 sak;
+	__u8 uid_len;
+	__u8 uid[10];
+	__u8 reserved[3];
+};
+
+/**
+ * struct mfrc522_ring_ctrl - Indices of the shared ring, in its first page
+ * @head: Free-running index of the next record the driver writes. Only written
+ *	by the driver, which keeps its own copy and ignores userspace writes
+ * @records: Amount of records in the ring, a power of 2
+ * @record_size: Size of a record
+ * @data_offset: Offset of the first record from the start of the mapping
+ * @dropped: Total amount of events dropped because the ring was full
+ * @tail: Free-running index of the next record userspace reads. Only written by
+ *	userspace, in its own cache line
+ *
+ * Mapping the device with MAP_SHARED, with a length of data_offset (the page
+ * size) plus MFRC522_RING_RECORDS * sizeof(struct mfrc522_ring_record) and an
+ * offset of 0, gives a single-producer single-consumer ring of tag events.
+ * Private mappings are refused. Record i is at index i & (records - 1).
+ * Userspace loads @head with acquire semantics, reads the records up to it,
+ * then stores @tail with release semantics. The driver does the opposite, and
+ * drops events instead of overwriting unread records.
+ *
+ * While the device is mapped, tag events go to the ring instead of read(), and
+ * poll() reports the device as readable as long as the ring is not empty, so
+ * one epoll_wait() can drain the rings of several readers without any other
+ * syscall.
+ */
+struct mfrc522_ring_ctrl {
+	__u32 head;
+	__u32 records;
+	__u32 record_size;
+	__u32 data_offset;
+	__u64 dropped;
+	__u8 reserved0[40];
+	__u32 tail;
+	__u8 reserved1[60];
+};
+
+/* Maximum amount of commands in a batch, written as text or sent as an ioctl */
+#define MFRC522_BATCH_MAX_CMDS 32
+
+/**
+ * struct mfrc522_ioc_batch - Commands executed by MFRC522_IOC_BATCH
+ * @cmds: Pointer to an array of struct mfrc522_ioc_cmd, each filled as for
+ *	MFRC522_IOC_EXEC, and getting its own status and answer back
+ * @count: Amount of commands, up to MFRC522_BATCH_MAX_CMDS
+ * @reserved: Must be zero
+ *
+ * The commands run in order, and the SPI bus stays locked from the first one
+ * to the last one, so that no other device's traffic comes in between. Commands
+ * of other devices on the same bus wait for the batch to be over. Writing
+ * several newline-separated text commands at once does the same.
+ */
+struct mfrc522_ioc_batch {
+	__u64 cmds;
+	__u32 count;
+	__u32 reserved;
+};
+
+/*
+ * Execute a command and get its answer back in the same call. The ioctl itself
+ * only fails if the request is malformed: command failures are reported through
+ * the status field.
+ */
+#define MFRC522_IOC_EXEC _IOWR(MFRC522_IOC_MAGIC, 0x01, struct mfrc522_ioc_cmd)
+/*
+ * Execute a batch of commands. Nothing runs if any request is malformed.
+ */
+#define MFRC522_IOC_BATCH _IOW(MFRC522_IOC_MAGIC, 0x02, struct mfrc522_ioc_batch)
+
+#endif /* _UAPI_LINUX_MFRC522_H */
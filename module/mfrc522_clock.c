@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/kernel.h>
+#include <linux/regmap.h>
+#include <linux/spi/spi.h>
+#include <linux/string.h>
+
+#include "mfrc522_clock.h"
+#include "mfrc522_pipeline.h"
+#include "mfrc522_spi.h"
+#include "mfrc522_user_command.h"
+
+// Each speed is checked with as many different patterns
+#define MFRC522_CLOCK_ROUNDS 4
+
+// Speeds tried by calibration, up to the 10 Mbit/s of section 8.1.2
+static const u32 mfrc522_clock_steps[] = {
+	1000000, 2000000, 3000000, 4000000, 5000000, 6000000, 8000000, 10000000,
+};
+
+int mfrc522_clock_set(struct mfrc522_state *state, u32 hz)
+{
+	struct spi_device *spi = state->spi;
+	u32 old_hz = spi->max_speed_hz;
+	int ret;
+
+	if (!hz || hz > state->spi_max_hz)
+		return -EINVAL;
+
+	spi->max_speed_hz = hz;
+	ret = spi_setup(spi);
+	if (ret < 0)
+		spi->max_speed_hz = old_hz;
+
+	return ret;
+}
+
+/**
+ * Fill a buffer with one of the calibration patterns: every line toggling on each
+ * byte, alternating bits, a walking one, and a counter
+ */
+static void mfrc522_clock_pattern(u8 *buf, size_t len, unsigned int round)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		switch (round) {
+		case 0:
+			buf[i] = i & 1 ? 0x00 : 0xFF;
+			break;
+		case 1:
+			buf[i] = i & 1 ? 0x55 : 0xAA;
+			break;
+		case 2:
+			buf[i] = BIT(i & 7);
+			break;
+		default:
+			buf[i] = i * 0x1D + 0x52;
+		}
+	}
+}
+
+/**
+ * Send a pattern through a full FIFO and through the internal memory, and read
+ * VersionReg in between, all at the current clock speed
+ *
+ * @param state Device to talk to
+ * @param round Pattern to use
+ * @param version Expected content of VersionReg
+ *
+ * @return 0 if everything came back unchanged, -EIO if not, another negative
+ *         number on error
+ */
+static int mfrc522_clock_check(struct mfrc522_state *state, unsigned int round,
+			       u8 version)
+{
+	u8 pattern[MFRC522_MAX_FIFO_SIZE];
+	struct mfrc522_pipeline *p;
+	u8 *fifo_level;
+	u8 *mem_level;
+	u8 *fifo;
+	u8 *mem;
+	u8 *ver;
+	int ret;
+
+	mfrc522_clock_pattern(pattern, sizeof(pattern), round);
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	mfrc522_pipeline_write(p, MFRC522_FIFO_LEVEL_REG,
+			       MFRC522_FIFO_LEVEL_REG_FLUSH);
+	mfrc522_pipeline_write_burst(p, MFRC522_FIFO_DATA_REG, pattern,
+				     sizeof(pattern));
+	fifo_level = mfrc522_pipeline_read(p, MFRC522_FIFO_LEVEL_REG, 1);
+	fifo = mfrc522_pipeline_read(p, MFRC522_FIFO_DATA_REG, sizeof(pattern));
+	ver = mfrc522_pipeline_read(p, MFRC522_VERSION_REG, 1);
+
+	// The memory gets the end of the pattern, which differs from its start
+	mfrc522_queue_mem_write(p, pattern + sizeof(pattern) - MFRC522_MEM_SIZE);
+	mfrc522_queue_mem_read(p, &mem_level, &mem);
+
+	ret = mfrc522_pipeline_run(p);
+	if (ret < 0)
+		goto out;
+
+	if ((*fifo_level & MFRC522_FIFO_LEVEL_REG_LEVEL_MASK) != sizeof(pattern) ||
+	    memcmp(fifo, pattern, sizeof(pattern)) || *ver != version ||
+	    (*mem_level & MFRC522_FIFO_LEVEL_REG_LEVEL_MASK) != MFRC522_MEM_SIZE ||
+	    memcmp(mem, pattern + sizeof(pattern) - MFRC522_MEM_SIZE,
+		   MFRC522_MEM_SIZE))
+		ret = -EIO;
+
+out:
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+/**
+ * Read VersionReg and the internal memory, at the current clock speed
+ */
+static int mfrc522_clock_save(struct mfrc522_state *state, u8 *version,
+			      u8 *saved)
+{
+	struct mfrc522_pipeline *p;
+	u8 *level;
+	u8 *data;
+	u8 *ver;
+	int ret;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	ver = mfrc522_pipeline_read(p, MFRC522_VERSION_REG, 1);
+	mfrc522_queue_mem_read(p, &level, &data);
+
+	ret = mfrc522_pipeline_run(p);
+	if (!ret && (*level & MFRC522_FIFO_LEVEL_REG_LEVEL_MASK) != MFRC522_MEM_SIZE)
+		ret = -EIO;
+	if (!ret) {
+		*version = *ver;
+		memcpy(saved, data, MFRC522_MEM_SIZE);
+	}
+
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+/**
+ * Write the internal memory back, at the current clock speed
+ */
+static int mfrc522_clock_restore(struct mfrc522_state *state, const u8 *saved)
+{
+	struct mfrc522_pipeline *p;
+	int ret;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	mfrc522_queue_mem_write(p, saved);
+	ret = mfrc522_pipeline_run(p);
+
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+int mfrc522_clock_calibrate(struct mfrc522_state *state)
+{
+	u8 saved[MFRC522_MEM_SIZE];
+	bool failed = false;
+	u32 chosen = 0;
+	u32 prev = 0;
+	unsigned int round;
+	unsigned int i;
+	u8 version;
+	u32 hz;
+	int ret;
+
+	ret = mfrc522_clock_set(state, MFRC522_SPI_SAFE_CLOCK_SPEED);
+	if (ret < 0)
+		return ret;
+
+	ret = mfrc522_clock_save(state, &version, saved);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < ARRAY_SIZE(mfrc522_clock_steps); i++) {
+		hz = min(mfrc522_clock_steps[i], state->spi_max_hz);
+		if (hz <= chosen)
+			break;
+
+		ret = mfrc522_clock_set(state, hz);
+		for (round = 0; !ret && round < MFRC522_CLOCK_ROUNDS; round++)
+			ret = mfrc522_clock_check(state, round, version);
+
+		if (ret < 0) {
+			dev_dbg(&state->spi->dev, "SPI clock check failed at %u Hz: %d\n",
+				hz, ret);
+			failed = true;
+			break;
+		}
+
+		prev = chosen;
+		chosen = hz;
+	}
+
+	// A speed passing right below one which failed is close to the edge, and
+	// may fail once the temperature or the supply changes. Passing every step
+	// up to the device tree's limit needs no margin
+	if (failed) {
+		chosen = prev ?: chosen;
+
+		// A garbled address may have hit a register other than the
+		// intended one, so the register cache is pushed back to the chip
+		ret = mfrc522_clock_set(state, MFRC522_SPI_SAFE_CLOCK_SPEED);
+		if (!ret) {
+			regcache_mark_dirty(state->regmap);
+			ret = regcache_sync(state->regmap);
+		}
+		if (ret < 0)
+			return ret;
+	}
+
+	if (!chosen) {
+		dev_warn(&state->spi->dev,
+			 "MFRC522 unreliable at %u Hz, keeping that speed anyway\n",
+			 MFRC522_SPI_SAFE_CLOCK_SPEED);
+		chosen = MFRC522_SPI_SAFE_CLOCK_SPEED;
+	}
+
+	ret = mfrc522_clock_set(state, chosen);
+	if (!ret)
+		ret = mfrc522_clock_restore(state, saved);
+	if (ret < 0) {
+		mfrc522_clock_set(state, MFRC522_SPI_SAFE_CLOCK_SPEED);
+		return ret;
+	}
+
+	dev_info(&state->spi->dev, "SPI clock set to %u Hz\n", chosen);
+
+	return chosen;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_CLOCK_H
+#define MFRC522_CLOCK_H
+
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+/**
+ * Change the SPI clock used to talk to the MFRC522
+ *
+ * @param state Device to talk to
+ * @param hz New clock speed, at most the speed allowed by the device tree
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_clock_set(struct mfrc522_state *state, u32 hz);
+
+/**
+ * Step the SPI clock up from MFRC522_SPI_SAFE_CLOCK_SPEED to the speed allowed by
+ * the device tree, checking at each step that known patterns go through the FIFO
+ * and the internal memory unchanged. Keep the fastest speed which passed, minus a
+ * step of safety margin if a faster one failed. The content of the internal
+ * memory is preserved. Must be called with the device's lock held
+ *
+ * @param state Device to talk to
+ *
+ * @return The chosen clock speed on success, a negative number on error, in which
+ *         case the clock is back to MFRC522_SPI_SAFE_CLOCK_SPEED
+ */
+int mfrc522_clock_calibrate(struct mfrc522_state *state);
+
+#endif /* ! MFRC522_CLOCK_H */
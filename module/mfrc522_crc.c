@@ -0,0 +1,227 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/crc-ccitt.h>
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/regmap.h>
+#include <linux/seq_file.h>
+
+#include "mfrc522_crc.h"
+#include "mfrc522_pipeline.h"
+#include "mfrc522_pm.h"
+#include "mfrc522_spi.h"
+
+// Measuring the coprocessor costs SPI messages, so probing only does a few rounds
+#define MFRC522_CRC_CALIBRATION_ROUNDS 4
+#define MFRC522_CRC_BENCH_HW_ROUNDS 64
+#define MFRC522_CRC_BENCH_SW_ROUNDS 4096
+
+// Frame lengths at which both ways are measured, from HLTA to a full FIFO
+static const size_t mfrc522_crc_lengths[] = {
+	2, 7, 16, 32, MFRC522_MAX_FIFO_SIZE,
+};
+
+/**
+ * Cost of computing the CRC_A of a frame of a given length, in nanoseconds
+ */
+struct mfrc522_crc_cost {
+	u64 sw_ns;
+	u64 hw_ns;
+	int hw_status;
+};
+
+u16 mfrc522_crc_a_sw(const u8 *buf, size_t len)
+{
+	return crc_ccitt(MFRC522_CRC_A_PRESET, buf, len);
+}
+
+int mfrc522_crc_a_hw(struct mfrc522_state *state, const u8 *buf, size_t len,
+		     u16 *crc)
+{
+	u8 idle = mfrc522_command_byte(MFRC522_COMMAND_REG_RCV_ON,
+				       MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+				       MFRC522_COMMAND_IDLE);
+	struct mfrc522_pipeline *p;
+	u8 *div_irq;
+	u8 *msb;
+	u8 *lsb;
+	int ret;
+
+	if (len > MFRC522_MAX_FIFO_SIZE)
+		return -EINVAL;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	mfrc522_pipeline_write(p, MFRC522_COMMAND_REG, idle);
+	mfrc522_pipeline_write(p, MFRC522_DIV_IRQ_REG, MFRC522_DIV_IRQ_CRC);
+	mfrc522_pipeline_write(p, MFRC522_FIFO_LEVEL_REG,
+			       MFRC522_FIFO_LEVEL_REG_FLUSH);
+	mfrc522_pipeline_write_burst(p, MFRC522_FIFO_DATA_REG, buf, len);
+	mfrc522_pipeline_write(p, MFRC522_COMMAND_REG,
+			       mfrc522_command_byte(MFRC522_COMMAND_REG_RCV_ON,
+						    MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+						    MFRC522_COMMAND_CALC_CRC));
+
+	// CalcCRC never ends by itself, see 10.3.1.4. The coprocessor processes the
+	// whole FIFO while the next register accesses are being clocked out, so
+	// its result is read and the command stopped in the same message. CRCIRq
+	// tells whether the result was ready in time
+	div_irq = mfrc522_pipeline_read(p, MFRC522_DIV_IRQ_REG, 1);
+	msb = mfrc522_pipeline_read(p, MFRC522_CRC_RESULT_MSB_REG, 1);
+	lsb = mfrc522_pipeline_read(p, MFRC522_CRC_RESULT_LSB_REG, 1);
+	mfrc522_pipeline_write(p, MFRC522_COMMAND_REG, idle);
+
+	ret = mfrc522_pipeline_run(p);
+	if (!ret && !(*div_irq & MFRC522_DIV_IRQ_CRC))
+		ret = -EBUSY;
+	if (!ret)
+		*crc = *msb << 8 | *lsb;
+
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+u16 mfrc522_crc_a(struct mfrc522_state *state, const u8 *buf, size_t len)
+{
+	unsigned int hw_min_len = state->crc_hw_min_len;
+	u16 crc;
+
+	if (hw_min_len && len >= hw_min_len && len <= MFRC522_MAX_FIFO_SIZE &&
+	    !mfrc522_crc_a_hw(state, buf, len, &crc))
+		return crc;
+
+	return mfrc522_crc_a_sw(buf, len);
+}
+
+/**
+ * Measure the average cost of both ways of computing the CRC_A of a frame. The
+ * coprocessor's result is checked against the CPU's
+ *
+ * @param state Device to talk to
+ * @param len Length of the frame
+ * @param sw_rounds Amount of CRC_A computed on the CPU
+ * @param hw_rounds Amount of CRC_A computed by the coprocessor
+ * @param cost Filled with the average cost of each way
+ */
+static void mfrc522_crc_measure(struct mfrc522_state *state, size_t len,
+				unsigned int sw_rounds, unsigned int hw_rounds,
+				struct mfrc522_crc_cost *cost)
+{
+	u8 frame[MFRC522_MAX_FIFO_SIZE];
+	u16 expected = 0;
+	u16 crc;
+	u64 start;
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		frame[i] = i * 0x1D + 0x52;
+
+	start = ktime_get_ns();
+	for (i = 0; i < sw_rounds; i++)
+		expected = mfrc522_crc_a_sw(frame, len);
+	cost->sw_ns = (ktime_get_ns() - start) / sw_rounds;
+
+	cost->hw_status = 0;
+	start = ktime_get_ns();
+	for (i = 0; i < hw_rounds && !cost->hw_status; i++) {
+		cost->hw_status = mfrc522_crc_a_hw(state, frame, len, &crc);
+		if (!cost->hw_status && crc != expected)
+			cost->hw_status = -EIO;
+	}
+	cost->hw_ns = (ktime_get_ns() - start) / hw_rounds;
+}
+
+int mfrc522_crc_init(struct mfrc522_state *state)
+{
+	struct mfrc522_crc_cost cost;
+	int ret;
+	int i;
+
+	ret = mfrc522_register_update_bits(state, MFRC522_MODE_REG,
+					   MFRC522_MODE_REG_CRC_PRESET_MASK,
+					   MFRC522_MODE_REG_CRC_PRESET_6363);
+	if (ret < 0)
+		return ret;
+
+	// The coprocessor only pays off for frames long enough for its SPI
+	// overhead to be cheaper than the CPU's work, so look for the shortest
+	// length from which it is faster every time
+	state->crc_hw_min_len = 0;
+
+	for (i = ARRAY_SIZE(mfrc522_crc_lengths) - 1; i >= 0; i--) {
+		mfrc522_crc_measure(state, mfrc522_crc_lengths[i],
+				    MFRC522_CRC_CALIBRATION_ROUNDS,
+				    MFRC522_CRC_CALIBRATION_ROUNDS, &cost);
+
+		if (cost.hw_status == -EIO)
+			dev_warn(&state->spi->dev,
+				 "CRC coprocessor disagrees with the CPU\n");
+
+		if (cost.hw_status || cost.hw_ns >= cost.sw_ns)
+			break;
+
+		state->crc_hw_min_len = mfrc522_crc_lengths[i];
+	}
+
+	if (state->crc_hw_min_len)
+		dev_info(&state->spi->dev,
+			 "Computing CRC_A of frames from %u bytes on the MFRC522\n",
+			 state->crc_hw_min_len);
+
+	return 0;
+}
+
+static int mfrc522_crc_bench_show(struct seq_file *s, void *unused)
+{
+	struct mfrc522_state *state = s->private;
+	struct mfrc522_crc_cost cost;
+	size_t len;
+	bool hw;
+	int ret;
+	int i;
+
+	ret = mfrc522_pm_get(state);
+	if (ret < 0)
+		return ret;
+
+	ret = mutex_lock_interruptible(&state->lock);
+	if (ret) {
+		mfrc522_pm_put(state);
+		return ret;
+	}
+
+	seq_printf(s, "%6s %12s %12s %9s\n", "length", "software_ns",
+		   "hardware_ns", "selected");
+
+	for (i = 0; i < ARRAY_SIZE(mfrc522_crc_lengths); i++) {
+		len = mfrc522_crc_lengths[i];
+		mfrc522_crc_measure(state, len, MFRC522_CRC_BENCH_SW_ROUNDS,
+				    MFRC522_CRC_BENCH_HW_ROUNDS, &cost);
+
+		seq_printf(s, "%6zu %12llu ", len, cost.sw_ns);
+		if (cost.hw_status)
+			seq_printf(s, "%12d ", cost.hw_status);
+		else
+			seq_printf(s, "%12llu ", cost.hw_ns);
+
+		hw = state->crc_hw_min_len && len >= state->crc_hw_min_len;
+		seq_printf(s, "%9s\n", hw ? "hardware" : "software");
+	}
+
+	mutex_unlock(&state->lock);
+	mfrc522_pm_put(state);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(mfrc522_crc_bench);
+
+void mfrc522_crc_debugfs_init(struct mfrc522_state *state)
+{
+	debugfs_create_file("crc_bench", 0400, state->debugfs, state,
+			    &mfrc522_crc_bench_fops);
+}
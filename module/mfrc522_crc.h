@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_CRC_H
+#define MFRC522_CRC_H
+
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+// CRC_A is the ITU-T V.41 CRC, sent LSB first and preset to 0x6363
+#define MFRC522_CRC_A_PRESET 0x6363
+#define MFRC522_CRC_A_SIZE 2
+
+/**
+ * Setup the MFRC522's CRC coprocessor for CRC_A, and measure which of the
+ * coprocessor and the CPU computes CRC_A faster, depending on the frame's length
+ *
+ * @param state Device to talk to
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_crc_init(struct mfrc522_state *state);
+
+/**
+ * Compute the CRC_A of a frame on the CPU
+ *
+ * @param buf Frame to compute the CRC_A of
+ * @param len Length of the frame
+ *
+ * @return The CRC_A of the frame
+ */
+u16 mfrc522_crc_a_sw(const u8 *buf, size_t len);
+
+/**
+ * Compute the CRC_A of a frame using the MFRC522's CalcCRC command, in a single
+ * SPI message. Must be called with the device's lock held
+ *
+ * @param state Device to talk to
+ * @param buf Frame to compute the CRC_A of
+ * @param len Length of the frame, at most MFRC522_MAX_FIFO_SIZE
+ * @param crc Filled with the CRC_A of the frame
+ *
+ * @return 0 on success, -EBUSY if the coprocessor was not done by the time its
+ *         result was read, another negative number on error
+ */
+int mfrc522_crc_a_hw(struct mfrc522_state *state, const u8 *buf, size_t len,
+		     u16 *crc);
+
+/**
+ * Compute the CRC_A of a frame, using whichever of the coprocessor and the CPU
+ * was measured to be faster for frames of that length. Must be called with the
+ * device's lock held
+ *
+ * @param state Device to talk to
+ * @param buf Frame to compute the CRC_A of
+ * @param len Length of the frame
+ *
+ * @return The CRC_A of the frame
+ */
+u16 mfrc522_crc_a(struct mfrc522_state *state, const u8 *buf, size_t len);
+
+/**
+ * Append the CRC_A of a frame to it, LSB first
+ *
+ * @param state Device to talk to
+ * @param buf Frame, with room for MFRC522_CRC_A_SIZE more bytes
+ * @param len Length of the frame, CRC_A excluded
+ */
+static inline void mfrc522_crc_a_append(struct mfrc522_state *state, u8 *buf,
+					size_t len)
+{
+	u16 crc = mfrc522_crc_a(state, buf, len);
+
+	buf[len] = crc & 0xFF;
+	buf[len + 1] = crc >> 8;
+}
+
+/**
+ * Check the CRC_A at the end of a received frame. Running the CRC over a frame
+ * and its CRC gives 0
+ *
+ * @param state Device to talk to
+ * @param buf Frame, CRC_A included
+ * @param len Length of the frame, CRC_A included
+ */
+static inline bool mfrc522_crc_a_valid(struct mfrc522_state *state,
+				       const u8 *buf, size_t len)
+{
+	return len >= MFRC522_CRC_A_SIZE && !mfrc522_crc_a(state, buf, len);
+}
+
+/**
+ * Create the crc_bench debugfs file of a device. Reading it measures both ways of
+ * computing CRC_A at several frame lengths
+ *
+ * @param state Device whose debugfs directory is set up
+ */
+void mfrc522_crc_debugfs_init(struct mfrc522_state *state);
+
+#endif /* ! MFRC522_CRC_H */
@@ -4,6 +4,8 @@
 
 #include "mfrc522_debug.h"
 
+DEFINE_STATIC_KEY_FALSE(mfrc522_debug_key);
+
 static void __print_bytes(const char *bytes, int len)
 {
 	int i;
@@ -40,6 +42,19 @@ static void do_debug_write(const char *cmd)
 	__print_bytes(cmd, strlen(cmd));
 }
 
+void mfrc522_debug_enable(struct mfrc522_state *state, bool on)
+{
+	if (state->debug_on == on)
+		return;
+
+	state->debug_on = on;
+
+	if (on)
+		static_branch_inc(&mfrc522_debug_key);
+	else
+		static_branch_dec(&mfrc522_debug_key);
+}
+
 void do_debug(const struct mfrc522_command *cmd, const char *answer,
 	      int answer_size)
 {
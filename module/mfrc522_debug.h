@@ -3,8 +3,33 @@
 #ifndef MFRC522_DEBUG
 #define MFRC522_DEBUG
 
+#include <linux/jump_label.h>
+
 #include "mfrc522_user_command.h"
 
+// Enabled while at least one device has debug on, so that commands do not even
+// check it otherwise
+DECLARE_STATIC_KEY_FALSE(mfrc522_debug_key);
+
+/**
+ * Turn the debug output of a device on or off. Must be called with the device's
+ * lock held
+ *
+ * @param state Device to update
+ * @param on Whether to show debug information about the device's commands
+ */
+void mfrc522_debug_enable(struct mfrc522_state *state, bool on);
+
+/**
+ * Check whether debug information should be shown about a device's commands
+ *
+ * @param state Device which ran a command
+ */
+static inline bool mfrc522_debug_on(struct mfrc522_state *state)
+{
+	return static_branch_unlikely(&mfrc522_debug_key) && state->debug_on;
+}
+
 /**
  * Show debug information based on the given MFRC522 command
  *
@@ -0,0 +1,1082 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Software model of the MFRC522, registered as an SPI controller with one
+ * MFRC522 per chip select, so that the driver can be exercised and benchmarked
+ * without a reader. The register file, the FIFO, the internal memory, the
+ * duration of commands, the timer, the CRC coprocessor and an optional virtual
+ * ISO/IEC 14443 type A PICC in the field are modeled. Frames are exchanged in
+ * plain text, MFAuthent only checks the key, and there is no interrupt line, so
+ * the driver polls the model
+ */
+
+#include <linux/crc-ccitt.h>
+#include <linux/delay.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/random.h>
+#include <linux/spi/spi.h>
+#include <linux/string.h>
+
+#include "mfrc522_spi.h"
+
+#define EMU_NAME "mfrc522-emu"
+#define EMU_MAX_READERS 4
+#define EMU_MAX_SPEED_HZ 10000000
+#define EMU_REGISTERS 0x40
+#define EMU_MEM_SIZE 25
+#define EMU_RANDOM_ID_SIZE 10
+#define EMU_VERSION 0x92
+
+// Durations of the MFRC522's own work. The datasheet does not give any, so they
+// are rough guesses, short enough for the driver not to notice them
+#define EMU_MEM_NS 2000
+#define EMU_RANDOM_ID_NS 10000
+#define EMU_CRC_NS_PER_BYTE 600
+#define EMU_WAKE_UP_NS 100000
+
+// ISO/IEC 14443 type A timings at 106kbit/s. A bit lasts 128 periods of the
+// 13.56MHz carrier, a byte 9 bits with its parity, and a frame has a start and
+// an end of communication
+#define EMU_CARRIER_HZ 13560000
+#define EMU_BIT_NS 9440
+#define EMU_FDT_NS 86000
+// MIFARE Classic and NTAG PICCs only acknowledge a write once it is programmed
+#define EMU_PICC_WRITE_NS 4100000
+
+
+// ISO/IEC 14443-3 and PICC commands
+#define PICC_WUPA 0x52
+#define PICC_REQA 0x26
+#define PICC_HLTA 0x50
+#define PICC_SEL_CL1 0x93
+#define PICC_SEL_CL2 0x95
+#define PICC_SEL_CL3 0x97
+#define PICC_NVB_ANTICOLL 0x20
+#define PICC_NVB_SELECT 0x70
+#define PICC_CASCADE_TAG 0x88
+#define PICC_SAK_INCOMPLETE 0x04
+#define PICC_READ 0x30
+#define PICC_FAST_READ 0x3A
+#define PICC_WRITE 0xA0
+#define PICC_AUTH_A 0x60
+#define PICC_AUTH_B 0x61
+#define PICC_ACK 0x0A
+#define PICC_NAK 0x00
+#define PICC_CRC_A_PRESET 0x6363
+
+#define PICC_MAX_MEM_SIZE 1024
+#define NTAG216_PAGES 231
+#define MFC1K_BLOCKS 64
+#define MFC_BLOCK_SIZE 16
+#define MFC_KEY_SIZE 6
+#define MFC_AUTH_SIZE (2 + MFC_KEY_SIZE + 4)
+
+enum emu_picc_type {
+	EMU_PICC_NONE,
+	EMU_PICC_NTAG216,
+	EMU_PICC_MFC1K,
+};
+
+static const char *const emu_picc_names[] = {
+	[EMU_PICC_NONE] = "none",
+	[EMU_PICC_NTAG216] = "ntag216",
+	[EMU_PICC_MFC1K] = "mfc1k",
+};
+
+enum emu_picc_state {
+	EMU_PICC_IDLE,
+	EMU_PICC_READY,
+	EMU_PICC_ACTIVE,
+	EMU_PICC_HALT,
+};
+
+/**
+ * Virtual PICC in the field of a reader
+ */
+struct emu_picc {
+	enum emu_picc_type type;
+	enum emu_picc_state state;
+	u8 uid[7];
+	u8 uid_size;
+	u8 atqa[2];
+	u8 sak;
+	// Cascade level being resolved while READY
+	unsigned int level;
+	int auth_sector;
+	int write_block;
+	u8 mem[PICC_MAX_MEM_SIZE];
+	size_t mem_size;
+};
+
+/**
+ * Answer of a PICC to a frame
+ */
+struct emu_answer {
+	u8 data[MFRC522_MAX_FIFO_SIZE];
+	size_t len;
+	// Amount of valid bits of the last byte, 0 for all 8
+	u8 last_bits;
+	u64 delay_ns;
+};
+
+/**
+ * What happens once the command currently running is over, or its timer
+ * expires: the ComIrqReg and DivIrqReg bits raised, the data pushed into the
+ * FIFO, and whether the MFRC522 goes back to idle
+ */
+struct emu_event {
+	bool pending;
+	u64 time_ns;
+	u8 com_irq;
+	u8 div_irq;
+	bool idle;
+	u8 status_2;
+	struct emu_answer answer;
+};
+
+/**
+ * Model of one MFRC522
+ */
+struct emu_chip {
+	u8 regs[EMU_REGISTERS];
+	u8 fifo[MFRC522_MAX_FIFO_SIZE];
+	unsigned int fifo_level;
+	u8 mem[EMU_MEM_SIZE];
+	u64 wake_up_ns;
+	struct emu_event event;
+	struct emu_picc picc;
+};
+
+struct emu {
+	struct mutex lock;
+	struct platform_device *pdev;
+	struct spi_master *master;
+	struct spi_device *spi[EMU_MAX_READERS];
+	struct emu_chip chips[EMU_MAX_READERS];
+};
+
+static struct emu *emu;
+
+static unsigned int readers = 1;
+module_param(readers, uint, 0444);
+MODULE_PARM_DESC(readers, "Amount of emulated MFRC522, one per chip select");
+
+static bool model_bus_time = true;
+module_param(model_bus_time, bool, 0644);
+MODULE_PARM_DESC(model_bus_time,
+		 "Take as long as a real SPI bus to complete transfers");
+
+static unsigned int max_reliable_hz;
+module_param(max_reliable_hz, uint, 0644);
+MODULE_PARM_DESC(max_reliable_hz,
+		 "Corrupt data read faster than this SPI clock, as a long cable would (0: never)");
+
+static enum emu_picc_type picc_type = EMU_PICC_NONE;
+
+static u16 emu_crc_a(u16 preset, const u8 *buf, size_t len)
+{
+	return crc_ccitt(preset, buf, len);
+}
+
+static u64 emu_frame_ns(size_t len, u8 last_bits)
+{
+	size_t bits = last_bits ? (len - 1) * 9 + last_bits : len * 9;
+
+	return (bits + 2) * EMU_BIT_NS;
+}
+
+/**
+ * Get the timeout of the MFRC522's timer, as set by TModeReg, TPrescalerReg and
+ * TReloadReg, see 9.3.3.10
+ */
+static u64 emu_timer_ns(struct emu_chip *chip)
+{
+	u64 prescaler = (chip->regs[MFRC522_T_MODE_REG] &
+			 MFRC522_T_MODE_REG_PRESCALER_HI_MASK) << 8 |
+			chip->regs[MFRC522_T_PRESCALER_REG];
+	u64 reload = chip->regs[MFRC522_T_RELOAD_MSB_REG] << 8 |
+		     chip->regs[MFRC522_T_RELOAD_LSB_REG];
+
+	return div_u64((2 * prescaler + 1) * (reload + 1) * NSEC_PER_SEC,
+		       EMU_CARRIER_HZ);
+}
+
+static void emu_fifo_push(struct emu_chip *chip, const u8 *buf, size_t len)
+{
+	size_t room = MFRC522_MAX_FIFO_SIZE - chip->fifo_level;
+
+	if (len > room) {
+		chip->regs[MFRC522_ERROR_REG] |= MFRC522_ERROR_BUFFER_OVFL;
+		len = room;
+	}
+
+	memcpy(chip->fifo + chip->fifo_level, buf, len);
+	chip->fifo_level += len;
+}
+
+static u8 emu_fifo_pop(struct emu_chip *chip)
+{
+	u8 value;
+
+	if (!chip->fifo_level)
+		return 0;
+
+	value = chip->fifo[0];
+	memmove(chip->fifo, chip->fifo + 1, --chip->fifo_level);
+
+	return value;
+}
+
+static void emu_picc_init(struct emu_picc *picc, enum emu_picc_type type)
+{
+	unsigned int i;
+	u8 *trailer;
+
+	memset(picc, 0, sizeof(*picc));
+	picc->type = type;
+	picc->auth_sector = -1;
+	picc->write_block = -1;
+
+	switch (type) {
+	case EMU_PICC_NTAG216:
+		picc->uid_size = 7;
+		get_random_bytes(picc->uid + 1, 6);
+		picc->uid[0] = 0x04; // NXP
+		picc->atqa[0] = 0x44;
+		picc->sak = 0x00;
+		picc->mem_size = NTAG216_PAGES * 4;
+
+		// UID and its check bytes, then the capability container
+		memcpy(picc->mem, picc->uid, 3);
+		picc->mem[3] = PICC_CASCADE_TAG ^ picc->uid[0] ^ picc->uid[1] ^
+			       picc->uid[2];
+		memcpy(picc->mem + 4, picc->uid + 3, 4);
+		picc->mem[8] = picc->uid[3] ^ picc->uid[4] ^ picc->uid[5] ^
+			       picc->uid[6];
+		picc->mem[12] = 0xE1;
+		picc->mem[13] = 0x10;
+		picc->mem[14] = 0x6D;
+		break;
+	case EMU_PICC_MFC1K:
+		picc->uid_size = 4;
+		get_random_bytes(picc->uid, 4);
+		picc->atqa[0] = 0x04;
+		picc->sak = 0x08;
+		picc->mem_size = MFC1K_BLOCKS * MFC_BLOCK_SIZE;
+
+		// Manufacturer block, then transport keys and access conditions
+		memcpy(picc->mem, picc->uid, 4);
+		picc->mem[4] = picc->uid[0] ^ picc->uid[1] ^ picc->uid[2] ^
+			       picc->uid[3];
+		picc->mem[5] = picc->sak;
+		for (i = 3; i < MFC1K_BLOCKS; i += 4) {
+			trailer = picc->mem + i * MFC_BLOCK_SIZE;
+			memset(trailer, 0xFF, MFC_BLOCK_SIZE);
+			trailer[6] = 0xFF;
+			trailer[7] = 0x07;
+			trailer[8] = 0x80;
+			trailer[9] = 0x69;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void emu_answer_set(struct emu_answer *answer, const u8 *data,
+			   size_t len, bool crc)
+{
+	u16 value;
+
+	memcpy(answer->data, data, len);
+	answer->len = len;
+	answer->last_bits = 0;
+
+	if (crc) {
+		value = emu_crc_a(PICC_CRC_A_PRESET, data, len);
+		answer->data[len] = value & 0xFF;
+		answer->data[len + 1] = value >> 8;
+		answer->len += 2;
+	}
+}
+
+static void emu_answer_ack(struct emu_answer *answer, u8 ack)
+{
+	answer->data[0] = ack;
+	answer->len = 1;
+	answer->last_bits = 4;
+}
+
+/**
+ * Get the UID bytes of a cascade level, followed by their BCC
+ */
+static void emu_picc_cascade_level(struct emu_picc *picc, unsigned int level,
+				   u8 *cl)
+{
+	if (picc->uid_size == 4) {
+		memcpy(cl, picc->uid, 4);
+	} else if (!level) {
+		cl[0] = PICC_CASCADE_TAG;
+		memcpy(cl + 1, picc->uid, 3);
+	} else {
+		memcpy(cl, picc->uid + 3, 4);
+	}
+
+	cl[4] = cl[0] ^ cl[1] ^ cl[2] ^ cl[3];
+}
+
+/**
+ * Handle a frame sent to a READY PICC: the anticollision and selection loops
+ *
+ * @return Whether the PICC answered
+ */
+static bool emu_picc_select(struct emu_picc *picc, const u8 *frame, size_t len,
+			    struct emu_answer *answer)
+{
+	static const u8 sel[] = { PICC_SEL_CL1, PICC_SEL_CL2, PICC_SEL_CL3 };
+	unsigned int levels = picc->uid_size == 4 ? 1 : 2;
+	u8 cl[5];
+	u8 sak;
+
+	if (len < 2 || picc->level >= levels || frame[0] != sel[picc->level])
+		return false;
+
+	emu_picc_cascade_level(picc, picc->level, cl);
+
+	// Alone in the field, the PICC never sees a partial UID
+	if (frame[1] == PICC_NVB_ANTICOLL && len == 2) {
+		emu_answer_set(answer, cl, sizeof(cl), false);
+		return true;
+	}
+
+	if (frame[1] != PICC_NVB_SELECT || len != 2 + sizeof(cl) + 2 ||
+	    emu_crc_a(PICC_CRC_A_PRESET, frame, len) ||
+	    memcmp(frame + 2, cl, sizeof(cl)))
+		return false;
+
+	if (++picc->level == levels) {
+		picc->state = EMU_PICC_ACTIVE;
+		sak = picc->sak;
+	} else {
+		sak = PICC_SAK_INCOMPLETE;
+	}
+
+	emu_answer_set(answer, &sak, 1, true);
+
+	return true;
+}
+
+static unsigned int emu_mfc_sector(unsigned int block)
+{
+	return block / 4;
+}
+
+/**
+ * Handle a frame sent to an ACTIVE NTAG216
+ *
+ * @return Whether the PICC answered
+ */
+static bool emu_ntag_frame(struct emu_picc *picc, const u8 *frame, size_t len,
+			   struct emu_answer *answer)
+{
+	unsigned int pages = picc->mem_size / 4;
+	unsigned int first = frame[1];
+	unsigned int last;
+	unsigned int i;
+
+	switch (frame[0]) {
+	case PICC_READ:
+		if (len != 4 || first >= pages)
+			break;
+
+		// READ wraps around at the end of the memory
+		for (i = 0; i < MFC_BLOCK_SIZE; i++)
+			answer->data[i] = picc->mem[(first * 4 + i) %
+						    picc->mem_size];
+		emu_answer_set(answer, answer->data, MFC_BLOCK_SIZE, true);
+		return true;
+	case PICC_FAST_READ:
+		last = frame[2];
+		if (len != 5 || first > last || last >= pages ||
+		    (last - first + 1) * 4 + 2 > MFRC522_MAX_FIFO_SIZE)
+			break;
+
+		emu_answer_set(answer, picc->mem + first * 4,
+			       (last - first + 1) * 4, true);
+		return true;
+	default:
+		break;
+	}
+
+	emu_answer_ack(answer, PICC_NAK);
+	picc->state = EMU_PICC_IDLE;
+
+	return true;
+}
+
+/**
+ * Handle a frame sent to an ACTIVE MIFARE Classic 1K, authenticated or not
+ *
+ * @return Whether the PICC answered
+ */
+static bool emu_mfc_frame(struct emu_picc *picc, const u8 *frame, size_t len,
+			  struct emu_answer *answer)
+{
+	unsigned int block = frame[1];
+	u8 data[MFC_BLOCK_SIZE];
+
+	// Second part of a WRITE
+	if (picc->write_block >= 0) {
+		block = picc->write_block;
+		picc->write_block = -1;
+
+		if (len != MFC_BLOCK_SIZE + 2)
+			goto nak;
+
+		memcpy(picc->mem + block * MFC_BLOCK_SIZE, frame,
+		       MFC_BLOCK_SIZE);
+		emu_answer_ack(answer, PICC_ACK);
+		answer->delay_ns = EMU_PICC_WRITE_NS;
+		return true;
+	}
+
+	if (len != 4 || block >= MFC1K_BLOCKS ||
+	    (int)emu_mfc_sector(block) != picc->auth_sector)
+		goto nak;
+
+	switch (frame[0]) {
+	case PICC_READ:
+		memcpy(data, picc->mem + block * MFC_BLOCK_SIZE, MFC_BLOCK_SIZE);
+
+		// Key A is never readable
+		if (block % 4 == 3)
+			memset(data, 0, MFC_KEY_SIZE);
+
+		emu_answer_set(answer, data, MFC_BLOCK_SIZE, true);
+		return true;
+	case PICC_WRITE:
+		if (!block)
+			break;
+
+		picc->write_block = block;
+		emu_answer_ack(answer, PICC_ACK);
+		return true;
+	default:
+		break;
+	}
+
+nak:
+	emu_answer_ack(answer, PICC_NAK);
+	picc->state = EMU_PICC_IDLE;
+	picc->auth_sector = -1;
+
+	return true;
+}
+
+/**
+ * Hand a frame sent by the MFRC522 to the PICC in the field
+ *
+ * @param picc PICC in the field
+ * @param frame Frame sent
+ * @param len Length of the frame
+ * @param last_bits Amount of bits sent of the last byte, 0 for all 8
+ * @param answer Filled with the answer of the PICC
+ *
+ * @return Whether the PICC answered
+ */
+static bool emu_picc_frame(struct emu_picc *picc, const u8 *frame, size_t len,
+			   u8 last_bits, struct emu_answer *answer)
+{
+	answer->delay_ns = 0;
+
+	if (picc->type == EMU_PICC_NONE || !len)
+		return false;
+
+	if (last_bits == 7 && len == 1) {
+		if (frame[0] == PICC_WUPA && picc->state != EMU_PICC_ACTIVE) {
+			picc->state = EMU_PICC_READY;
+		} else if (frame[0] == PICC_REQA &&
+			   picc->state == EMU_PICC_IDLE) {
+			picc->state = EMU_PICC_READY;
+		} else {
+			picc->state = EMU_PICC_IDLE;
+			return false;
+		}
+
+		picc->level = 0;
+		picc->auth_sector = -1;
+		picc->write_block = -1;
+		emu_answer_set(answer, picc->atqa, sizeof(picc->atqa), false);
+		return true;
+	}
+
+	if (picc->state == EMU_PICC_READY)
+		return emu_picc_select(picc, frame, len, answer);
+
+	if (picc->state != EMU_PICC_ACTIVE)
+		return false;
+
+	// Frames sent to a selected PICC carry a CRC_A
+	if (len < 3 || emu_crc_a(PICC_CRC_A_PRESET, frame, len)) {
+		picc->state = EMU_PICC_IDLE;
+		return false;
+	}
+
+	if (frame[0] == PICC_HLTA && len == 4 && picc->write_block < 0) {
+		picc->state = EMU_PICC_HALT;
+		picc->auth_sector = -1;
+		return false;
+	}
+
+	if (picc->type == EMU_PICC_NTAG216)
+		return emu_ntag_frame(picc, frame, len, answer);
+
+	return emu_mfc_frame(picc, frame, len, answer);
+}
+
+/**
+ * Authenticate to a sector of an ACTIVE MIFARE Classic 1K, as MFAuthent does
+ *
+ * @return Whether the authentication succeeded
+ */
+static bool emu_picc_auth(struct emu_picc *picc, const u8 *frame, size_t len)
+{
+	unsigned int block = frame[1];
+	const u8 *trailer;
+	const u8 *key;
+
+	if (picc->type != EMU_PICC_MFC1K || picc->state != EMU_PICC_ACTIVE ||
+	    len != MFC_AUTH_SIZE || block >= MFC1K_BLOCKS ||
+	    (frame[0] != PICC_AUTH_A && frame[0] != PICC_AUTH_B) ||
+	    memcmp(frame + 2 + MFC_KEY_SIZE, picc->uid, 4)) {
+		picc->state = EMU_PICC_IDLE;
+		return false;
+	}
+
+	trailer = picc->mem + (emu_mfc_sector(block) * 4 + 3) * MFC_BLOCK_SIZE;
+	key = frame[0] == PICC_AUTH_A ? trailer : trailer + 10;
+
+	if (memcmp(frame + 2, key, MFC_KEY_SIZE)) {
+		picc->state = EMU_PICC_IDLE;
+		picc->auth_sector = -1;
+		return false;
+	}
+
+	picc->auth_sector = emu_mfc_sector(block);
+
+	return true;
+}
+
+/**
+ * Apply the outcome of the running command if it is due
+ */
+static void emu_advance(struct emu_chip *chip, u64 now)
+{
+	struct emu_event *event = &chip->event;
+
+	if (!event->pending || now < event->time_ns)
+		return;
+
+	event->pending = false;
+
+	chip->regs[MFRC522_COM_IRQ_REG] |= event->com_irq;
+	chip->regs[MFRC522_DIV_IRQ_REG] |= event->div_irq;
+	chip->regs[MFRC522_STATUS_2_REG] |= event->status_2;
+
+	if (event->answer.len) {
+		emu_fifo_push(chip, event->answer.data, event->answer.len);
+		chip->regs[MFRC522_CONTROL_REG] =
+			(chip->regs[MFRC522_CONTROL_REG] &
+			 ~MFRC522_CONTROL_REG_RX_LAST_BITS_MASK) |
+			event->answer.last_bits;
+	}
+
+	if (event->idle)
+		chip->regs[MFRC522_COMMAND_REG] &=
+			~MFRC522_COMMAND_REG_COMMAND_MASK;
+}
+
+static void emu_schedule(struct emu_chip *chip, u64 time_ns, u8 com_irq,
+			 bool idle)
+{
+	struct emu_event *event = &chip->event;
+
+	memset(event, 0, sizeof(*event));
+	event->pending = true;
+	event->time_ns = time_ns;
+	event->com_irq = com_irq;
+	event->idle = idle;
+}
+
+/**
+ * Whether the antenna is powered, without which PICCs neither get frames nor
+ * answer
+ */
+static bool emu_field_on(struct emu_chip *chip)
+{
+	return chip->regs[MFRC522_TX_CONTROL_REG] &
+	       (MFRC522_TX_CONTROL_REG_TX1_RF_EN |
+		MFRC522_TX_CONTROL_REG_TX2_RF_EN);
+}
+
+/**
+ * Send the FIFO to the PICC, and schedule the reception of its answer or the
+ * expiry of the timer
+ */
+static void emu_transmit(struct emu_chip *chip, u64 now, bool receive)
+{
+	u8 last_bits = chip->regs[MFRC522_BIT_FRAMING_REG] &
+		       MFRC522_BIT_FRAMING_REG_TX_LAST_BITS_MASK;
+	struct emu_answer answer = { 0 };
+	u8 frame[MFRC522_MAX_FIFO_SIZE];
+	size_t len = chip->fifo_level;
+	u64 tx_end;
+	u64 timeout;
+	bool answered;
+
+	memcpy(frame, chip->fifo, len);
+	chip->fifo_level = 0;
+	chip->regs[MFRC522_ERROR_REG] = 0;
+	chip->regs[MFRC522_COLL_REG] = 0;
+
+	tx_end = now + emu_frame_ns(len, last_bits);
+	answered = emu_field_on(chip) &&
+		   emu_picc_frame(&chip->picc, frame, len, last_bits, &answer);
+
+	if (!receive) {
+		emu_schedule(chip, tx_end, MFRC522_COM_IRQ_TX |
+				   MFRC522_COM_IRQ_IDLE, true);
+		return;
+	}
+
+	// The timer starts at the end of the transmission, and stops as soon as
+	// the answer starts
+	timeout = emu_timer_ns(chip);
+	if (!answered || EMU_FDT_NS + answer.delay_ns > timeout) {
+		emu_schedule(chip, tx_end + timeout,
+			     MFRC522_COM_IRQ_TX | MFRC522_COM_IRQ_TIMER, false);
+		return;
+	}
+
+	emu_schedule(chip, tx_end + EMU_FDT_NS + answer.delay_ns +
+			   emu_frame_ns(answer.len, answer.last_bits),
+		     MFRC522_COM_IRQ_TX | MFRC522_COM_IRQ_RX, false);
+	chip->event.answer = answer;
+}
+
+static void emu_mf_authent(struct emu_chip *chip, u64 now)
+{
+	u8 frame[MFRC522_MAX_FIFO_SIZE];
+	size_t len = chip->fifo_level;
+	u64 duration;
+
+	memcpy(frame, chip->fifo, len);
+	chip->fifo_level = 0;
+
+	// Two exchanges with the PICC, each made of a frame and its answer
+	duration = 2 * (emu_frame_ns(4, 0) + EMU_FDT_NS + emu_frame_ns(8, 0));
+
+	if (emu_field_on(chip) && emu_picc_auth(&chip->picc, frame, len)) {
+		emu_schedule(chip, now + duration, MFRC522_COM_IRQ_IDLE, true);
+		chip->event.status_2 = MFRC522_STATUS_2_REG_MF_CRYPTO1_ON;
+		return;
+	}
+
+	// The PICC stops answering, so MFAuthent never ends by itself
+	emu_schedule(chip, now + emu_frame_ns(4, 0) + emu_timer_ns(chip),
+		     MFRC522_COM_IRQ_TIMER, false);
+}
+
+static void emu_calc_crc(struct emu_chip *chip, u64 now)
+{
+	static const u16 presets[] = { 0x0000, 0x6363, 0xA671, 0xFFFF };
+	u16 preset = presets[chip->regs[MFRC522_MODE_REG] &
+			     MFRC522_MODE_REG_CRC_PRESET_MASK];
+	u16 crc = emu_crc_a(preset, chip->fifo, chip->fifo_level);
+
+	// CalcCRC keeps running until another command is started
+	emu_schedule(chip, now + chip->fifo_level * EMU_CRC_NS_PER_BYTE, 0,
+		     false);
+	chip->event.div_irq = MFRC522_DIV_IRQ_CRC;
+
+	chip->fifo_level = 0;
+	chip->regs[MFRC522_CRC_RESULT_MSB_REG] = crc >> 8;
+	chip->regs[MFRC522_CRC_RESULT_LSB_REG] = crc & 0xFF;
+}
+
+/**
+ * Transfer the FIFO into the internal memory, or the internal memory into an
+ * empty FIFO, see 10.3.1.2
+ */
+static void emu_mem(struct emu_chip *chip, u64 now)
+{
+	size_t len;
+
+	if (!chip->fifo_level) {
+		emu_fifo_push(chip, chip->mem, EMU_MEM_SIZE);
+	} else {
+		len = min_t(size_t, chip->fifo_level, EMU_MEM_SIZE);
+		memcpy(chip->mem, chip->fifo, len);
+		memmove(chip->fifo, chip->fifo + len, chip->fifo_level - len);
+		chip->fifo_level -= len;
+	}
+
+	emu_schedule(chip, now + EMU_MEM_NS, MFRC522_COM_IRQ_IDLE, true);
+}
+
+static void emu_soft_reset(struct emu_chip *chip)
+{
+	memset(chip->regs, 0, sizeof(chip->regs));
+	chip->regs[MFRC522_COMMAND_REG] = 0x20;
+	chip->regs[MFRC522_COM_IEN_REG] = 0x80;
+	chip->regs[MFRC522_COM_IRQ_REG] = 0x14;
+	chip->regs[MFRC522_MODE_REG] = 0x3F;
+	chip->regs[MFRC522_TX_CONTROL_REG] = 0x80;
+	chip->regs[MFRC522_VERSION_REG] = EMU_VERSION;
+	chip->fifo_level = 0;
+	memset(&chip->event, 0, sizeof(chip->event));
+}
+
+static void emu_write_command(struct emu_chip *chip, u8 value, u64 now)
+{
+	u8 command = value & MFRC522_COMMAND_REG_COMMAND_MASK;
+	u8 old = chip->regs[MFRC522_COMMAND_REG];
+
+	// Leaving the soft power-down mode restarts the oscillator, during which
+	// PowerDown still reads as 1
+	if ((old & MFRC522_COMMAND_REG_POWER_DOWN) && !(value & MFRC522_COMMAND_REG_POWER_DOWN))
+		chip->wake_up_ns = now + EMU_WAKE_UP_NS;
+
+	if (command == MFRC522_COMMAND_NO_CMD_CHANGE) {
+		chip->regs[MFRC522_COMMAND_REG] =
+			(value & ~MFRC522_COMMAND_REG_COMMAND_MASK) |
+			(old & MFRC522_COMMAND_REG_COMMAND_MASK);
+		return;
+	}
+
+	// Any new command stops the running one, without raising IdleIRq
+	chip->event.pending = false;
+	chip->regs[MFRC522_COMMAND_REG] = value;
+
+	switch (command) {
+	case MFRC522_COMMAND_MEM:
+		emu_mem(chip, now);
+		break;
+	case MFRC522_COMMAND_GENERATE_RANDOM_ID:
+		get_random_bytes(chip->mem, EMU_RANDOM_ID_SIZE);
+		emu_schedule(chip, now + EMU_RANDOM_ID_NS, MFRC522_COM_IRQ_IDLE,
+			     true);
+		break;
+	case MFRC522_COMMAND_CALC_CRC:
+		emu_calc_crc(chip, now);
+		break;
+	case MFRC522_COMMAND_TRANSMIT:
+		emu_transmit(chip, now, false);
+		break;
+	case MFRC522_COMMAND_MF_AUTHENT:
+		emu_mf_authent(chip, now);
+		break;
+	case MFRC522_COMMAND_SOFT_RESET:
+		emu_soft_reset(chip);
+		break;
+	default:
+		// Idle, and Receive or Transceive, which wait for StartSend
+		break;
+	}
+}
+
+static void emu_write(struct emu_chip *chip, u8 reg, u8 value, u64 now)
+{
+	u8 *regs = chip->regs;
+
+	switch (reg) {
+	case MFRC522_COMMAND_REG:
+		emu_write_command(chip, value, now);
+		break;
+	case MFRC522_COM_IRQ_REG:
+	case MFRC522_DIV_IRQ_REG:
+		// Set1 tells whether the marked bits are set or cleared
+		if (value & BIT(7))
+			regs[reg] |= value & 0x7F;
+		else
+			regs[reg] &= ~value;
+		break;
+	case MFRC522_FIFO_DATA_REG:
+		emu_fifo_push(chip, &value, 1);
+		break;
+	case MFRC522_FIFO_LEVEL_REG:
+		if (value & MFRC522_FIFO_LEVEL_REG_FLUSH) {
+			chip->fifo_level = 0;
+			regs[MFRC522_ERROR_REG] &= ~MFRC522_ERROR_BUFFER_OVFL;
+		}
+		break;
+	case MFRC522_CONTROL_REG:
+		if (value & MFRC522_CONTROL_REG_T_STOP_NOW &&
+		    chip->event.com_irq & MFRC522_COM_IRQ_TIMER)
+			chip->event.pending = false;
+		break;
+	case MFRC522_BIT_FRAMING_REG:
+		regs[reg] = value & ~MFRC522_BIT_FRAMING_REG_START_SEND;
+		if (value & MFRC522_BIT_FRAMING_REG_START_SEND &&
+		    (regs[MFRC522_COMMAND_REG] &
+		     MFRC522_COMMAND_REG_COMMAND_MASK) ==
+			    MFRC522_COMMAND_TRANSCEIVE)
+			emu_transmit(chip, now, true);
+		break;
+	case MFRC522_ERROR_REG:
+	case MFRC522_STATUS_1_REG:
+	case MFRC522_COLL_REG:
+	case MFRC522_CRC_RESULT_MSB_REG:
+	case MFRC522_CRC_RESULT_LSB_REG:
+	case MFRC522_VERSION_REG:
+		// Read-only
+		break;
+	default:
+		regs[reg] = value;
+		break;
+	}
+}
+
+static u8 emu_read(struct emu_chip *chip, u8 reg, u64 now)
+{
+	u8 value;
+
+	switch (reg) {
+	case MFRC522_FIFO_DATA_REG:
+		return emu_fifo_pop(chip);
+	case MFRC522_FIFO_LEVEL_REG:
+		return chip->fifo_level;
+	case MFRC522_COMMAND_REG:
+		value = chip->regs[reg];
+		if (now < chip->wake_up_ns)
+			value |= MFRC522_COMMAND_REG_POWER_DOWN;
+		return value;
+	default:
+		return chip->regs[reg];
+	}
+}
+
+/**
+ * Run one SPI transfer, which is a whole register access sequence since the
+ * driver releases NSS after each of them, see 8.1.2
+ */
+static void emu_transfer(struct emu_chip *chip, struct spi_transfer *xfer)
+{
+	const u8 *tx = xfer->tx_buf;
+	u8 *rx = xfer->rx_buf;
+	u64 now = ktime_get_ns();
+	unsigned int i;
+	u8 reg;
+
+	if (!tx || !xfer->len)
+		return;
+
+	emu_advance(chip, now);
+
+	if (rx)
+		rx[0] = 0;
+
+	reg = (tx[0] >> MFRC522_ADDRESS_BYTE_SHIFT) & (EMU_REGISTERS - 1);
+
+	// Writes go to the register addressed by the first byte
+	if (!(tx[0] & MFRC522_ADDRESS_BYTE_READ)) {
+		for (i = 1; i < xfer->len; i++)
+			emu_write(chip, reg, tx[i], now);
+		return;
+	}
+
+	// Reads answer the address of each byte during the next one
+	for (i = 1; i < xfer->len; i++) {
+		if (rx)
+			rx[i] = emu_read(chip, reg, now);
+		reg = (tx[i] >> MFRC522_ADDRESS_BYTE_SHIFT) &
+		      (EMU_REGISTERS - 1);
+	}
+}
+
+/**
+ * Flip a bit of every byte read over a bus clocked faster than max_reliable_hz
+ */
+static void emu_bus_errors(struct spi_device *spi, struct spi_transfer *xfer)
+{
+	u32 speed_hz = xfer->speed_hz ?: spi->max_speed_hz;
+	unsigned int limit = READ_ONCE(max_reliable_hz);
+	u8 *rx = xfer->rx_buf;
+	unsigned int i;
+
+	if (!limit || speed_hz <= limit || !rx)
+		return;
+
+	for (i = 1; i < xfer->len; i++)
+		rx[i] ^= BIT(i & 7);
+}
+
+/**
+ * Take as long as the transfer would on a real bus
+ */
+static void emu_bus_delay(struct spi_device *spi, struct spi_transfer *xfer)
+{
+	u32 speed_hz = xfer->speed_hz ?: spi->max_speed_hz;
+	u64 ns;
+
+	if (!model_bus_time || !speed_hz)
+		return;
+
+	ns = div_u64((u64)xfer->len * 8 * NSEC_PER_SEC, speed_hz);
+	if (ns >= NSEC_PER_USEC)
+		udelay(div_u64(ns, NSEC_PER_USEC));
+	else
+		ndelay(ns);
+}
+
+static int emu_transfer_one_message(struct spi_master *master,
+				    struct spi_message *msg)
+{
+	struct emu *e = spi_master_get_devdata(master);
+	struct emu_chip *chip = &e->chips[msg->spi->chip_select];
+	struct spi_transfer *xfer;
+
+	list_for_each_entry(xfer, &msg->transfers, transfer_list) {
+		mutex_lock(&e->lock);
+		emu_transfer(chip, xfer);
+		mutex_unlock(&e->lock);
+
+		emu_bus_errors(msg->spi, xfer);
+		emu_bus_delay(msg->spi, xfer);
+		msg->actual_length += xfer->len;
+	}
+
+	msg->status = 0;
+	spi_finalize_current_message(master);
+
+	return 0;
+}
+
+static int emu_picc_set(const char *val, const struct kernel_param *kp)
+{
+	int type = sysfs_match_string(emu_picc_names, val);
+	unsigned int i;
+
+	if (type < 0)
+		return type;
+
+	picc_type = type;
+
+	// A new PICC enters the field of every reader
+	if (emu) {
+		mutex_lock(&emu->lock);
+		for (i = 0; i < readers; i++)
+			emu_picc_init(&emu->chips[i].picc, type);
+		mutex_unlock(&emu->lock);
+	}
+
+	return 0;
+}
+
+static int emu_picc_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", emu_picc_names[picc_type]);
+}
+
+static const struct kernel_param_ops emu_picc_ops = {
+	.set = emu_picc_set,
+	.get = emu_picc_get,
+};
+
+module_param_cb(picc, &emu_picc_ops, NULL, 0644);
+MODULE_PARM_DESC(picc,
+		 "PICC in the field of every reader: none, ntag216 or mfc1k");
+
+static int __init emu_init(void)
+{
+	struct spi_board_info info = {
+		.modalias = "mfrc522",
+		.max_speed_hz = MFRC522_SPI_MAX_CLOCK_SPEED,
+		.mode = SPI_MODE_0,
+	};
+	struct platform_device *pdev;
+	struct spi_master *master;
+	struct emu *e;
+	unsigned int i;
+	int ret;
+
+	if (!readers || readers > EMU_MAX_READERS)
+		return -EINVAL;
+
+	pdev = platform_device_register_simple(EMU_NAME, PLATFORM_DEVID_NONE,
+					       NULL, 0);
+	if (IS_ERR(pdev))
+		return PTR_ERR(pdev);
+
+	master = spi_alloc_master(&pdev->dev, sizeof(*e));
+	if (!master) {
+		ret = -ENOMEM;
+		goto err_pdev;
+	}
+
+	e = spi_master_get_devdata(master);
+	mutex_init(&e->lock);
+	e->pdev = pdev;
+	e->master = master;
+
+	for (i = 0; i < readers; i++) {
+		emu_soft_reset(&e->chips[i]);
+		emu_picc_init(&e->chips[i].picc, picc_type);
+	}
+
+	master->bus_num = -1;
+	master->num_chipselect = readers;
+	master->mode_bits = SPI_MODE_0;
+	master->max_speed_hz = EMU_MAX_SPEED_HZ;
+	master->transfer_one_message = emu_transfer_one_message;
+
+	ret = spi_register_master(master);
+	if (ret < 0) {
+		spi_master_put(master);
+		goto err_pdev;
+	}
+
+	emu = e;
+
+	for (i = 0; i < readers; i++) {
+		info.chip_select = i;
+		e->spi[i] = spi_new_device(master, &info);
+		if (!e->spi[i])
+			dev_warn(&pdev->dev, "Could not add reader %u\n", i);
+	}
+
+	return 0;
+
+err_pdev:
+	platform_device_unregister(pdev);
+
+	return ret;
+}
+
+static void __exit emu_exit(void)
+{
+	struct platform_device *pdev = emu->pdev;
+	struct emu *e = emu;
+	unsigned int i;
+
+	emu = NULL;
+
+	for (i = 0; i < readers; i++)
+		if (e->spi[i])
+			spi_unregister_device(e->spi[i]);
+
+	// Frees the model along with the controller
+	spi_unregister_master(e->master);
+
+	platform_device_unregister(pdev);
+}
+
+module_init(emu_init);
+module_exit(emu_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_AUTHOR("ks0n");
+MODULE_DESCRIPTION("Software model of the MFRC522, for tests and benchmarks");
@@ -0,0 +1,517 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "mfrc522_crc.h"
+#include "mfrc522_mifare.h"
+#include "mfrc522_picc.h"
+#include "mfrc522_pipeline.h"
+#include "mfrc522_spi.h"
+
+// MIFARE Classic commands
+#define MF_CMD_AUTH_KEY_A 0x60
+#define MF_CMD_AUTH_KEY_B 0x61
+#define MF_CMD_READ 0x30
+#define MF_CMD_WRITE 0xA0
+
+// PICCs answer WRITE, and refused commands, with 4 bits. Anything but an ACK is a
+// NAK
+#define MF_ACK 0x0A
+#define MF_ACK_MASK 0x0F
+#define MF_ACK_SIZE 1
+
+#define MF_READ_SIZE (MFRC522_MF_BLOCK_SIZE + MFRC522_CRC_A_SIZE)
+
+#define MF_SAK_MINI 0x09
+#define MF_SAK_1K 0x08
+#define MF_SAK_4K 0x18
+
+// Sectors 32 to 39 of a MIFARE Classic 4K hold 16 blocks instead of 4
+#define MF_SMALL_SECTORS 32
+#define MF_SMALL_SECTOR_BLOCKS 4
+#define MF_LARGE_SECTOR_BLOCKS 16
+
+// PICCs only acknowledge a WRITE once their EEPROM was programmed, which takes a
+// few milliseconds
+#define MF_TIMEOUT_US 10000
+
+// The last stage of a pipeline reads the answer to the last frame
+#define MF_MAX_STEPS (MFRC522_PIPELINE_MAX_STAGES - 1)
+
+enum mf_step_type {
+	MF_STEP_AUTH,
+	MF_STEP_READ,
+	MF_STEP_WRITE,
+	MF_STEP_WRITE_DATA,
+};
+
+/**
+ * An exchange with the PICC, and where its outcome is read once the pipeline ran
+ */
+struct mf_step {
+	enum mf_step_type type;
+	unsigned int block;
+	// Block read by MF_STEP_READ, or written by MF_STEP_WRITE_DATA
+	u8 *data;
+	u8 *status;
+	struct mfrc522_picc_rx rx;
+};
+
+struct mf_read_ctx {
+	unsigned int first;
+	unsigned int last;
+	u8 *buf;
+};
+
+struct mf_write_ctx {
+	unsigned int block;
+	u8 data[MFRC522_MF_BLOCK_SIZE];
+};
+
+/**
+ * Get the amount of sectors of a MIFARE Classic PICC, or 0 if the SAK is not one
+ * of a MIFARE Classic PICC
+ */
+static unsigned int mf_sector_count(u8 sak)
+{
+	// Bit 7 of the SAK is set by some second-source 1K PICCs
+	switch (sak & ~BIT(7)) {
+	case MF_SAK_MINI:
+		return 5;
+	case MF_SAK_1K:
+		return 16;
+	case MF_SAK_4K:
+		return 40;
+	default:
+		return 0;
+	}
+}
+
+static unsigned int mf_sector_first_block(unsigned int sector)
+{
+	if (sector < MF_SMALL_SECTORS)
+		return sector * MF_SMALL_SECTOR_BLOCKS;
+
+	return MF_SMALL_SECTORS * MF_SMALL_SECTOR_BLOCKS +
+	       (sector - MF_SMALL_SECTORS) * MF_LARGE_SECTOR_BLOCKS;
+}
+
+static unsigned int mf_sector_blocks(unsigned int sector)
+{
+	return sector < MF_SMALL_SECTORS ? MF_SMALL_SECTOR_BLOCKS :
+					   MF_LARGE_SECTOR_BLOCKS;
+}
+
+static unsigned int mf_block_sector(unsigned int block)
+{
+	unsigned int small_blocks = MF_SMALL_SECTORS * MF_SMALL_SECTOR_BLOCKS;
+
+	if (block < small_blocks)
+		return block / MF_SMALL_SECTOR_BLOCKS;
+
+	return MF_SMALL_SECTORS + (block - small_blocks) / MF_LARGE_SECTOR_BLOCKS;
+}
+
+/**
+ * Whether a block is the trailer of its sector, holding its keys and access
+ * conditions
+ */
+static bool mf_block_is_trailer(unsigned int block)
+{
+	unsigned int sector = mf_block_sector(block);
+
+	return block + 1 ==
+	       mf_sector_first_block(sector) + mf_sector_blocks(sector);
+}
+
+/**
+ * Get the key to authenticate to a sector with, or NULL if there is none
+ */
+static const struct mfrc522_mf_key *mf_key(struct mfrc522_state *state,
+					   unsigned int sector)
+{
+	const struct mfrc522_mf_key *key = &state->mifare.keys[sector];
+
+	if (key->valid)
+		return key;
+
+	key = &state->mifare.default_key;
+
+	return key->valid ? key : NULL;
+}
+
+int mfrc522_mf_set_key(struct mfrc522_state *state, int sector, bool key_b,
+		       const u8 *key)
+{
+	struct mfrc522_mf_key *slot;
+
+	lockdep_assert_held(&state->lock);
+
+	if (sector == MFRC522_MF_DEFAULT_KEY)
+		slot = &state->mifare.default_key;
+	else if (sector >= 0 && sector < MFRC522_MF_MAX_SECTORS)
+		slot = &state->mifare.keys[sector];
+	else
+		return -EINVAL;
+
+	slot->key_b = key_b;
+	memcpy(slot->bytes, key, MFRC522_MF_KEY_SIZE);
+	slot->valid = true;
+
+	return 0;
+}
+
+/**
+ * Queue the frames of a step. The outcome of the step is read at the beginning of
+ * the next stage
+ */
+static int mf_queue_step(struct mfrc522_state *state,
+			 struct mfrc522_pipeline *p, struct mf_step *step)
+{
+	const struct mfrc522_mf_key *key;
+	u8 frame[MF_READ_SIZE];
+	size_t rx_size = MF_ACK_SIZE;
+	size_t len = 2;
+
+	switch (step->type) {
+	case MF_STEP_AUTH:
+		key = mf_key(state, mf_block_sector(step->block));
+		if (!key)
+			return -ENOKEY;
+
+		// MFAuthent expects the command, the key, and the last 4 bytes of
+		// the UID, see 10.3.1.9
+		frame[0] = key->key_b ? MF_CMD_AUTH_KEY_B : MF_CMD_AUTH_KEY_A;
+		frame[1] = step->block;
+		memcpy(frame + 2, key->bytes, MFRC522_MF_KEY_SIZE);
+		memcpy(frame + 2 + MFRC522_MF_KEY_SIZE,
+		       state->mifare.session_uid, MFRC522_MF_UID_SIZE);
+
+		mfrc522_picc_queue_frame(p, frame,
+					 2 + MFRC522_MF_KEY_SIZE +
+						 MFRC522_MF_UID_SIZE);
+		mfrc522_pipeline_command_timed(p, MFRC522_COMMAND_MF_AUTHENT);
+		step->status = mfrc522_pipeline_read(p, MFRC522_STATUS_2_REG, 1);
+
+		memzero_explicit(frame, sizeof(frame));
+		return 0;
+	case MF_STEP_READ:
+		frame[0] = MF_CMD_READ;
+		frame[1] = step->block;
+		rx_size = MF_READ_SIZE;
+		break;
+	case MF_STEP_WRITE:
+		frame[0] = MF_CMD_WRITE;
+		frame[1] = step->block;
+		break;
+	case MF_STEP_WRITE_DATA:
+		memcpy(frame, step->data, MFRC522_MF_BLOCK_SIZE);
+		len = MFRC522_MF_BLOCK_SIZE;
+		break;
+	}
+
+	// Once authenticated, the MFRC522 encrypts frames and their CRC_A
+	mfrc522_crc_a_append(state, frame, len);
+	mfrc522_picc_queue_transceive(p, frame, len + MFRC522_CRC_A_SIZE, 0, 0,
+				      rx_size, &step->rx);
+
+	return 0;
+}
+
+/**
+ * Check the outcome of a step once its pipeline ran
+ */
+static int mf_check_step(struct mfrc522_state *state, struct mf_step *step)
+{
+	const struct mfrc522_picc_rx *rx = &step->rx;
+	size_t len;
+
+	if (step->type == MF_STEP_AUTH) {
+		if (!(*step->status & MFRC522_STATUS_2_REG_MF_CRYPTO1_ON))
+			return -EACCES;
+
+		state->mifare.auth_sector = mf_block_sector(step->block);
+		return 0;
+	}
+
+	if (*rx->error & MFRC522_PICC_ERRORS)
+		return -EIO;
+
+	len = mfrc522_picc_rx_len(rx);
+
+	if (step->type != MF_STEP_READ) {
+		if (len != MF_ACK_SIZE || (rx->data[0] & MF_ACK_MASK) != MF_ACK)
+			return -EACCES;
+
+		return 0;
+	}
+
+	// The access conditions of the sector forbid reading the block
+	if (len == MF_ACK_SIZE)
+		return -EACCES;
+
+	if (len != MF_READ_SIZE)
+		return -EIO;
+
+	if (!mfrc522_crc_a_valid(state, rx->data, MF_READ_SIZE))
+		return -EBADMSG;
+
+	memcpy(step->data, rx->data, MFRC522_MF_BLOCK_SIZE);
+
+	return 0;
+}
+
+/**
+ * Run steps in a single pipeline. Each step only depends on the previous ones
+ * having succeeded, so the frames of a step go out in the same SPI message as
+ * the one reading the outcome of the previous step
+ *
+ * @param state Device to talk to
+ * @param steps Steps to run, at most MF_MAX_STEPS
+ * @param num_steps Amount of steps
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int mf_run_steps(struct mfrc522_state *state, struct mf_step *steps,
+			unsigned int num_steps)
+{
+	struct mfrc522_pipeline *p;
+	unsigned int i;
+	int ret = 0;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	for (i = 0; i < num_steps && !ret; i++)
+		ret = mf_queue_step(state, p, &steps[i]);
+
+	mfrc522_picc_queue_idle(p);
+
+	if (!ret)
+		ret = mfrc522_pipeline_run(p);
+
+	for (i = 0; i < num_steps && !ret; i++)
+		ret = mf_check_step(state, &steps[i]);
+
+	// The pipeline's buffer holds the keys sent to MFAuthent
+	memzero_explicit(p->buf, sizeof(p->buf));
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+/**
+ * Select the MIFARE Classic PICC in the field, and open a session with it
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int mf_activate(struct mfrc522_state *state)
+{
+	struct mfrc522_mifare *mf = &state->mifare;
+	struct mfrc522_picc_uid uid;
+	int ret;
+
+	ret = mfrc522_picc_read_uid(state, &uid, false);
+	if (ret < 0)
+		return ret;
+
+	mf->sectors = mf_sector_count(uid.sak);
+	if (!mf->sectors) {
+		mfrc522_picc_halt(state);
+		return -EOPNOTSUPP;
+	}
+
+	ret = mfrc522_picc_set_timeout(state, MF_TIMEOUT_US);
+	if (ret < 0)
+		return ret;
+
+	memcpy(mf->session_uid, uid.bytes + uid.size - MFRC522_MF_UID_SIZE,
+	       MFRC522_MF_UID_SIZE);
+	mf->auth_sector = -1;
+	mf->session = true;
+
+	return 0;
+}
+
+/**
+ * Run an operation on the MIFARE Classic PICC in the field, reusing the open
+ * session if there is one
+ *
+ * @param state Device to talk to
+ * @param op Operation to run
+ * @param ctx Arguments of the operation
+ *
+ * @return What the operation returned
+ */
+static int mf_run(struct mfrc522_state *state,
+		  int (*op)(struct mfrc522_state *state, void *ctx), void *ctx)
+{
+	bool reused = state->mifare.session;
+	int ret = 0;
+
+	if (!reused)
+		ret = mf_activate(state);
+
+	if (!ret)
+		ret = op(state, ctx);
+
+	// The PICC might have left the field or been reset since the session was
+	// opened. It then needs to be selected again
+	if (reused && (ret == -ENODATA || ret == -EIO)) {
+		ret = mf_activate(state);
+		if (!ret)
+			ret = op(state, ctx);
+	}
+
+	if (ret < 0) {
+		state->mifare.session = false;
+		return ret;
+	}
+
+	// A selected PICC ignores WUPA, so it would look gone to the scan work
+	if (READ_ONCE(state->scan.enabled))
+		mfrc522_picc_halt(state);
+
+	return ret;
+}
+
+static int mf_read_op(struct mfrc522_state *state, void *data)
+{
+	struct mf_read_ctx *ctx = data;
+	struct mf_step steps[MF_MAX_STEPS];
+	int auth_sector = state->mifare.auth_sector;
+	unsigned int first_block;
+	unsigned int end_block;
+	unsigned int block;
+	unsigned int sector;
+	unsigned int num_steps;
+	int ret;
+
+	if (ctx->last >= state->mifare.sectors)
+		return -ERANGE;
+
+	first_block = mf_sector_first_block(ctx->first);
+	end_block = mf_sector_first_block(ctx->last) +
+		    mf_sector_blocks(ctx->last);
+
+	block = first_block;
+	while (block < end_block) {
+		num_steps = 0;
+
+		while (num_steps < MF_MAX_STEPS && block < end_block) {
+			sector = mf_block_sector(block);
+
+			// Only authenticate when entering another sector, along
+			// with at least one read
+			if ((int)sector != auth_sector) {
+				if (num_steps + 2 > MF_MAX_STEPS)
+					break;
+
+				steps[num_steps++] = (struct mf_step){
+					.type = MF_STEP_AUTH,
+					.block = block,
+				};
+				auth_sector = sector;
+			}
+
+			steps[num_steps++] = (struct mf_step){
+				.type = MF_STEP_READ,
+				.block = block,
+				.data = ctx->buf + (block - first_block) *
+							   MFRC522_MF_BLOCK_SIZE,
+			};
+			block++;
+		}
+
+		ret = mf_run_steps(state, steps, num_steps);
+		if (ret < 0)
+			return ret;
+	}
+
+	return (end_block - first_block) * MFRC522_MF_BLOCK_SIZE;
+}
+
+int mfrc522_mf_read_sectors(struct mfrc522_state *state, unsigned int first,
+			    unsigned int last, u8 *buf, size_t size)
+{
+	struct mf_read_ctx ctx = {
+		.first = first,
+		.last = last,
+		.buf = buf,
+	};
+	unsigned int sector;
+	size_t needed;
+
+	lockdep_assert_held(&state->lock);
+
+	if (first > last || last >= MFRC522_MF_MAX_SECTORS)
+		return -EINVAL;
+
+	needed = (mf_sector_first_block(last) + mf_sector_blocks(last) -
+		  mf_sector_first_block(first)) *
+		 MFRC522_MF_BLOCK_SIZE;
+	if (needed > size)
+		return -E2BIG;
+
+	for (sector = first; sector <= last; sector++)
+		if (!mf_key(state, sector))
+			return -ENOKEY;
+
+	return mf_run(state, mf_read_op, &ctx);
+}
+
+static int mf_write_op(struct mfrc522_state *state, void *data)
+{
+	struct mf_write_ctx *ctx = data;
+	struct mf_step steps[3];
+	unsigned int sector = mf_block_sector(ctx->block);
+	unsigned int num_steps = 0;
+
+	if (sector >= state->mifare.sectors)
+		return -ERANGE;
+
+	if ((int)sector != state->mifare.auth_sector)
+		steps[num_steps++] = (struct mf_step){
+			.type = MF_STEP_AUTH,
+			.block = ctx->block,
+		};
+
+	// The data goes out right after the command, without waiting for its ACK. A
+	// PICC which refused the command ignores it
+	steps[num_steps++] = (struct mf_step){
+		.type = MF_STEP_WRITE,
+		.block = ctx->block,
+	};
+	steps[num_steps++] = (struct mf_step){
+		.type = MF_STEP_WRITE_DATA,
+		.block = ctx->block,
+		.data = ctx->data,
+	};
+
+	return mf_run_steps(state, steps, num_steps);
+}
+
+int mfrc522_mf_write_block(struct mfrc522_state *state, unsigned int block,
+			   const u8 *data)
+{
+	struct mf_write_ctx ctx = {
+		.block = block,
+	};
+
+	lockdep_assert_held(&state->lock);
+
+	if (block >= mf_sector_first_block(MFRC522_MF_MAX_SECTORS))
+		return -EINVAL;
+
+	if (!block || mf_block_is_trailer(block))
+		return -EPERM;
+
+	if (!mf_key(state, mf_block_sector(block)))
+		return -ENOKEY;
+
+	memcpy(ctx.data, data, MFRC522_MF_BLOCK_SIZE);
+
+	return mf_run(state, mf_write_op, &ctx);
+}
@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_MIFARE_H
+#define MFRC522_MIFARE_H
+
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+#define MFRC522_MF_BLOCK_SIZE 16
+#define MFRC522_MF_DEFAULT_KEY (-1)
+
+/**
+ * Load a key into the keyring of a device. Must be called with the device's lock
+ * held
+ *
+ * @param state Device whose keyring is updated
+ * @param sector Sector the key is for, or MFRC522_MF_DEFAULT_KEY for every
+ *               sector without a key of its own
+ * @param key_b Whether to authenticate as key B rather than key A
+ * @param key Key, MFRC522_MF_KEY_SIZE bytes wide
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_mf_set_key(struct mfrc522_state *state, int sector, bool key_b,
+		       const u8 *key);
+
+/**
+ * Read every block of a range of sectors of the MIFARE Classic PICC in the field,
+ * sector trailers included. Blocks are read sector after sector, and each
+ * sector is only authenticated once. The PICC stays selected and authenticated
+ * afterwards, so that a following command on the same sector skips the
+ * activation and authentication. Must be called with the device's lock held
+ *
+ * @param state Device to talk to
+ * @param first First sector to read
+ * @param last Last sector to read
+ * @param buf Filled with the content of the blocks
+ * @param size Size of the buffer
+ *
+ * @return The amount of bytes read on success, a negative number on error
+ */
+int mfrc522_mf_read_sectors(struct mfrc522_state *state, unsigned int first,
+			    unsigned int last, u8 *buf, size_t size);
+
+/**
+ * Write a data block of the MIFARE Classic PICC in the field. The manufacturer
+ * block and sector trailers, which hold the keys and access conditions, cannot be
+ * written. Must be called with the device's lock held
+ *
+ * @param state Device to talk to
+ * @param block Block to write
+ * @param data Data to write, MFRC522_MF_BLOCK_SIZE bytes wide
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_mf_write_block(struct mfrc522_state *state, unsigned int block,
+			   const u8 *data);
+
+#endif /* ! MFRC522_MIFARE_H */
@@ -1,48 +1,230 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#include <linux/debugfs.h>
 #include <linux/errno.h>
+#include <linux/idr.h>
 #include <linux/module.h>
 #include <linux/miscdevice.h>
 #include <linux/init.h>
+#include <linux/ktime.h>
 #include <linux/spi/spi.h>
 #include <linux/regmap.h>
 #include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/mfrc522.h>
 
 #include "mfrc522_module.h"
 #include "mfrc522_user_command.h"
 #include "mfrc522_parser.h"
+#include "mfrc522_clock.h"
+#include "mfrc522_crc.h"
+#include "mfrc522_picc.h"
+#include "mfrc522_pm.h"
+#include "mfrc522_ring.h"
+#include "mfrc522_rng.h"
+#include "mfrc522_scan.h"
+#include "mfrc522_stats.h"
 #include "mfrc522_spi.h"
 #include "mfrc522_debug.h"
 
+#define CREATE_TRACE_POINTS
+#include "mfrc522_trace.h"
+
 #define MFRC522_VERSION_BASE 0x90
 #define MFRC522_VERSION_1 0x91
 #define MFRC522_VERSION_2 0x92
 #define MFRC522_VERSION_NUM(ver) ((ver)-MFRC522_VERSION_BASE)
 
-static struct mfrc522_state *g_state;
+// Longest "<status>:<length>:" prefix and trailing newline of a batch answer
+#define MFRC522_BATCH_HEADER_SIZE 16
+
+static DEFINE_IDA(mfrc522_ida);
+
+// Answer buffers of open files, see struct mfrc522_file
+static struct kmem_cache *mfrc522_file_cache;
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("ks0n");
 MODULE_DESCRIPTION("Driver for the MFRC522 RFID Chip");
 
-static ssize_t __mfrc522_write(struct mfrc522_state *state, const char *buffer,
+static void mfrc522_state_release(struct kref *ref)
+{
+	struct mfrc522_state *state = container_of(ref, struct mfrc522_state,
+						   ref);
+
+	mfrc522_ring_free(state);
+	mutex_destroy(&state->lock);
+	spi_dev_put(state->spi);
+	kfree(state);
+}
+
+void mfrc522_state_get(struct mfrc522_state *state)
+{
+	kref_get(&state->ref);
+}
+
+void mfrc522_state_put(struct mfrc522_state *state)
+{
+	kref_put(&state->ref, mfrc522_state_release);
+}
+
+/**
+ * Drop the reference of the bound device. Registered as a devm action before the
+ * interrupt and the register map are set up, so it runs once they are gone
+ */
+static void mfrc522_state_put_action(void *state)
+{
+	mfrc522_state_put(state);
+}
+
+/**
+ * Execute a parsed command on a device, keeping track of its statistics. Must
+ * be called with the device's lock held
+ *
+ * @param state Device to run the command on
+ * @param answer Buffer in which to store the command's answer
+ * @param command Command to execute
+ *
+ * @return The size of the answer on success, a negative number otherwise
+ */
+static int __mfrc522_run_command(struct mfrc522_state *state, char *answer,
+				 struct mfrc522_command *command)
+{
+	int answer_size;
+	s64 spi_msg_start;
+	s64 timeouts_start;
+	u64 start;
+
+	lockdep_assert_held(&state->lock);
+
+	trace_mfrc522_cmd_start(state, command);
+
+	// The scan work also sends messages, but never while a command runs
+	spi_msg_start = mfrc522_stats_spi_messages(state);
+	timeouts_start = atomic64_read(&state->stats.timeouts);
+	start = ktime_get_ns();
+	answer_size = mfrc522_execute(state, answer, command);
+	state->stats.last_cmd_latency_ns = ktime_get_ns() - start;
+	state->stats.last_cmd_spi_messages =
+		mfrc522_stats_spi_messages(state) - spi_msg_start;
+
+	mfrc522_stats_cmd(state, command->cmd,
+			  state->stats.last_cmd_latency_ns, answer_size < 0,
+			  atomic64_read(&state->stats.timeouts) -
+				  timeouts_start);
+
+	trace_mfrc522_cmd_end(state, command, answer_size,
+			      state->stats.last_cmd_latency_ns,
+			      state->stats.last_cmd_spi_messages);
+
+	if (answer_size >= 0 && mfrc522_debug_on(state))
+		do_debug(command, answer, answer_size);
+
+	return answer_size;
+}
+
+/**
+ * Execute a parsed command on a device, keeping track of its statistics
+ *
+ * @param state Device to run the command on
+ * @param answer Buffer in which to store the command's answer
+ * @param command Command to execute
+ *
+ * @return The size of the answer on success, a negative number otherwise
+ */
+static int mfrc522_run_command(struct mfrc522_state *state, char *answer,
+			       struct mfrc522_command *command)
+{
+	int answer_size;
+
+	answer_size = mfrc522_pm_get(state);
+	if (answer_size < 0)
+		return answer_size;
+
+	mutex_lock(&state->lock);
+	// The device might have been unbound while waiting for the lock
+	if (state->dead)
+		answer_size = -ENODEV;
+	else
+		answer_size = __mfrc522_run_command(state, answer, command);
+	mutex_unlock(&state->lock);
+
+	mfrc522_pm_put(state);
+
+	return answer_size;
+}
+
+/**
+ * Start running a batch of commands: wake the device up, take its lock, then the
+ * SPI bus lock, so that neither other commands nor other devices on the bus can
+ * send messages until mfrc522_batch_unlock(). Those devices do not fail in the
+ * meantime: their messages wait for the bus, see struct mfrc522_pipeline
+ *
+ * @param state Device to run the batch on
+ *
+ * @return 0 on success, -ENODEV if the device was unbound, another negative
+ *         number if it could not be woken up
+ */
+static int mfrc522_batch_lock(struct mfrc522_state *state)
+{
+	int ret;
+
+	ret = mfrc522_pm_get(state);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&state->lock);
+	if (state->dead) {
+		mutex_unlock(&state->lock);
+		mfrc522_pm_put(state);
+		return -ENODEV;
+	}
+
+	spi_bus_lock(state->spi->master);
+	WRITE_ONCE(state->bus_locked, true);
+
+	return 0;
+}
+
+static void mfrc522_batch_unlock(struct mfrc522_state *state)
+{
+	WRITE_ONCE(state->bus_locked, false);
+	spi_bus_unlock(state->spi->master);
+	mutex_unlock(&state->lock);
+	mfrc522_pm_put(state);
+}
+
+/**
+ * Run a single command, and keep its answer for the next reads of the file
+ *
+ * @param f Open file the command is written to. Its lock must be held
+ * @param buffer Command
+ * @param len Length of the command
+ *
+ * @return len on success, a negative number on error
+ */
+static ssize_t __mfrc522_write(struct mfrc522_file *f, const char *buffer,
 			       size_t len)
 {
+	struct mfrc522_state *state = f->state;
 	int answer_size;
 	struct mfrc522_command command = { 0 };
+	int ret;
 
-	if (mfrc522_parse(&command, buffer, len) < 0) {
+	ret = mfrc522_parse(&command, buffer, len);
+	trace_mfrc522_parse(state, buffer, len, &command, ret);
+	if (ret < 0) {
 		pr_err("[MFRC522] Got invalid command\n");
 		return -EINVAL;
 	}
 
-	pr_info("[MFRC522] Got following command: %d\n", command.cmd);
+	// Any answer left unread is dropped
+	f->buffer_full = false;
 
-	// The data buffer is zero filled if no extra input has been given
-	if (command.data[0])
-		pr_info("[MFRC522] With extra data: `%s`\n", command.data);
-
-	answer_size = mfrc522_execute(state, state->answer, &command);
+	answer_size = mfrc522_run_command(state, f->answer, &command);
+	if (answer_size == -ENODEV)
+		return answer_size;
 
 	if (answer_size < 0) {
 		// Error
@@ -50,38 +232,201 @@ static ssize_t __mfrc522_write(struct mfrc522_state *state, const char *buffer,
 		return -EBADE;
 	}
 
-	if (state->debug_on)
-		do_debug(&command, state->answer, answer_size);
+	if (!answer_size)
+		return len;
 
 	// Non-empty answer
-	pr_info("[MFRC522] Answer: \"%.*s\"\n", answer_size, state->answer);
-	state->buffer_full = true;
+	f->answer_size = answer_size;
+	f->answer_pos = 0;
+	f->buffer_full = true;
+	wake_up_interruptible(&state->read_wait);
 
 	return len;
 }
 
+/**
+ * Parse a batch of newline-separated commands. Empty lines are skipped
+ *
+ * @param state Device the batch is sent to, for tracing
+ * @param input Batch
+ * @param len Length of the batch
+ * @param commands Filled with the parsed commands
+ *
+ * @return The amount of commands on success, a negative number if any of them is
+ *         invalid or if there are too many
+ */
+static int mfrc522_parse_batch(struct mfrc522_state *state, const char *input,
+			       size_t len, struct mfrc522_command *commands)
+{
+	const char *end = input + len;
+	const char *line = input;
+	const char *newline;
+	size_t line_len;
+	int count = 0;
+	int ret;
+
+	while (line < end) {
+		newline = memchr(line, '\n', end - line);
+		line_len = (newline ? newline : end) - line;
+
+		if (line_len) {
+			if (count == MFRC522_BATCH_MAX_CMDS ||
+			    line_len > MFRC522_MAX_INPUT_LEN)
+				return -EINVAL;
+
+			ret = mfrc522_parse(&commands[count], line, line_len);
+			trace_mfrc522_parse(state, line, line_len,
+					    &commands[count], ret);
+			if (ret < 0)
+				return -EINVAL;
+
+			count++;
+		}
+
+		line += line_len + 1;
+	}
+
+	return count;
+}
+
+/**
+ * Run a batch of newline-separated commands, without any other SPI traffic in
+ * between, and keep all their answers for the next reads. Each answer is
+ * formatted as "<status>:<length>:<answer>\n", so that binary answers can be
+ * told apart. The whole batch is rejected if any of its commands is invalid
+ *
+ * @param f Open file the batch is written to. Its lock must be held
+ * @param input Batch
+ * @param len Length of the batch
+ *
+ * @return len on success, a negative number on error
+ */
+static ssize_t mfrc522_write_batch(struct mfrc522_file *f, const char *input,
+				   size_t len)
+{
+	struct mfrc522_state *state = f->state;
+	struct mfrc522_command *commands;
+	char *answer = NULL;
+	size_t pos = 0;
+	int answer_size;
+	int status;
+	int count;
+	int ret;
+	int i;
+
+	commands = kcalloc(MFRC522_BATCH_MAX_CMDS, sizeof(*commands),
+			   GFP_KERNEL);
+	if (!commands)
+		return -ENOMEM;
+
+	count = mfrc522_parse_batch(state, input, len, commands);
+	if (count < 0) {
+		pr_err("[MFRC522] Got invalid batch\n");
+		goto out;
+	}
+
+	answer = kmalloc(MFRC522_MAX_ANSWER_SIZE, GFP_KERNEL);
+	if (!answer) {
+		count = -ENOMEM;
+		goto out;
+	}
+
+	f->buffer_full = false;
+
+	ret = mfrc522_batch_lock(state);
+	if (ret < 0) {
+		count = ret;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		// Commands whose answer might not fit are not run at all. Room is
+		// kept for the header of every remaining command
+		if (pos + MFRC522_MAX_ANSWER_SIZE +
+			    (count - i) * MFRC522_BATCH_HEADER_SIZE >
+		    sizeof(f->answer)) {
+			status = -ENOSPC;
+			answer_size = 0;
+		} else {
+			answer_size = __mfrc522_run_command(state, answer,
+							    &commands[i]);
+			status = min(answer_size, 0);
+			answer_size = max(answer_size, 0);
+		}
+
+		pos += scnprintf(f->answer + pos, sizeof(f->answer) - pos,
+				 "%d:%d:", status, answer_size);
+		memcpy(f->answer + pos, answer, answer_size);
+		pos += answer_size;
+		f->answer[pos++] = '\n';
+	}
+
+	mfrc522_batch_unlock(state);
+
+	f->answer_size = pos;
+	f->answer_pos = 0;
+	f->buffer_full = pos > 0;
+
+	wake_up_interruptible(&state->read_wait);
+
+out:
+	kfree(answer);
+	kfree(commands);
+
+	return count < 0 ? count : len;
+}
+
 static ssize_t mfrc522_write(struct file *file, const char *buffer, size_t len,
 			     loff_t *offset)
 {
-	ssize_t ret;
-	char *answer;
-	struct mfrc522_state *state;
+	struct mfrc522_file *f = file->private_data;
 	char kernel_buffer[MFRC522_MAX_INPUT_LEN] = { 0 };
+	char *input = kernel_buffer;
+	size_t cmd_len;
+	ssize_t ret;
+
+	if (READ_ONCE(f->state->dead))
+		return -ENODEV;
 
-	if (len > MFRC522_MAX_INPUT_LEN)
+	if (len > MFRC522_MAX_BATCH_LEN)
 		return -EINVAL;
 
-	if (copy_from_user(kernel_buffer, buffer, len) != 0) {
+	// Only batches may be longer than a single command
+	if (len > MFRC522_MAX_INPUT_LEN) {
+		input = kmalloc(len, GFP_KERNEL);
+		if (!input)
+			return -ENOMEM;
+	}
+
+	if (copy_from_user(input, buffer, len) != 0) {
 		pr_err("[MFRC522] Fail to copy from user\n");
-		return -EINVAL;
+		ret = -EINVAL;
+		goto out;
 	}
 
-	state = container_of(file->private_data, struct mfrc522_state, misc);
-	answer = state->answer;
+	// echo ends single commands with a newline, which does not make a batch
+	cmd_len = len;
+	if (cmd_len && input[cmd_len - 1] == '\n')
+		cmd_len--;
+
+	mutex_lock(&f->lock);
+
+	if (memchr(input, '\n', cmd_len))
+		ret = mfrc522_write_batch(f, input, len);
+	else if (cmd_len > MFRC522_MAX_INPUT_LEN)
+		ret = -EINVAL;
+	else
+		ret = __mfrc522_write(f, input, cmd_len);
+
+	mutex_unlock(&f->lock);
 
-	pr_info("[MFRC522] Being written to: %.*s\n", len, kernel_buffer);
+	// The trailing newline is consumed along with the command
+	if (ret >= 0)
+		ret = len;
 
-	ret = __mfrc522_write(state, kernel_buffer, len);
+out:
+	if (input != kernel_buffer)
+		kfree(input);
 
 	return ret;
 }
@@ -89,48 +434,329 @@ static ssize_t mfrc522_write(struct file *file, const char *buffer, size_t len,
 static ssize_t mfrc522_read(struct file *file, char *buffer, size_t len,
 			    loff_t *offset)
 {
-	struct mfrc522_state *state;
-	char *answer;
+	struct mfrc522_file *f = file->private_data;
+	struct mfrc522_state *state = f->state;
+	ssize_t ret;
 
-	pr_info("[MFRC522] Being read from\n");
+	mutex_lock(&f->lock);
 
-	state = container_of(file->private_data, struct mfrc522_state, misc);
+	// Once the answer has been read, tag events are returned while polling.
+	// They are shared by every open file of the device
+	if (!f->buffer_full) {
+		mutex_unlock(&f->lock);
 
-	answer = state->answer;
+		if (READ_ONCE(state->dead))
+			return -ENODEV;
 
-	if (!state->buffer_full)
-		return 0;
+		if (!mfrc522_scan_readable(state))
+			return 0;
 
-	if (len > MFRC522_MEM_SIZE)
-		len = MFRC522_MEM_SIZE;
+		return mfrc522_scan_read(state, buffer, len,
+					 file->f_flags & O_NONBLOCK);
+	}
+
+	// Large answers can be read in several chunks
+	if (len > f->answer_size - f->answer_pos)
+		len = f->answer_size - f->answer_pos;
 
-	if (copy_to_user(buffer, answer, len) != 0) {
+	if (copy_to_user(buffer, f->answer + f->answer_pos, len) != 0) {
 		pr_err("[MFRC522] Fail to copy to user\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	f->answer_pos += len;
+	if (f->answer_pos == f->answer_size)
+		f->buffer_full = false;
+
+	ret = len;
+
+out:
+	mutex_unlock(&f->lock);
+
+	return ret;
+}
+
+/**
+ * Copy a request of the binary interface from userspace, and check it
+ *
+ * @param ureq Request in userspace
+ * @param command Filled with the command to execute
+ *
+ * @return 0 on success, a negative number if the request is invalid
+ */
+static int mfrc522_ioc_command(struct mfrc522_ioc_cmd __user *ureq,
+			       struct mfrc522_command *command)
+{
+	const size_t header_len = offsetof(struct mfrc522_ioc_cmd, data);
+	struct mfrc522_ioc_cmd req;
+
+	if (copy_from_user(&req, ureq, header_len))
+		return -EFAULT;
+
+	if (req.opcode > MFRC522_OP_NTAG_READ || req.reserved ||
+	    req.len > MFRC522_MAX_DATA_LEN)
+		return -EINVAL;
+
+	// The internal memory is all there is to write to
+	if (req.opcode == MFRC522_OP_MEM_WRITE && req.len > MFRC522_MEM_SIZE)
 		return -EINVAL;
+
+	memset(command, 0, sizeof(*command));
+	command->cmd = req.opcode;
+	command->data_len = req.len;
+	if (copy_from_user(command->data, ureq->data, req.len))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Write the status and answer of a command back to its request in userspace
+ *
+ * @param ureq Request in userspace
+ * @param answer Answer of the command
+ * @param answer_size Size of the answer, or the negative errno of the command
+ *                    if it failed
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int mfrc522_ioc_answer(struct mfrc522_ioc_cmd __user *ureq,
+			      const char *answer, int answer_size)
+{
+	s32 status = min(answer_size, 0);
+	u32 len = max(answer_size, 0);
+
+	if (put_user(status, &ureq->status) || put_user(len, &ureq->len) ||
+	    copy_to_user(ureq->data, answer, len))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Execute a command received through MFRC522_IOC_EXEC. Unlike the text
+ * interface, nothing is parsed or logged, and the answer is written back to the
+ * caller's request instead of being kept for a later read()
+ *
+ * @param state Device to run the command on
+ * @param ureq Request in userspace
+ *
+ * @return 0 if the command was executed, whatever its status, a negative
+ *         number if the request is invalid
+ */
+static long mfrc522_ioctl_exec(struct mfrc522_state *state,
+			       struct mfrc522_ioc_cmd __user *ureq)
+{
+	struct mfrc522_command command;
+	char *answer;
+	int answer_size;
+	long ret;
+
+	BUILD_BUG_ON(MFRC522_MAX_ANSWER_SIZE > MFRC522_IOC_DATA_SIZE);
+
+	ret = mfrc522_ioc_command(ureq, &command);
+	if (ret < 0)
+		return ret;
+
+	answer = kmalloc(MFRC522_MAX_ANSWER_SIZE, GFP_KERNEL);
+	if (!answer)
+		return -ENOMEM;
+
+	answer_size = mfrc522_run_command(state, answer, &command);
+	if (answer_size == -ENODEV)
+		ret = answer_size;
+	else
+		ret = mfrc522_ioc_answer(ureq, answer, answer_size);
+
+	kfree(answer);
+
+	return ret;
+}
+
+/**
+ * Execute the commands received through MFRC522_IOC_BATCH in order, without any
+ * other SPI traffic in between. Requests are all copied in before the first
+ * command runs, and answers copied back once the last one is over, so that
+ * userspace page faults never happen with the bus locked
+ *
+ * @param state Device to run the commands on
+ * @param ubatch Batch in userspace
+ *
+ * @return 0 if the commands were executed, whatever their status, a negative
+ *         number if any request is invalid
+ */
+static long mfrc522_ioctl_batch(struct mfrc522_state *state,
+				struct mfrc522_ioc_batch __user *ubatch)
+{
+	struct mfrc522_ioc_cmd __user *ureqs;
+	struct mfrc522_command *commands;
+	struct mfrc522_ioc_batch batch;
+	char *answers = NULL;
+	int *answer_sizes = NULL;
+	long ret = 0;
+	u32 i;
+
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+
+	if (!batch.count || batch.count > MFRC522_BATCH_MAX_CMDS ||
+	    batch.reserved)
+		return -EINVAL;
+
+	ureqs = u64_to_user_ptr(batch.cmds);
+
+	commands = kcalloc(batch.count, sizeof(*commands), GFP_KERNEL);
+	if (!commands)
+		return -ENOMEM;
+
+	for (i = 0; i < batch.count && !ret; i++)
+		ret = mfrc522_ioc_command(&ureqs[i], &commands[i]);
+	if (ret < 0)
+		goto out;
+
+	answer_sizes = kcalloc(batch.count, sizeof(*answer_sizes), GFP_KERNEL);
+	answers = kvmalloc_array(batch.count, MFRC522_MAX_ANSWER_SIZE,
+				 GFP_KERNEL);
+	if (!answer_sizes || !answers) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	state->buffer_full = false;
+	ret = mfrc522_batch_lock(state);
+	if (ret < 0)
+		goto out;
 
-	return len;
+	for (i = 0; i < batch.count; i++)
+		answer_sizes[i] = __mfrc522_run_command(state,
+							answers + i * MFRC522_MAX_ANSWER_SIZE,
+							&commands[i]);
+	mfrc522_batch_unlock(state);
+
+	for (i = 0; i < batch.count && !ret; i++)
+		ret = mfrc522_ioc_answer(&ureqs[i],
+					 answers + i * MFRC522_MAX_ANSWER_SIZE,
+					 answer_sizes[i]);
+
+out:
+	kvfree(answers);
+	kfree(answer_sizes);
+	kfree(commands);
+
+	return ret;
+}
+
+static long mfrc522_ioctl(struct file *file, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct mfrc522_file *f = file->private_data;
+
+	if (READ_ONCE(f->state->dead))
+		return -ENODEV;
+
+	switch (cmd) {
+	case MFRC522_IOC_EXEC:
+		return mfrc522_ioctl_exec(f->state, (void __user *)arg);
+	case MFRC522_IOC_BATCH:
+		return mfrc522_ioctl_batch(f->state, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static __poll_t mfrc522_poll(struct file *file, poll_table *wait)
+{
+	struct mfrc522_file *f = file->private_data;
+	struct mfrc522_state *state = f->state;
+	__poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+	poll_wait(file, &state->read_wait, wait);
+
+	if (READ_ONCE(state->dead))
+		return EPOLLERR | EPOLLHUP;
+
+	if (READ_ONCE(f->buffer_full) || mfrc522_scan_pending(state))
+		mask |= EPOLLIN | EPOLLRDNORM;
+
+	return mask;
+}
+
+static int mfrc522_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct mfrc522_file *f = file->private_data;
+
+	return mfrc522_ring_mmap(f->state, vma);
+}
+
+static int mfrc522_open(struct inode *inode, struct file *file)
+{
+	struct mfrc522_file *f;
+
+	f = kmem_cache_alloc(mfrc522_file_cache, GFP_KERNEL);
+	if (!f)
+		return -ENOMEM;
+
+	// The misc core points private_data to the misc device
+	// misc_deregister() waits for it, so the state cannot go away meanwhile
+	f->state = container_of(file->private_data, struct mfrc522_state, misc);
+	mfrc522_state_get(f->state);
+	mutex_init(&f->lock);
+	f->buffer_full = false;
+	f->answer_size = 0;
+	f->answer_pos = 0;
+
+	file->private_data = f;
+
+	return 0;
+}
+
+static int mfrc522_release(struct inode *inode, struct file *file)
+{
+	struct mfrc522_file *f = file->private_data;
+	struct mfrc522_state *state = f->state;
+
+	mutex_destroy(&f->lock);
+	kmem_cache_free(mfrc522_file_cache, f);
+	mfrc522_state_put(state);
+
+	return 0;
 }
 
 static const struct file_operations mfrc522_fops = {
 	.owner = THIS_MODULE,
+	.open = mfrc522_open,
+	.release = mfrc522_release,
 	.write = mfrc522_write,
 	.read = mfrc522_read,
+	.poll = mfrc522_poll,
+	.mmap = mfrc522_mmap,
+	.unlocked_ioctl = mfrc522_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
 };
 
 static const struct of_device_id mfrc522_match_table[] = {
 	{ .compatible = "mfrc522" },
 	{} // NULL entry
 };
+MODULE_DEVICE_TABLE(of, mfrc522_match_table);
+
+/**
+ * Get the state of the device owning a misc device
+ */
+static struct mfrc522_state *to_mfrc522_state(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct mfrc522_state, misc);
+}
 
 static ssize_t bits_read_show(struct device *dev, struct device_attribute *attr,
 			      char *buf)
 {
-	struct mfrc522_state *state = dev_get_drvdata(dev);
+	struct mfrc522_state *state = to_mfrc522_state(dev);
 
-	return snprintf(buf, 8, "%u\n", state->stats.bytes_read * 8);
+	return sysfs_emit(buf, "%llu\n",
+			  (u64)atomic64_read(&state->stats.bytes_read) * 8);
 }
 
 DEVICE_ATTR_RO(bits_read);
@@ -138,16 +764,206 @@ DEVICE_ATTR_RO(bits_read);
 static ssize_t bits_written_show(struct device *dev,
 				 struct device_attribute *attr, char *buf)
 {
-	struct mfrc522_state *state = dev_get_drvdata(dev);
+	struct mfrc522_state *state = to_mfrc522_state(dev);
 
-	return snprintf(buf, 8, "%u\n", state->stats.bytes_written * 8);
+	return sysfs_emit(buf, "%llu\n",
+			  (u64)atomic64_read(&state->stats.bytes_written) * 8);
 }
 
 DEVICE_ATTR_RO(bits_written);
 
+static ssize_t spi_messages_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%llu\n", (u64)mfrc522_stats_spi_messages(state));
+}
+
+DEVICE_ATTR_RO(spi_messages);
+
+static ssize_t spi_errors_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%llu\n",
+			  (u64)atomic64_read(&state->stats.spi.errors));
+}
+
+DEVICE_ATTR_RO(spi_errors);
+
+static ssize_t commands_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+	u64 count = 0;
+	int i;
+
+	for (i = 0; i < MFRC522_STATS_CMDS; i++)
+		count += atomic64_read(&state->stats.cmds[i].count);
+
+	return sysfs_emit(buf, "%llu\n", count);
+}
+
+DEVICE_ATTR_RO(commands);
+
+static ssize_t command_errors_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+	u64 errors = 0;
+	int i;
+
+	for (i = 0; i < MFRC522_STATS_CMDS; i++)
+		errors += atomic64_read(&state->stats.cmds[i].errors);
+
+	return sysfs_emit(buf, "%llu\n", errors);
+}
+
+DEVICE_ATTR_RO(command_errors);
+
+static ssize_t timeouts_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%llu\n",
+			  (u64)atomic64_read(&state->stats.timeouts));
+}
+
+DEVICE_ATTR_RO(timeouts);
+
+static ssize_t spi_messages_last_cmd_show(struct device *dev,
+					  struct device_attribute *attr,
+					  char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%lu\n", state->stats.last_cmd_spi_messages);
+}
+
+DEVICE_ATTR_RO(spi_messages_last_cmd);
+
+static ssize_t last_cmd_latency_ns_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%llu\n", state->stats.last_cmd_latency_ns);
+}
+
+DEVICE_ATTR_RO(last_cmd_latency_ns);
+
+static ssize_t poll_interval_ms_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(state->scan.interval_ms));
+}
+
+static ssize_t poll_interval_ms_store(struct device *dev,
+				      struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+	unsigned int interval;
+	int ret;
+
+	ret = kstrtouint(buf, 10, &interval);
+	if (ret < 0)
+		return ret;
+
+	if (interval < MFRC522_SCAN_MIN_INTERVAL_MS ||
+	    interval > MFRC522_SCAN_MAX_INTERVAL_MS)
+		return -EINVAL;
+
+	WRITE_ONCE(state->scan.interval_ms, interval);
+
+	return count;
+}
+
+DEVICE_ATTR_RW(poll_interval_ms);
+
+static ssize_t events_dropped_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%llu\n",
+			  (u64)atomic64_read(&state->scan.dropped));
+}
+
+DEVICE_ATTR_RO(events_dropped);
+
+static ssize_t spi_clock_hz_show(struct device *dev,
+				 struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%u\n", READ_ONCE(state->spi->max_speed_hz));
+}
+
+DEVICE_ATTR_RO(spi_clock_hz);
+
+static ssize_t spi_clock_calibrate_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+	bool calibrate;
+	int ret;
+
+	ret = kstrtobool(buf, &calibrate);
+	if (ret < 0)
+		return ret;
+
+	if (!calibrate)
+		return count;
+
+	ret = mfrc522_pm_get(state);
+	if (ret < 0)
+		return ret;
+
+	mutex_lock(&state->lock);
+	ret = mfrc522_clock_calibrate(state);
+	mutex_unlock(&state->lock);
+
+	mfrc522_pm_put(state);
+
+	return ret < 0 ? ret : count;
+}
+
+DEVICE_ATTR_WO(spi_clock_calibrate);
+
+static ssize_t wake_latency_ns_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct mfrc522_state *state = to_mfrc522_state(dev);
+
+	return sysfs_emit(buf, "%llu\n",
+			  READ_ONCE(state->stats.last_wake_latency_ns));
+}
+
+DEVICE_ATTR_RO(wake_latency_ns);
+
 static struct attribute *mfrc522_attrs[] = {
 	&dev_attr_bits_read.attr,
 	&dev_attr_bits_written.attr,
+	&dev_attr_spi_messages.attr,
+	&dev_attr_spi_errors.attr,
+	&dev_attr_commands.attr,
+	&dev_attr_command_errors.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_spi_messages_last_cmd.attr,
+	&dev_attr_last_cmd_latency_ns.attr,
+	&dev_attr_poll_interval_ms.attr,
+	&dev_attr_events_dropped.attr,
+	&dev_attr_spi_clock_hz.attr,
+	&dev_attr_spi_clock_calibrate.attr,
+	&dev_attr_wake_latency_ns.attr,
 	NULL,
 };
 
@@ -160,17 +976,6 @@ static const struct attribute_group *mfrc522_groups[] = {
 	NULL,
 };
 
-static int mfrc522_spi_probe(struct spi_device *spi);
-
-static struct spi_driver mfrc522_spi_driver = {
-	.driver = {
-		.name = "mfrc522",
-		.owner = THIS_MODULE,
-		.of_match_table = mfrc522_match_table,
-	},
-	.probe = mfrc522_spi_probe,
-};
-
 /** Detect if the device we are talking to is an MFRC522 using the VersionReg,
  * section 9.3.4.8 of the datasheet
  *
@@ -178,19 +983,20 @@ static struct spi_driver mfrc522_spi_driver = {
  *
  * @return -1 if not an MFRC522, version number otherwise
  */
-static int mfrc522_detect(struct spi_device *client)
+static int mfrc522_detect(struct mfrc522_state *state)
 {
-	u8 version = mfrc522_get_version();
+	u8 version = mfrc522_get_version(state);
 
 	switch (version) {
 	case MFRC522_VERSION_1:
 	case MFRC522_VERSION_2:
 		version = MFRC522_VERSION_NUM(version);
-		pr_info("[MFRC522] MFRC522 version %d detected\n", version);
+		dev_info(&state->spi->dev, "MFRC522 version %d detected\n",
+			 version);
 		return version;
 	default:
-		pr_info("[MFRC522] this chip is not an MFRC522: 0x%x\n",
-			version);
+		dev_info(&state->spi->dev,
+			 "this chip is not an MFRC522: 0x%x\n", version);
 	}
 
 	return -1;
@@ -198,68 +1004,190 @@ static int mfrc522_detect(struct spi_device *client)
 
 static int mfrc522_spi_probe(struct spi_device *client)
 {
-	pr_info("[MFRC522] SPI Probed\n");
+	struct mfrc522_state *state;
+	int ret;
+
+	dev_info(&client->dev, "SPI Probed\n");
+
+	state = kzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return -ENOMEM;
 
-	if (client->max_speed_hz > MFRC522_SPI_MAX_CLOCK_SPEED) {
-		pr_info("[MFRC522] Current speed (%u)Hz is too high. Setting speed to %uHz\n",
-			client->max_speed_hz, MFRC522_SPI_MAX_CLOCK_SPEED);
-		client->max_speed_hz = MFRC522_SPI_MAX_CLOCK_SPEED;
+	kref_init(&state->ref);
+
+	// The device tree's speed is an upper bound for calibration, which
+	// starts from a speed any wiring supports. Boards with long wires set a
+	// lower limit on purpose, which is never raised
+	state->spi_max_hz = min_t(u32, client->max_speed_hz,
+				  MFRC522_SPI_MAX_CLOCK_SPEED);
+	client->max_speed_hz = min_t(u32, state->spi_max_hz,
+				     MFRC522_SPI_SAFE_CLOCK_SPEED);
+
+	state->spi = spi_dev_get(client);
+	state->debug_on = false;
+	mutex_init(&state->lock);
+	init_completion(&state->irq_done);
+	spin_lock_init(&state->pipeline_lock);
+	init_waitqueue_head(&state->read_wait);
+	mfrc522_scan_init(state);
+
+	ret = devm_add_action_or_reset(&client->dev, mfrc522_state_put_action,
+				       state);
+	if (ret < 0)
+		return ret;
+
+	ret = mfrc522_regmap_init(state);
+	if (ret < 0) {
+		dev_err(&client->dev, "Register map initialization failed: %d\n",
+			ret);
+		return ret;
 	}
 
-	// FIXME: Don't register one global clientstruct spi_device *mfrc522_spi;
-	mfrc522_spi = client;
+	if (mfrc522_detect(state) < 0)
+		return -ENODEV;
 
-	return mfrc522_detect(client) < 0;
-}
+	// A previous unbind leaves the chip in soft power-down, which
+	// calibration and the CRC coprocessor check cannot run in
+	ret = mfrc522_pm_wake(state);
+	if (ret < 0) {
+		dev_err(&client->dev, "Leaving soft power-down failed: %d\n",
+			ret);
+		return ret;
+	}
 
-static int __init mfrc522_init(void)
-{
-	int ret;
-	struct mfrc522_state *state;
+	ret = mfrc522_irq_init(state);
+	if (ret < 0) {
+		dev_err(&client->dev, "Interrupt setup failed: %d\n", ret);
+		return ret;
+	}
+
+	if (!state->irq)
+		dev_info(&client->dev,
+			 "No interrupt line, polling for command completion\n");
+
+	if (state->spi_max_hz > MFRC522_SPI_SAFE_CLOCK_SPEED) {
+		ret = mfrc522_clock_calibrate(state);
+		if (ret < 0) {
+			dev_err(&client->dev, "SPI clock calibration failed: %d\n",
+				ret);
+			return ret;
+		}
+	}
 
-	pr_info("MFRC522 init\n");
+	ret = mfrc522_picc_init(state);
+	if (ret < 0) {
+		dev_err(&client->dev, "Tag interface setup failed: %d\n", ret);
+		return ret;
+	}
 
-	state = kcalloc(1, sizeof(*state), GFP_KERNEL);
+	ret = mfrc522_crc_init(state);
+	if (ret < 0) {
+		dev_err(&client->dev, "CRC coprocessor setup failed: %d\n", ret);
+		return ret;
+	}
 
-	if (!state)
-		return -ENOMEM;
+	// The runtime PM callbacks find the state through the driver data
+	spi_set_drvdata(client, state);
+	mfrc522_pm_init(state);
+
+	state->id = ida_alloc(&mfrc522_ida, GFP_KERNEL);
+	if (state->id < 0) {
+		ret = state->id;
+		goto err_pm;
+	}
+
+	snprintf(state->name, MFRC522_NAME_SIZE, "mfrc522_misc%d", state->id);
 
 	state->misc = (struct miscdevice){
 		.minor = MISC_DYNAMIC_MINOR,
-		.name = "mfrc522_misc",
+		.name = state->name,
 		.fops = &mfrc522_fops,
 		.groups = mfrc522_groups,
+		.parent = &client->dev,
 	};
 
-	state->debug_on = false;
-
 	ret = misc_register(&state->misc);
 	if (ret) {
-		pr_err("[MFRC522] Misc device initialization failed\n");
-		return ret;
+		dev_err(&client->dev, "Misc device initialization failed\n");
+		goto err_ida;
 	}
 
-	ret = spi_register_driver(&mfrc522_spi_driver);
-	if (ret) {
-		pr_err("[MFRC522] SPI Register failed\r\n");
-		return ret;
+	ret = mfrc522_rng_init(state);
+	if (ret < 0) {
+		dev_err(&client->dev, "hw_random registration failed: %d\n", ret);
+		goto err_misc;
 	}
 
-	dev_set_drvdata(state->misc.this_device, state);
+	state->debugfs = debugfs_create_dir(state->name, NULL);
+	mfrc522_crc_debugfs_init(state);
+	mfrc522_rng_debugfs_init(state);
+	mfrc522_stats_debugfs_init(state);
+
+	return 0;
+
+err_misc:
+	misc_deregister(&state->misc);
+err_ida:
+	ida_free(&mfrc522_ida, state->id);
+err_pm:
+	mfrc522_pm_exit(state);
+
+	return ret;
+}
+
+static int mfrc522_spi_remove(struct spi_device *client)
+{
+	struct mfrc522_state *state = spi_get_drvdata(client);
+
+	debugfs_remove_recursive(state->debugfs);
+	mfrc522_rng_exit(state);
+	misc_deregister(&state->misc);
 
-	g_state = state;
+	// Open files and mappings of the ring keep the state, but from now on
+	// nothing they do reaches the chip, and waiting readers give up
+	mutex_lock(&state->lock);
+	WRITE_ONCE(state->dead, true);
+	mutex_unlock(&state->lock);
+	wake_up_interruptible(&state->read_wait);
+
+	mfrc522_scan_stop(state);
+	mfrc522_pm_exit(state);
+	mfrc522_debug_enable(state, false);
+	ida_free(&mfrc522_ida, state->id);
 
 	return 0;
 }
 
-static void __exit mfrc522_exit(void)
+static struct spi_driver mfrc522_spi_driver = {
+	.driver = {
+		.name = "mfrc522",
+		.owner = THIS_MODULE,
+		.of_match_table = mfrc522_match_table,
+		.pm = &mfrc522_pm_ops,
+	},
+	.probe = mfrc522_spi_probe,
+	.remove = mfrc522_spi_remove,
+};
+
+static int __init mfrc522_init(void)
 {
-	misc_deregister(&g_state->misc);
-	spi_unregister_driver(&mfrc522_spi_driver);
+	int ret;
+
+	mfrc522_file_cache = KMEM_CACHE(mfrc522_file, 0);
+	if (!mfrc522_file_cache)
+		return -ENOMEM;
 
-	kfree(g_state);
+	ret = spi_register_driver(&mfrc522_spi_driver);
+	if (ret)
+		kmem_cache_destroy(mfrc522_file_cache);
 
-	pr_info("MFRC522 exit\n");
+	return ret;
+}
+
+static void __exit mfrc522_exit(void)
+{
+	spi_unregister_driver(&mfrc522_spi_driver);
+	kmem_cache_destroy(mfrc522_file_cache);
 }
 
 module_init(mfrc522_init);
@@ -3,31 +3,225 @@
 #ifndef MFRC522_MODULE_H
 #define MFRC522_MODULE_H
 
-#define MFRC522_MAX_ANSWER_SIZE 256 // FIXME
+// Large enough for the whole memory of an NTAG216 or a MIFARE Classic 1K
+#define MFRC522_MAX_ANSWER_SIZE 1024
+// Large enough for the answers of several commands sent in a single batch
+#define MFRC522_MAX_BATCH_ANSWER_SIZE 8192
 
 #include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/hw_random.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
 #include <linux/miscdevice.h>
+#include <linux/mutex.h>
+#include <linux/regmap.h>
+#include <linux/spi/spi.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/mfrc522.h>
+
+#define MFRC522_NAME_SIZE 32
+#define MFRC522_EVENT_QUEUE_SIZE 64
+#define MFRC522_MF_MAX_SECTORS 40
+#define MFRC522_MF_KEY_SIZE 6
+#define MFRC522_MF_UID_SIZE 4
+// Commands share their values with the opcodes of the binary interface
+#define MFRC522_STATS_CMDS (MFRC522_OP_NTAG_READ + 1)
+#define MFRC522_STATS_BUCKETS 32
+
+struct dentry;
+struct mfrc522_pipeline;
+
+/**
+ * Latency histogram. Bucket N counts latencies below 2^N nanoseconds and at least
+ * half of that, and the last bucket counts every latency above it
+ */
+struct mfrc522_histogram {
+	atomic64_t buckets[MFRC522_STATS_BUCKETS];
+};
+
+/**
+ * Statistics of a type of command, or of SPI messages. Timeouts are counted
+ * among errors
+ */
+struct mfrc522_op_stats {
+	atomic64_t count;
+	atomic64_t errors;
+	atomic64_t timeouts;
+	struct mfrc522_histogram latency;
+};
 
 /**
  * The mfrc522_statistics structure keeps track of the amounts of bytes written and read
- * by the MFRC522 driver
+ * by the MFRC522 driver, of the outcome and latency of each type of command and
+ * of SPI messages and of wake ups from soft power-down, as well as of the amount of
+ * SPI messages and the end-to-end latency of the last command. Counters are updated without the device's lock,
+ * from SPI completion callbacks and the scan work as well
  */
 struct mfrc522_statistics {
-	unsigned int bytes_read;
-	unsigned int bytes_written;
+	atomic64_t bytes_read;
+	atomic64_t bytes_written;
+	atomic64_t timeouts;
+	struct mfrc522_op_stats cmds[MFRC522_STATS_CMDS];
+	struct mfrc522_op_stats spi;
+	struct mfrc522_op_stats wake;
+	unsigned long last_cmd_spi_messages;
+	u64 last_cmd_latency_ns;
+	u64 last_wake_latency_ns;
+};
+
+/**
+ * Ring of tag events shared with userspace through mmap(). It is allocated on
+ * the first mapping, and records points right after the control page. The
+ * control page is writable by every mapper, so the producer index is kept here
+ * and only copied to it
+ */
+struct mfrc522_ring {
+	struct mfrc522_ring_ctrl *ctrl;
+	struct mfrc522_ring_record *records;
+	u32 head;
+	atomic_t mappings;
 };
 
 /**
- * Keep global information about the MFRC522 driver. This includes the answer buffer,
- * in which the MFRC522's memory content shall be kept between writes and reads, as well
- * as statistics and information
+ * Tag polling state of a device. The scan work runs every interval_ms while
+ * enabled, and pushes tag events into the queue, which is read by userspace,
+ * or into the shared ring while it is mapped. Readers waiting for events sleep
+ * on the device's read_wait
+ */
+struct mfrc522_scan {
+	bool enabled;
+	unsigned int interval_ms;
+	struct delayed_work work;
+
+	bool tag_present;
+	struct mfrc522_tag_event tag;
+
+	DECLARE_KFIFO(events, struct mfrc522_tag_event,
+		      MFRC522_EVENT_QUEUE_SIZE);
+	spinlock_t events_lock;
+	u32 dropped_pending;
+	atomic64_t dropped;
+
+	struct mfrc522_ring ring;
+};
+
+/**
+ * hw_random source of a device, see mfrc522_rng_init(). bytes and busy_ns add up
+ * the random bytes generated and the time spent generating them, with the
+ * device's lock held, which gives the sustained throughput
+ */
+struct mfrc522_rng {
+	struct hwrng hwrng;
+	atomic64_t bytes;
+	atomic64_t busy_ns;
+};
+
+/**
+ * MIFARE Classic key, used either as key A or as key B of a sector
+ */
+struct mfrc522_mf_key {
+	bool valid;
+	bool key_b;
+	u8 bytes[MFRC522_MF_KEY_SIZE];
+};
+
+/**
+ * MIFARE Classic state of a device. Keys are loaded into the keyring once, and
+ * default_key is used for sectors without a key of their own. While a session
+ * is open, the PICC whose UID ends with session_uid is selected, and the Crypto1
+ * unit is authenticated to auth_sector, unless it is negative
+ */
+struct mfrc522_mifare {
+	struct mfrc522_mf_key default_key;
+	struct mfrc522_mf_key keys[MFRC522_MF_MAX_SECTORS];
+
+	bool session;
+	u8 session_uid[MFRC522_MF_UID_SIZE];
+	unsigned int sectors;
+	int auth_sector;
+};
+
+/**
+ * Keep information about an MFRC522 device. One state is allocated per probed chip,
+ * and keeps statistics and information about it. Commands sent to the chip are
+ * serialized by the lock, which is only held while they talk to the chip, and
+ * batches of commands also lock the SPI bus so that no other device's traffic
+ * comes in between. Other devices on the bus wait for the batch to be over
+ *
+ * The state is refcounted, see mfrc522_state_get(): open files and mappings of
+ * the ring keep it alive after the chip is unbound. Unbinding sets dead with the
+ * lock held, after which nothing talks to the chip anymore and file operations
+ * fail with -ENODEV
  */
 struct mfrc522_state {
+	struct kref ref;
+	bool dead;
+
 	struct miscdevice misc;
-	bool buffer_full;
-	char answer[MFRC522_MAX_ANSWER_SIZE];
+	char name[MFRC522_NAME_SIZE];
+	int id;
+
+	struct mutex lock;
+	struct spi_device *spi;
+	struct regmap *regmap;
+	// Fastest SPI clock allowed by the device tree, see mfrc522_clock_calibrate()
+	u32 spi_max_hz;
+	// Set while a batch holds the SPI bus, see mfrc522_batch_lock()
+	bool bus_locked;
+
+	int irq;
+	struct completion irq_done;
+	u8 irq_latched;
+
+	spinlock_t pipeline_lock;
+	struct mfrc522_pipeline *pipeline_active;
+
+	unsigned int crc_hw_min_len;
+
+	wait_queue_head_t read_wait;
 	bool debug_on;
 	struct mfrc522_statistics stats;
+
+	struct mfrc522_scan scan;
+	struct mfrc522_mifare mifare;
+	struct mfrc522_rng rng;
+	struct dentry *debugfs;
+};
+
+/**
+ * Open file of an MFRC522 device. Each one gets its own answer buffer, drawn from
+ * a dedicated slab cache, so that clients sharing a device never see each other's
+ * answers. An answer is read from answer_pos onwards until answer_size is
+ * reached. The lock serializes the commands and reads done through the file,
+ * copies to and from userspace included, without holding up other files
+ */
+struct mfrc522_file {
+	struct mfrc522_state *state;
+	struct mutex lock;
+	bool buffer_full;
+	size_t answer_size;
+	size_t answer_pos;
+	char answer[MFRC522_MAX_BATCH_ANSWER_SIZE];
 };
 
+/**
+ * Take a reference to the state of a device, so that it outlives the unbinding
+ * of the chip
+ *
+ * @param state State to keep alive
+ */
+void mfrc522_state_get(struct mfrc522_state *state);
+
+/**
+ * Drop a reference taken by mfrc522_state_get(). The last one frees the state,
+ * along with its ring
+ *
+ * @param state State to let go of
+ */
+void mfrc522_state_put(struct mfrc522_state *state);
+
 #endif /* ! MFRC522_MODULE_H */
@@ -0,0 +1,220 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "mfrc522_crc.h"
+#include "mfrc522_ntag.h"
+#include "mfrc522_picc.h"
+#include "mfrc522_pipeline.h"
+#include "mfrc522_spi.h"
+
+// NFC Forum Type 2 commands, see the NTAG213/215/216 datasheet, section 10
+#define NTAG_CMD_READ 0x30
+#define NTAG_CMD_FAST_READ 0x3A
+
+// Type 2 PICCs do not support ISO/IEC 14443-4, nor anything else in their SAK
+#define NTAG_SAK 0x00
+
+// PICCs answer refused commands with a 4-bit NAK
+#define NTAG_NAK_SIZE 1
+
+// READ always answers 4 pages, wrapping around at the end of the memory
+#define NTAG_READ_PAGES 4
+
+// The whole answer to FAST_READ has to fit in the FIFO, CRC_A included
+#define NTAG_FAST_READ_MAX_PAGES                                               \
+	((MFRC522_MAX_FIFO_SIZE - MFRC522_CRC_A_SIZE) / MFRC522_NTAG_PAGE_SIZE)
+
+// The last stage of a pipeline reads the answer to the last frame
+#define NTAG_MAX_FRAMES (MFRC522_PIPELINE_MAX_STAGES - 1)
+
+/**
+ * A READ or FAST_READ exchange, and where its answer is read once the pipeline
+ * ran
+ */
+struct ntag_frame {
+	unsigned int first;
+	unsigned int pages;
+	struct mfrc522_picc_rx rx;
+};
+
+/**
+ * Queue the frame reading pages. Type 2 PICCs do not encrypt anything, so the
+ * frame only needs its CRC_A
+ */
+static void ntag_queue_frame(struct mfrc522_state *state,
+			     struct mfrc522_pipeline *p, struct ntag_frame *frame,
+			     bool fast_read)
+{
+	u8 tx[3 + MFRC522_CRC_A_SIZE];
+	size_t rx_pages = NTAG_READ_PAGES;
+	size_t len = 2;
+
+	tx[0] = NTAG_CMD_READ;
+	tx[1] = frame->first;
+
+	if (fast_read) {
+		tx[0] = NTAG_CMD_FAST_READ;
+		tx[2] = frame->first + frame->pages - 1;
+		rx_pages = frame->pages;
+		len = 3;
+	}
+
+	mfrc522_crc_a_append(state, tx, len);
+	mfrc522_picc_queue_transceive(p, tx, len + MFRC522_CRC_A_SIZE, 0, 0,
+				      rx_pages * MFRC522_NTAG_PAGE_SIZE +
+					      MFRC522_CRC_A_SIZE,
+				      &frame->rx);
+}
+
+/**
+ * Check the answer to a frame once its pipeline ran, and copy the pages it read
+ */
+static int ntag_check_frame(struct mfrc522_state *state,
+			    const struct ntag_frame *frame, u8 *buf)
+{
+	const struct mfrc522_picc_rx *rx = &frame->rx;
+	size_t len;
+
+	if (*rx->error & MFRC522_PICC_ERRORS)
+		return -EIO;
+
+	len = mfrc522_picc_rx_len(rx);
+
+	// The PICC lacks the command, or the pages are out of its memory
+	if (len == NTAG_NAK_SIZE)
+		return -EACCES;
+
+	if (len != rx->size)
+		return -EIO;
+
+	if (!mfrc522_crc_a_valid(state, rx->data, rx->size))
+		return -EBADMSG;
+
+	memcpy(buf, rx->data, frame->pages * MFRC522_NTAG_PAGE_SIZE);
+
+	return 0;
+}
+
+/**
+ * Read a range of pages from the selected PICC, as many frames per pipeline as
+ * possible
+ *
+ * @param state Device to talk to
+ * @param first First page to read
+ * @param last Last page to read
+ * @param buf Filled with the content of the pages
+ * @param fast_read Whether to use FAST_READ rather than READ
+ * @param read Filled with the amount of pages read, even on error
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int ntag_read(struct mfrc522_state *state, unsigned int first,
+		     unsigned int last, u8 *buf, bool fast_read,
+		     unsigned int *read)
+{
+	unsigned int max_pages = fast_read ? NTAG_FAST_READ_MAX_PAGES :
+					     NTAG_READ_PAGES;
+	struct ntag_frame frames[NTAG_MAX_FRAMES];
+	struct mfrc522_pipeline *p;
+	unsigned int num_frames;
+	unsigned int page = first;
+	unsigned int i;
+	int ret = 0;
+
+	*read = 0;
+
+	while (page <= last && !ret) {
+		p = mfrc522_pipeline_alloc(state);
+		if (!p)
+			return -ENOMEM;
+
+		for (num_frames = 0; num_frames < NTAG_MAX_FRAMES && page <= last;
+		     num_frames++) {
+			frames[num_frames].first = page;
+			frames[num_frames].pages =
+				min(max_pages, last - page + 1);
+			ntag_queue_frame(state, p, &frames[num_frames],
+					 fast_read);
+			page += frames[num_frames].pages;
+		}
+
+		// The PICC is done once the last pages were read
+		if (page > last)
+			mfrc522_picc_queue_halt(p);
+		else
+			mfrc522_picc_queue_idle(p);
+
+		ret = mfrc522_pipeline_run(p);
+
+		for (i = 0; i < num_frames && !ret; i++) {
+			ret = ntag_check_frame(state, &frames[i],
+					       buf + (frames[i].first - first) *
+							     MFRC522_NTAG_PAGE_SIZE);
+			if (!ret)
+				*read += frames[i].pages;
+		}
+
+		mfrc522_pipeline_free(p);
+	}
+
+	return ret;
+}
+
+/**
+ * Select the Type 2 PICC in the field
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int ntag_activate(struct mfrc522_state *state)
+{
+	struct mfrc522_picc_uid uid;
+	int ret;
+
+	ret = mfrc522_picc_read_uid(state, &uid, false);
+	if (ret < 0)
+		return ret;
+
+	if (uid.sak != NTAG_SAK) {
+		mfrc522_picc_halt(state);
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+int mfrc522_ntag_read_pages(struct mfrc522_state *state, unsigned int first,
+			    unsigned int last, u8 *buf, size_t size)
+{
+	unsigned int read;
+	int ret;
+
+	lockdep_assert_held(&state->lock);
+
+	if (first > last || last >= MFRC522_NTAG_MAX_PAGES)
+		return -EINVAL;
+
+	if ((last - first + 1) * MFRC522_NTAG_PAGE_SIZE > size)
+		return -E2BIG;
+
+	ret = ntag_activate(state);
+	if (ret < 0)
+		return ret;
+
+	ret = ntag_read(state, first, last, buf, true, &read);
+
+	// MIFARE Ultralight and other early PICCs do not know FAST_READ. They
+	// either NAK it or do not answer at all, and go back to IDLE, so they
+	// have to be selected again
+	if (!read && (ret == -EACCES || ret == -ENODATA)) {
+		ret = ntag_activate(state);
+		if (!ret)
+			ret = ntag_read(state, first, last, buf, false, &read);
+	}
+
+	if (ret < 0)
+		return ret;
+
+	return read * MFRC522_NTAG_PAGE_SIZE;
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_NTAG_H
+#define MFRC522_NTAG_H
+
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+#define MFRC522_NTAG_PAGE_SIZE 4
+// Pages are addressed with a single byte
+#define MFRC522_NTAG_MAX_PAGES 256
+
+/**
+ * Read a range of pages of the NFC Forum Type 2 PICC in the field, such as an
+ * NTAG21x or a MIFARE Ultralight. Pages are fetched with FAST_READ, as many as
+ * fit in the FIFO per frame, and frames are chained so that each one goes out in
+ * the same SPI message as the one reading the previous answer. PICCs without
+ * FAST_READ are read again using READ, 4 pages at a time. The PICC is halted
+ * afterwards. Must be called with the device's lock held
+ *
+ * @param state Device to talk to
+ * @param first First page to read
+ * @param last Last page to read
+ * @param buf Filled with the content of the pages
+ * @param size Size of the buffer
+ *
+ * @return The amount of bytes read on success, -ENODATA if no PICC answered,
+ *         another negative number on error
+ */
+int mfrc522_ntag_read_pages(struct mfrc522_state *state, unsigned int first,
+			    unsigned int last, u8 *buf, size_t size);
+
+#endif /* ! MFRC522_NTAG_H */
@@ -3,6 +3,7 @@
 #include "linux/kernel.h"
 #include "mfrc522_user_command.h"
 
+#include <linux/export.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 #include <linux/types.h>
@@ -10,7 +11,7 @@
 #include "mfrc522_parser.h"
 
 #define MFRC522_SEPARATOR ":"
-#define MFRC522_CMD_AMOUNT 5
+#define MFRC522_CMD_AMOUNT 11
 #define MFRC522_MAX_PARAMETER_AMOUNT 2
 
 struct driver_command {
@@ -19,24 +20,51 @@ struct driver_command {
 	u8 cmd;
 };
 
+// Indexed by command, so that finding the name of a command is a lookup
 static const struct driver_command commands[MFRC522_CMD_AMOUNT] = {
-	{ .input = "mem_write",
-	  .parameter_amount = 2,
-	  .cmd = MFRC522_CMD_MEM_WRITE },
-	{ .input = "mem_read",
-	  .parameter_amount = 0,
-	  .cmd = MFRC522_CMD_MEM_READ },
-	{ .input = "gen_rand_id",
-	  .parameter_amount = 0,
-	  .cmd = MFRC522_CMD_GEN_RANDOM },
-	{ .input = "version",
-	  .parameter_amount = 0,
-	  .cmd = MFRC522_CMD_GET_VERSION },
-	{ .input = "debug", .parameter_amount = 1, .cmd = MFRC522_CMD_DEBUG },
+	[MFRC522_CMD_MEM_WRITE] = { .input = "mem_write",
+				    .parameter_amount = 2,
+				    .cmd = MFRC522_CMD_MEM_WRITE },
+	[MFRC522_CMD_MEM_READ] = { .input = "mem_read",
+				   .parameter_amount = 0,
+				   .cmd = MFRC522_CMD_MEM_READ },
+	[MFRC522_CMD_GEN_RANDOM] = { .input = "gen_rand_id",
+				     .parameter_amount = 0,
+				     .cmd = MFRC522_CMD_GEN_RANDOM },
+	[MFRC522_CMD_GET_VERSION] = { .input = "version",
+				      .parameter_amount = 0,
+				      .cmd = MFRC522_CMD_GET_VERSION },
+	[MFRC522_CMD_DEBUG] = { .input = "debug",
+				.parameter_amount = 1,
+				.cmd = MFRC522_CMD_DEBUG },
+	[MFRC522_CMD_POLL] = { .input = "poll",
+			       .parameter_amount = 1,
+			       .cmd = MFRC522_CMD_POLL },
+	[MFRC522_CMD_READ_UID] = { .input = "read_uid",
+				   .parameter_amount = 0,
+				   .cmd = MFRC522_CMD_READ_UID },
+	[MFRC522_CMD_MF_KEY] = { .input = "mf_key",
+				 .parameter_amount = 1,
+				 .cmd = MFRC522_CMD_MF_KEY },
+	[MFRC522_CMD_MF_READ] = { .input = "mf_read",
+				  .parameter_amount = 1,
+				  .cmd = MFRC522_CMD_MF_READ },
+	[MFRC522_CMD_MF_WRITE] = { .input = "mf_write",
+				   .parameter_amount = 1,
+				   .cmd = MFRC522_CMD_MF_WRITE },
+	[MFRC522_CMD_NTAG_READ] = { .input = "ntag_read",
+				    .parameter_amount = 1,
+				    .cmd = MFRC522_CMD_NTAG_READ },
 };
 
+// Key telling command names apart from their length and first two characters
+#define MFRC522_CMD_KEY(len, c0, c1) ((len) << 16 | (c0) << 8 | (c1))
+
 /**
- * Get the command associated with a command name
+ * Get the command associated with a command name. Names are told apart by a
+ * switch over their length and first two characters, so only one string
+ * comparison is made whatever the amount of commands. Two names sharing a key
+ * do not compile, as their case labels are duplicates
  *
  * @param token Command name found during parsing
  *
@@ -45,14 +73,65 @@ static const struct driver_command commands[MFRC522_CMD_AMOUNT] = {
  */
 static const struct driver_command *find_cmd_from_token(const char *token)
 {
-	size_t i;
+	size_t len = strnlen(token, MFRC522_MAX_INPUT_LEN);
+	const struct driver_command *command;
+
+	if (len < 2)
+		return NULL;
+
+	switch (MFRC522_CMD_KEY(len, (u8)token[0], (u8)token[1])) {
+	case MFRC522_CMD_KEY(9, 'm', 'e'):
+		command = &commands[MFRC522_CMD_MEM_WRITE];
+		break;
+	case MFRC522_CMD_KEY(8, 'm', 'e'):
+		command = &commands[MFRC522_CMD_MEM_READ];
+		break;
+	case MFRC522_CMD_KEY(11, 'g', 'e'):
+		command = &commands[MFRC522_CMD_GEN_RANDOM];
+		break;
+	case MFRC522_CMD_KEY(7, 'v', 'e'):
+		command = &commands[MFRC522_CMD_GET_VERSION];
+		break;
+	case MFRC522_CMD_KEY(5, 'd', 'e'):
+		command = &commands[MFRC522_CMD_DEBUG];
+		break;
+	case MFRC522_CMD_KEY(4, 'p', 'o'):
+		command = &commands[MFRC522_CMD_POLL];
+		break;
+	case MFRC522_CMD_KEY(8, 'r', 'e'):
+		command = &commands[MFRC522_CMD_READ_UID];
+		break;
+	case MFRC522_CMD_KEY(6, 'm', 'f'):
+		command = &commands[MFRC522_CMD_MF_KEY];
+		break;
+	case MFRC522_CMD_KEY(7, 'm', 'f'):
+		command = &commands[MFRC522_CMD_MF_READ];
+		break;
+	case MFRC522_CMD_KEY(8, 'm', 'f'):
+		command = &commands[MFRC522_CMD_MF_WRITE];
+		break;
+	case MFRC522_CMD_KEY(9, 'n', 't'):
+		command = &commands[MFRC522_CMD_NTAG_READ];
+		break;
+	default:
+		return NULL;
+	}
 
-	for (i = 0; i < MFRC522_CMD_AMOUNT; i++)
-		if (!strcmp(token, commands[i].input))
-			return &commands[i];
+	if (memcmp(token + 2, command->input + 2, len - 1))
+		return NULL;
+
+	return command;
+}
+
+const char *mfrc522_command_name(u8 cmd)
+{
+	if (cmd >= MFRC522_CMD_AMOUNT)
+		return "unknown";
 
-	return NULL;
+	return commands[cmd].input;
 }
+// Used by the KUnit suite, which is a module of its own
+EXPORT_SYMBOL_GPL(mfrc522_command_name);
 
 /**
  * Parse a command with multiple arguments
@@ -76,7 +155,7 @@ static int parse_multi_arg(struct mfrc522_command *cmd, char *input,
 
 	if (ref_cmd->parameter_amount == 1) {
 		extra_data = token;
-		extra_data_len = strnlen(extra_data, 4);
+		extra_data_len = strnlen(extra_data, MFRC522_MAX_DATA_LEN);
 		goto finish;
 	}
 
@@ -95,9 +174,9 @@ static int parse_multi_arg(struct mfrc522_command *cmd, char *input,
 		return ret;
 	}
 
-	if (extra_data_len > MFRC522_MAX_DATA_LEN) {
-		pr_err("[MFRC522] Invalid parameter for Data length: Length %d is too important (max length: 25)\n",
-		       extra_data_len);
+	if (extra_data_len > MFRC522_MEM_SIZE) {
+		pr_err("[MFRC522] Invalid parameter for Data length: Length %d is too important (max length: %d)\n",
+		       extra_data_len, MFRC522_MEM_SIZE);
 		return -1;
 	}
 
@@ -162,3 +241,4 @@ int mfrc522_parse(struct mfrc522_command *cmd, const char *input, size_t len)
 
 	return parse_multi_arg(cmd, input_mut, command);
 }
+EXPORT_SYMBOL_GPL(mfrc522_parse);
@@ -8,6 +8,8 @@
 #include "mfrc522_user_command.h"
 
 #define MFRC522_MAX_INPUT_LEN 255
+// Longest write(), for newline-separated batches of commands
+#define MFRC522_MAX_BATCH_LEN 4096
 
 /**
  * Parse and check input sent to the MFRC522. Return the command asked by the user
@@ -21,4 +23,13 @@
  */
 int mfrc522_parse(struct mfrc522_command *cmd, const char *input, size_t len);
 
+/**
+ * Get the name of a command, as expected by mfrc522_parse()
+ *
+ * @param cmd Command, as defined in the MFRC522_CMD_* values
+ *
+ * @return The name of the command, or "unknown"
+ */
+const char *mfrc522_command_name(u8 cmd);
+
 #endif /* !MFRC522_PARSER_H */
@@ -0,0 +1,197 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * KUnit tests for the text command parser, along with a measure of the cost of
+ * parsing each command. Built as mfrc522_parser_test.ko with
+ * make CONFIG_MFRC522_KUNIT_TEST=m on a kernel with CONFIG_KUNIT, the suite runs
+ * when that module is loaded, after mfrc522.ko
+ */
+
+#include <kunit/test.h>
+#include <linux/ktime.h>
+#include <linux/module.h>
+#include <linux/string.h>
+
+#include "mfrc522_parser.h"
+#include "mfrc522_user_command.h"
+
+#define MFRC522_PARSER_BENCH_ROUNDS 10000
+
+struct mfrc522_parser_case {
+	const char *input;
+	int cmd;
+	const char *data;
+};
+
+// Valid inputs. A command without parameter has no data. rust-module/parser.rs
+// differs on two of them: it refuses "mem_write:0:", and takes "get_version"
+static const struct mfrc522_parser_case mfrc522_parser_valid[] = {
+	{ "version", MFRC522_CMD_GET_VERSION, "" },
+	{ "mem_read", MFRC522_CMD_MEM_READ, "" },
+	{ "gen_rand_id", MFRC522_CMD_GEN_RANDOM, "" },
+	{ "read_uid", MFRC522_CMD_READ_UID, "" },
+	{ "mem_write:3:Hey", MFRC522_CMD_MEM_WRITE, "Hey" },
+	{ "mem_write:25:0123456789abcdefghijklmno", MFRC522_CMD_MEM_WRITE,
+	  "0123456789abcdefghijklmno" },
+	{ "mem_write:0:", MFRC522_CMD_MEM_WRITE, "" },
+	// Data past the given length is dropped
+	{ "mem_write:2:Hey", MFRC522_CMD_MEM_WRITE, "He" },
+	{ "debug:on", MFRC522_CMD_DEBUG, "on" },
+	{ "poll:off", MFRC522_CMD_POLL, "off" },
+	{ "mf_key:*,A,FFFFFFFFFFFF", MFRC522_CMD_MF_KEY, "*,A,FFFFFFFFFFFF" },
+	{ "mf_read:0-15", MFRC522_CMD_MF_READ, "0-15" },
+	{ "mf_write:4,000102030405060708090A0B0C0D0E0F", MFRC522_CMD_MF_WRITE,
+	  "4,000102030405060708090A0B0C0D0E0F" },
+	{ "ntag_read:0-230", MFRC522_CMD_NTAG_READ, "0-230" },
+};
+
+// Invalid inputs: unknown commands, and wrong amounts or kinds of parameters
+static const char *const mfrc522_parser_invalid[] = {
+	"",
+	"m",
+	"not_a_cmd",
+	"get_version",
+	// Same length and first two characters as existing commands
+	"mem_reed",
+	"mf_kez",
+	"ntag_reax",
+	"VERSION",
+	"version ",
+	"mem_write",
+	"mem_write:3",
+	"mem_write:NotANumber:Hey",
+	"mem_write:3.0:Hey",
+	"mem_write:-15:Hey",
+	"mem_write:26:Hey",
+	"mem_write:3599:Hey",
+	"mem_write::Hey",
+	"version:",
+	"debug",
+	"mf_read",
+	"ntag_read",
+};
+
+static void mfrc522_parser_test_valid(struct kunit *test)
+{
+	const struct mfrc522_parser_case *c;
+	struct mfrc522_command cmd;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(mfrc522_parser_valid); i++) {
+		c = &mfrc522_parser_valid[i];
+
+		KUNIT_ASSERT_EQ_MSG(test,
+				    mfrc522_parse(&cmd, c->input, strlen(c->input)),
+				    0, "input: \"%s\"", c->input);
+		KUNIT_EXPECT_EQ_MSG(test, cmd.cmd, c->cmd, "input: \"%s\"",
+				    c->input);
+		KUNIT_EXPECT_STREQ_MSG(test, cmd.data, c->data, "input: \"%s\"",
+				       c->input);
+	}
+}
+
+static void mfrc522_parser_test_invalid(struct kunit *test)
+{
+	struct mfrc522_command cmd;
+	const char *input;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(mfrc522_parser_invalid); i++) {
+		input = mfrc522_parser_invalid[i];
+
+		KUNIT_EXPECT_LT_MSG(test, mfrc522_parse(&cmd, input, strlen(input)),
+				    0, "input: \"%s\"", input);
+	}
+}
+
+static void mfrc522_parser_test_len(struct kunit *test)
+{
+	static const char input[] = "mem_write:3:HeyHey";
+	struct mfrc522_command cmd;
+
+	// User input is not NUL-terminated, so only its length bounds it
+	KUNIT_ASSERT_EQ(test, mfrc522_parse(&cmd, "versionXYZ", 7), 0);
+	KUNIT_EXPECT_EQ(test, cmd.cmd, MFRC522_CMD_GET_VERSION);
+
+	KUNIT_EXPECT_LT(test, mfrc522_parse(&cmd, "version", 4), 0);
+
+	KUNIT_ASSERT_EQ(test, mfrc522_parse(&cmd, input, 14), 0);
+	KUNIT_EXPECT_STREQ(test, cmd.data, "He");
+}
+
+static void mfrc522_parser_test_names(struct kunit *test)
+{
+	struct mfrc522_command cmd;
+	const char *name;
+	char input[32];
+	int cmd_byte;
+
+	// Every command is found from its own name
+	for (cmd_byte = 0; cmd_byte <= MFRC522_CMD_NTAG_READ; cmd_byte++) {
+		name = mfrc522_command_name(cmd_byte);
+		KUNIT_ASSERT_STRNEQ(test, name, "unknown");
+
+		// Commands taking parameters need some
+		if (mfrc522_parse(&cmd, name, strlen(name))) {
+			if (cmd_byte == MFRC522_CMD_MEM_WRITE)
+				snprintf(input, sizeof(input), "%s:1:x", name);
+			else
+				snprintf(input, sizeof(input), "%s:x", name);
+
+			KUNIT_ASSERT_EQ_MSG(test,
+					    mfrc522_parse(&cmd, input,
+							  strlen(input)),
+					    0, "input: \"%s\"", input);
+		}
+
+		KUNIT_EXPECT_EQ_MSG(test, cmd.cmd, cmd_byte, "name: \"%s\"",
+				    name);
+	}
+
+	KUNIT_EXPECT_STREQ(test, mfrc522_command_name(MFRC522_CMD_NTAG_READ + 1),
+			   "unknown");
+}
+
+static void mfrc522_parser_bench(struct kunit *test)
+{
+	const struct mfrc522_parser_case *c;
+	struct mfrc522_command cmd;
+	size_t len;
+	u64 start;
+	u64 ns;
+	size_t i;
+	int j;
+
+	for (i = 0; i < ARRAY_SIZE(mfrc522_parser_valid); i++) {
+		c = &mfrc522_parser_valid[i];
+		len = strlen(c->input);
+
+		start = ktime_get_ns();
+		for (j = 0; j < MFRC522_PARSER_BENCH_ROUNDS; j++)
+			mfrc522_parse(&cmd, c->input, len);
+		ns = ktime_get_ns() - start;
+
+		kunit_info(test, "%-48s %6llu ns/parse\n", c->input,
+			   div_u64(ns, MFRC522_PARSER_BENCH_ROUNDS));
+	}
+}
+
+static struct kunit_case mfrc522_parser_test_cases[] = {
+	KUNIT_CASE(mfrc522_parser_test_valid),
+	KUNIT_CASE(mfrc522_parser_test_invalid),
+	KUNIT_CASE(mfrc522_parser_test_len),
+	KUNIT_CASE(mfrc522_parser_test_names),
+	KUNIT_CASE(mfrc522_parser_bench),
+	{}
+};
+
+static struct kunit_suite mfrc522_parser_test_suite = {
+	.name = "mfrc522_parser",
+	.test_cases = mfrc522_parser_test_cases,
+};
+
+kunit_test_suite(mfrc522_parser_test_suite);
+
+MODULE_LICENSE("GPL v2");
+MODULE_AUTHOR("ks0n");
+MODULE_DESCRIPTION("KUnit tests of the MFRC522 text parser");
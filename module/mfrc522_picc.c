@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/kernel.h>
+#include <linux/regmap.h>
+#include <linux/string.h>
+
+#include "mfrc522_crc.h"
+#include "mfrc522_picc.h"
+#include "mfrc522_pipeline.h"
+#include "mfrc522_spi.h"
+
+// ISO/IEC 14443-3 type A commands
+#define PICC_CMD_WUPA 0x52
+#define PICC_CMD_HLTA 0x50
+#define PICC_CMD_SEL_CL1 0x93
+#define PICC_CMD_SEL_CL2 0x95
+#define PICC_CMD_SEL_CL3 0x97
+
+#define PICC_CASCADE_LEVELS 3
+// Sent as the first UID byte of a cascade level when the UID does not fit in it
+#define PICC_CASCADE_TAG 0x88
+#define PICC_SAK_UID_INCOMPLETE BIT(2)
+
+// REQA and WUPA are short frames of 7 bits
+#define PICC_SHORT_FRAME_BITS 7
+#define PICC_ATQA_SIZE 2
+#define PICC_SAK_SIZE (1 + MFRC522_CRC_A_SIZE)
+
+// A cascade level holds 4 UID bytes and their BCC
+#define PICC_CL_UID_SIZE 4
+#define PICC_CL_SIZE (PICC_CL_UID_SIZE + 1)
+#define PICC_CL_BITS (PICC_CL_UID_SIZE * 8)
+
+// The NVB byte holds the amount of valid bytes and bits sent, SEL and NVB
+// included
+#define PICC_NVB(bits) ((2 + (bits) / 8) << 4 | (bits) % 8)
+#define PICC_NVB_SELECT PICC_NVB(PICC_CL_SIZE * 8)
+
+// The timer ticks every 2 * 0xA9 + 1 periods of the 13.56MHz clock, i.e. 25us
+#define MFRC522_TIMER_PRESCALER 0xA9
+#define MFRC522_TIMER_TICK_US 25
+#define MFRC522_TIMER_MAX_TICKS 0xFFFF
+
+// PICCs answer activation frames after about 90us. The timer stops as soon as an
+// answer starts, so not getting one after 1ms means that no PICC is there
+#define PICC_ACTIVATION_TIMEOUT_US 1000
+#define PICC_ACTIVATION_TIMEOUT_TICKS                                          \
+	(PICC_ACTIVATION_TIMEOUT_US / MFRC522_TIMER_TICK_US)
+
+/**
+ * State of the anticollision loop of a cascade level
+ */
+struct picc_anticoll {
+	// SEL, NVB, then the UID bytes of the cascade level and their BCC
+	u8 frame[2 + PICC_CL_SIZE];
+	unsigned int known_bits;
+};
+
+static const struct reg_sequence mfrc522_picc_init_seq[] = {
+	{ MFRC522_T_MODE_REG,
+	  MFRC522_T_MODE_REG_T_AUTO | (MFRC522_TIMER_PRESCALER >> 8) },
+	{ MFRC522_T_PRESCALER_REG, MFRC522_TIMER_PRESCALER & 0xFF },
+	{ MFRC522_T_RELOAD_MSB_REG, PICC_ACTIVATION_TIMEOUT_TICKS >> 8 },
+	{ MFRC522_T_RELOAD_LSB_REG, PICC_ACTIVATION_TIMEOUT_TICKS & 0xFF },
+	{ MFRC522_TX_ASK_REG, MFRC522_TX_ASK_REG_FORCE_100_ASK },
+};
+
+int mfrc522_picc_init(struct mfrc522_state *state)
+{
+	u8 antenna = MFRC522_TX_CONTROL_REG_TX1_RF_EN |
+		     MFRC522_TX_CONTROL_REG_TX2_RF_EN;
+	int ret;
+
+	ret = regmap_multi_reg_write(state->regmap, mfrc522_picc_init_seq,
+				     ARRAY_SIZE(mfrc522_picc_init_seq));
+	if (ret < 0)
+		return ret;
+
+	return mfrc522_register_update_bits(state, MFRC522_TX_CONTROL_REG,
+					    antenna, antenna);
+}
+
+int mfrc522_picc_set_timeout(struct mfrc522_state *state,
+			     unsigned int timeout_us)
+{
+	unsigned int ticks = min_t(unsigned int,
+				   DIV_ROUND_UP(timeout_us, MFRC522_TIMER_TICK_US),
+				   MFRC522_TIMER_MAX_TICKS);
+	int ret;
+
+	// TReloadReg is cached, so nothing is sent unless the timeout changed
+	ret = mfrc522_register_write(state, MFRC522_T_RELOAD_MSB_REG, ticks >> 8);
+	if (ret < 0)
+		return ret;
+
+	return mfrc522_register_write(state, MFRC522_T_RELOAD_LSB_REG,
+				      ticks & 0xFF);
+}
+
+void mfrc522_picc_queue_idle(struct mfrc522_pipeline *p)
+{
+	mfrc522_pipeline_write(p, MFRC522_COMMAND_REG,
+			       mfrc522_command_byte(MFRC522_COMMAND_REG_RCV_ON,
+						    MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+						    MFRC522_COMMAND_IDLE));
+	mfrc522_pipeline_write(p, MFRC522_CONTROL_REG,
+			       MFRC522_CONTROL_REG_T_STOP_NOW);
+}
+
+void mfrc522_picc_queue_frame(struct mfrc522_pipeline *p, const u8 *tx,
+			      size_t tx_len)
+{
+	mfrc522_picc_queue_idle(p);
+	mfrc522_pipeline_write(p, MFRC522_FIFO_LEVEL_REG,
+			       MFRC522_FIFO_LEVEL_REG_FLUSH);
+	mfrc522_pipeline_write_burst(p, MFRC522_FIFO_DATA_REG, tx, tx_len);
+}
+
+void mfrc522_picc_queue_transceive(struct mfrc522_pipeline *p, const u8 *tx,
+				   size_t tx_len, u8 tx_last_bits, u8 rx_align,
+				   size_t rx_size, struct mfrc522_picc_rx *rx)
+{
+	mfrc522_picc_queue_frame(p, tx, tx_len);
+	mfrc522_pipeline_transceive(p, tx_last_bits, rx_align);
+
+	// The answer's size is bounded, so the FIFO can be drained in the same
+	// message as the one reading its level
+	rx->error = mfrc522_pipeline_read(p, MFRC522_ERROR_REG, 1);
+	rx->coll = mfrc522_pipeline_read(p, MFRC522_COLL_REG, 1);
+	rx->level = mfrc522_pipeline_read(p, MFRC522_FIFO_LEVEL_REG, 1);
+	rx->data = mfrc522_pipeline_read(p, MFRC522_FIFO_DATA_REG, rx_size);
+	rx->size = rx_size;
+}
+
+size_t mfrc522_picc_rx_len(const struct mfrc522_picc_rx *rx)
+{
+	return min_t(size_t, *rx->level & MFRC522_FIFO_LEVEL_REG_LEVEL_MASK,
+		     rx->size);
+}
+
+/**
+ * Queue a WUPA, waking up the PICCs in the field, including halted ones. The
+ * Crypto1 unit is turned off first, since it would otherwise encrypt WUPA if a
+ * MIFARE Classic PICC was authenticated
+ */
+static void picc_queue_wake_up(struct mfrc522_pipeline *p,
+			       struct mfrc522_picc_rx *rx)
+{
+	u8 wupa = PICC_CMD_WUPA;
+
+	mfrc522_pipeline_write(p, MFRC522_STATUS_2_REG, 0);
+	mfrc522_picc_queue_transceive(p, &wupa, 1, PICC_SHORT_FRAME_BITS, 0,
+			      PICC_ATQA_SIZE, rx);
+}
+
+/**
+ * Check the ATQA answered to WUPA
+ *
+ * @return 0 if at least one PICC answered properly, a negative number otherwise
+ */
+static int picc_wake_up_check(const struct mfrc522_picc_rx *rx)
+{
+	// PICCs answer all at once, so their ATQAs colliding is expected
+	if (*rx->error & MFRC522_ERROR_COLL_ERR)
+		return 0;
+
+	if (*rx->error & MFRC522_PICC_ERRORS || mfrc522_picc_rx_len(rx) != PICC_ATQA_SIZE)
+		return -EIO;
+
+	return 0;
+}
+
+void mfrc522_picc_queue_halt(struct mfrc522_pipeline *p)
+{
+	u8 frame[2 + MFRC522_CRC_A_SIZE] = { PICC_CMD_HLTA, 0 };
+
+	// A PICC acknowledges HLTA by not answering, so it is sent using Transmit,
+	// which ends by itself
+	mfrc522_crc_a_append(p->state, frame, 2);
+
+	mfrc522_picc_queue_frame(p, frame, sizeof(frame));
+	mfrc522_pipeline_command(p, MFRC522_COMMAND_REG_RCV_ON,
+				 MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+				 MFRC522_COMMAND_TRANSMIT);
+}
+
+static void picc_anticoll_init(struct picc_anticoll *ac, u8 sel)
+{
+	memset(ac, 0, sizeof(*ac));
+	ac->frame[0] = sel;
+}
+
+/**
+ * Queue the next round of the anticollision loop, sending the part of the UID
+ * which is already known
+ */
+static void picc_anticoll_queue(struct mfrc522_pipeline *p,
+				struct picc_anticoll *ac, struct mfrc522_picc_rx *rx)
+{
+	unsigned int known_bytes = ac->known_bits / 8;
+	u8 last_bits = ac->known_bits % 8;
+
+	ac->frame[1] = PICC_NVB(ac->known_bits);
+
+	// The PICC only sends the bits which are still unknown. The first one is
+	// stored right after the last bit sent, in the middle of a byte if needed
+	mfrc522_picc_queue_transceive(p, ac->frame, 2 + known_bytes + !!last_bits,
+			      last_bits, last_bits, PICC_CL_SIZE - known_bytes,
+			      rx);
+}
+
+/**
+ * Merge the answer to an anticollision round into the known part of the UID.
+ * Whenever several PICCs answered with different bits, the PICCs having a 1 are
+ * kept, and another round is needed so that the other PICCs stop answering
+ *
+ * @return 0 once the UID of the cascade level is known, -EAGAIN if another round
+ *         is needed, another negative number on error
+ */
+static int picc_anticoll_update(struct picc_anticoll *ac,
+				const struct mfrc522_picc_rx *rx)
+{
+	u8 *cl = ac->frame + 2;
+	unsigned int known_bytes = ac->known_bits / 8;
+	u8 low_mask = BIT(ac->known_bits % 8) - 1;
+	unsigned int coll_pos;
+
+	cl[known_bytes] = (cl[known_bytes] & low_mask) |
+			  (rx->data[0] & ~low_mask);
+	memcpy(cl + known_bytes + 1, rx->data + 1, rx->size - 1);
+
+	if (!(*rx->error & MFRC522_ERROR_COLL_ERR)) {
+		if (*rx->error & MFRC522_PICC_ERRORS || mfrc522_picc_rx_len(rx) != rx->size)
+			return -EIO;
+
+		if (cl[0] ^ cl[1] ^ cl[2] ^ cl[3] ^ cl[4])
+			return -EBADMSG;
+
+		return 0;
+	}
+
+	if (*rx->coll & MFRC522_COLL_REG_POS_NOT_VALID)
+		return -EIO;
+
+	// CollPos counts from 1, and 0 means the 32nd bit
+	coll_pos = *rx->coll & MFRC522_COLL_REG_POS_MASK;
+	if (!coll_pos)
+		coll_pos = PICC_CL_BITS;
+
+	if (coll_pos <= ac->known_bits)
+		return -EPROTO;
+
+	// Keep the PICCs having a 1 at the collision
+	ac->known_bits = coll_pos;
+	cl[(coll_pos - 1) / 8] |= BIT((coll_pos - 1) % 8);
+
+	return -EAGAIN;
+}
+
+/**
+ * Queue a SELECT of the PICC whose cascade level UID is known
+ */
+static void picc_select_queue(struct mfrc522_pipeline *p,
+			      const struct picc_anticoll *ac,
+			      struct mfrc522_picc_rx *rx)
+{
+	u8 frame[2 + PICC_CL_SIZE + MFRC522_CRC_A_SIZE] = { ac->frame[0],
+							    PICC_NVB_SELECT };
+
+	memcpy(frame + 2, ac->frame + 2, PICC_CL_SIZE);
+	mfrc522_crc_a_append(p->state, frame, 2 + PICC_CL_SIZE);
+
+	mfrc522_picc_queue_transceive(p, frame, sizeof(frame), 0, 0, PICC_SAK_SIZE, rx);
+}
+
+/**
+ * Check the answer to SELECT
+ *
+ * @param state Device which received the answer
+ * @param rx Answer to SELECT
+ * @param sak Filled with the SAK answered by the PICC
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int picc_select_check(struct mfrc522_state *state,
+			     const struct mfrc522_picc_rx *rx, u8 *sak)
+{
+	if (*rx->error & MFRC522_PICC_ERRORS || mfrc522_picc_rx_len(rx) != PICC_SAK_SIZE)
+		return -EIO;
+
+	if (!mfrc522_crc_a_valid(state, rx->data, PICC_SAK_SIZE))
+		return -EBADMSG;
+
+	*sak = rx->data[0];
+
+	return 0;
+}
+
+/**
+ * Finish the anticollision loop of a cascade level, whose first round already ran.
+ * Further rounds are run until the UID of the cascade level is known
+ *
+ * @param state Device to talk to
+ * @param p Pipeline which ran the first round, freed by this function
+ * @param ac Anticollision loop state
+ * @param rx Where the pipeline read the answer to the first round
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int picc_anticoll_finish(struct mfrc522_state *state,
+				struct mfrc522_pipeline *p,
+				struct picc_anticoll *ac, struct mfrc522_picc_rx *rx)
+{
+	int ret = picc_anticoll_update(ac, rx);
+
+	while (ret == -EAGAIN) {
+		mfrc522_pipeline_free(p);
+
+		p = mfrc522_pipeline_alloc(state);
+		if (!p)
+			return -ENOMEM;
+
+		picc_anticoll_queue(p, ac, rx);
+		mfrc522_picc_queue_idle(p);
+
+		ret = mfrc522_pipeline_run(p);
+		if (!ret)
+			ret = picc_anticoll_update(ac, rx);
+	}
+
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+int mfrc522_picc_read_uid(struct mfrc522_state *state,
+			  struct mfrc522_picc_uid *uid, bool halt)
+{
+	static const u8 sel[PICC_CASCADE_LEVELS] = {
+		PICC_CMD_SEL_CL1,
+		PICC_CMD_SEL_CL2,
+		PICC_CMD_SEL_CL3,
+	};
+	struct mfrc522_picc_rx atqa_rx;
+	struct mfrc522_picc_rx cl_rx;
+	struct mfrc522_picc_rx sak_rx;
+	struct picc_anticoll ac;
+	struct mfrc522_pipeline *p;
+	u8 cl[PICC_CL_SIZE];
+	unsigned int level;
+	bool cascade;
+	u8 sak;
+	int ret;
+
+	// Waking PICCs up puts an end to any MIFARE Classic session
+	state->mifare.session = false;
+
+	ret = mfrc522_picc_set_timeout(state, PICC_ACTIVATION_TIMEOUT_US);
+	if (ret < 0)
+		return ret;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	// The first anticollision round does not depend on the ATQA, so it goes
+	// out in the same message as the one reading it
+	picc_queue_wake_up(p, &atqa_rx);
+	picc_anticoll_init(&ac, sel[0]);
+	picc_anticoll_queue(p, &ac, &cl_rx);
+	mfrc522_picc_queue_idle(p);
+
+	ret = mfrc522_pipeline_run(p);
+	if (!ret)
+		ret = picc_wake_up_check(&atqa_rx);
+	if (ret < 0) {
+		mfrc522_pipeline_free(p);
+		return ret;
+	}
+
+	uid->size = 0;
+
+	for (level = 0; level < PICC_CASCADE_LEVELS; level++) {
+		ret = picc_anticoll_finish(state, p, &ac, &cl_rx);
+		if (ret < 0)
+			return ret;
+
+		memcpy(cl, ac.frame + 2, PICC_CL_SIZE);
+
+		p = mfrc522_pipeline_alloc(state);
+		if (!p)
+			return -ENOMEM;
+
+		picc_select_queue(p, &ac, &sak_rx);
+
+		// A cascade tag announces that the UID goes on at the next level,
+		// whose first anticollision round can then go out in the same
+		// message as the one reading the SAK. Otherwise, this is the last
+		// level, and the PICC can be halted in that message instead
+		cascade = cl[0] == PICC_CASCADE_TAG &&
+			  level + 1 < PICC_CASCADE_LEVELS;
+		if (cascade) {
+			picc_anticoll_init(&ac, sel[level + 1]);
+			picc_anticoll_queue(p, &ac, &cl_rx);
+		} else if (halt) {
+			mfrc522_picc_queue_halt(p);
+		} else {
+			mfrc522_picc_queue_idle(p);
+		}
+
+		ret = mfrc522_pipeline_run(p);
+		if (!ret)
+			ret = picc_select_check(state, &sak_rx, &sak);
+		if (ret < 0)
+			break;
+
+		if (!cascade) {
+			if (sak & PICC_SAK_UID_INCOMPLETE) {
+				ret = -EPROTO;
+				break;
+			}
+
+			memcpy(uid->bytes + uid->size, cl, PICC_CL_UID_SIZE);
+			uid->size += PICC_CL_UID_SIZE;
+			uid->sak = sak;
+			break;
+		}
+
+		if (!(sak & PICC_SAK_UID_INCOMPLETE)) {
+			ret = -EPROTO;
+			break;
+		}
+
+		memcpy(uid->bytes + uid->size, cl + 1, PICC_CL_UID_SIZE - 1);
+		uid->size += PICC_CL_UID_SIZE - 1;
+	}
+
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+int mfrc522_picc_halt(struct mfrc522_state *state)
+{
+	struct mfrc522_pipeline *p;
+	int ret;
+
+	state->mifare.session = false;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	mfrc522_picc_queue_halt(p);
+
+	ret = mfrc522_pipeline_run(p);
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_PICC_H
+#define MFRC522_PICC_H
+
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+#define MFRC522_PICC_UID_MAX_SIZE 10
+
+// ErrorReg bits meaning that a frame was not received properly
+#define MFRC522_PICC_ERRORS                                                    \
+	(MFRC522_ERROR_BUFFER_OVFL | MFRC522_ERROR_COLL_ERR |                  \
+	 MFRC522_ERROR_PARITY_ERR | MFRC522_ERROR_PROTOCOL_ERR)
+
+struct mfrc522_pipeline;
+
+/**
+ * UID of a PICC, the card or tag in the MFRC522's field, as well as the SAK it
+ * answered when it got selected. UIDs are 4, 7 or 10 bytes wide
+ */
+struct mfrc522_picc_uid {
+	u8 size;
+	u8 bytes[MFRC522_PICC_UID_MAX_SIZE];
+	u8 sak;
+};
+
+/**
+ * Where a pipeline reads the state of the MFRC522 after a frame exchange with a
+ * PICC
+ */
+struct mfrc522_picc_rx {
+	u8 *error;
+	u8 *coll;
+	u8 *level;
+	u8 *data;
+	size_t size;
+};
+
+/**
+ * Setup the MFRC522 to talk to ISO/IEC 14443 type A PICCs, and turn the antenna
+ * on
+ *
+ * @param state Device to talk to
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_picc_init(struct mfrc522_state *state);
+
+/**
+ * Set how long the MFRC522 waits for a PICC to start answering a frame
+ *
+ * @param state Device to talk to
+ * @param timeout_us Timeout in microseconds, rounded up to 25us steps
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_picc_set_timeout(struct mfrc522_state *state,
+			     unsigned int timeout_us);
+
+/**
+ * Wake up a PICC, and run the anticollision and selection loops of ISO/IEC
+ * 14443-3 until its whole UID is known. If several PICCs are in the field, only
+ * one of them is selected.
+ *
+ * Frames which do not depend on the previous answer are sent in the same SPI
+ * message as the one reading it. Without collisions, a 4-byte UID is read in 5
+ * SPI messages, a 7-byte UID in 8 and a 10-byte UID in 11, halting included.
+ * The 1ms activation timeout is restored first if another one was set
+ *
+ * @param state Device to talk to
+ * @param uid Filled with the UID and SAK of the selected PICC
+ * @param halt Whether to halt the PICC once its UID is known, instead of leaving
+ *             it selected
+ *
+ * @return 0 on success, -ENODATA if no PICC answered, another negative number
+ *         on error
+ */
+int mfrc522_picc_read_uid(struct mfrc522_state *state,
+			  struct mfrc522_picc_uid *uid, bool halt);
+
+/**
+ * Put the selected PICC into the HALT state. It will then only answer to WUPA
+ *
+ * @param state Device to talk to
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_picc_halt(struct mfrc522_state *state);
+
+/**
+ * Queue the register writes stopping the current command, such as a previous
+ * Transceive, and the timer it started
+ *
+ * @param p Pipeline to build
+ */
+void mfrc522_picc_queue_idle(struct mfrc522_pipeline *p);
+
+/**
+ * Queue an HLTA, putting the selected PICC into the HALT state, and stopping the
+ * current command
+ *
+ * @param p Pipeline to build
+ */
+void mfrc522_picc_queue_halt(struct mfrc522_pipeline *p);
+
+/**
+ * Queue the register writes loading a frame into the FIFO
+ *
+ * @param p Pipeline to build
+ * @param tx Frame to send
+ * @param tx_len Amount of bytes to send
+ */
+void mfrc522_picc_queue_frame(struct mfrc522_pipeline *p, const u8 *tx,
+			      size_t tx_len);
+
+/**
+ * Queue a frame exchange with a PICC. The answer is read at the beginning of the
+ * next stage, so any other register access queued afterwards, such as the next
+ * frame, goes out in the same SPI message. The receiver keeps running until the
+ * next frame, or until mfrc522_picc_queue_idle()
+ *
+ * @param p Pipeline to build
+ * @param tx Frame to send
+ * @param tx_len Amount of bytes to send
+ * @param tx_last_bits Amount of bits of the last byte to send, 0 for all 8
+ * @param rx_align Bit position at which to store the first received bit
+ * @param rx_size Size of the expected answer
+ * @param rx Filled with where the answer will be once the pipeline ran
+ */
+void mfrc522_picc_queue_transceive(struct mfrc522_pipeline *p, const u8 *tx,
+				   size_t tx_len, u8 tx_last_bits, u8 rx_align,
+				   size_t rx_size, struct mfrc522_picc_rx *rx);
+
+/**
+ * Get the amount of bytes received during a frame exchange
+ *
+ * @param rx Where the pipeline read the answer
+ */
+size_t mfrc522_picc_rx_len(const struct mfrc522_picc_rx *rx);
+
+#endif /* ! MFRC522_PICC_H */
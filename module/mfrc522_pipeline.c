@@ -0,0 +1,461 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "mfrc522_pipeline.h"
+#include "mfrc522_spi.h"
+#include "mfrc522_stats.h"
+#include "mfrc522_trace.h"
+
+#define MFRC522_PIPELINE_STAGE_TIMEOUT_MS 50
+
+struct mfrc522_pipeline *mfrc522_pipeline_alloc(struct mfrc522_state *state)
+{
+	struct mfrc522_pipeline *p;
+
+	p = kzalloc(sizeof(*p), GFP_KERNEL);
+	if (!p)
+		return NULL;
+
+	p->state = state;
+	p->num_stages = 1;
+	spin_lock_init(&p->lock);
+	init_completion(&p->wake);
+	init_completion(&p->msg_done);
+
+	return p;
+}
+
+void mfrc522_pipeline_free(struct mfrc522_pipeline *p)
+{
+	kfree(p);
+}
+
+/**
+ * Reserve a transfer at the end of the current stage, as well as its buffers
+ *
+ * @param p Pipeline to build
+ * @param len Length of the transfer
+ * @param rx Whether the transfer needs a receive buffer
+ *
+ * @return The new transfer, or NULL if the pipeline is full
+ */
+static struct spi_transfer *mfrc522_pipeline_xfer(struct mfrc522_pipeline *p,
+						  size_t len, bool rx)
+{
+	struct mfrc522_stage *stage = &p->stages[p->num_stages - 1];
+	struct spi_transfer *xfer;
+	size_t size = rx ? 2 * len : len;
+
+	if (p->status < 0)
+		return NULL;
+
+	if (stage->num_xfers == MFRC522_STAGE_MAX_XFERS ||
+	    p->buf_used + size > MFRC522_PIPELINE_BUF_SIZE) {
+		p->status = -ENOSPC;
+		return NULL;
+	}
+
+	xfer = &stage->xfers[stage->num_xfers++];
+	xfer->tx_buf = p->buf + p->buf_used;
+	xfer->rx_buf = rx ? p->buf + p->buf_used + len : NULL;
+	xfer->len = len;
+	// Each register access is a sequence of its own, ended by releasing NSS
+	xfer->cs_change = 1;
+
+	p->buf_used += size;
+
+	return xfer;
+}
+
+void mfrc522_pipeline_write(struct mfrc522_pipeline *p, u8 reg, u8 value)
+{
+	mfrc522_pipeline_write_burst(p, reg, &value, 1);
+}
+
+void mfrc522_pipeline_write_burst(struct mfrc522_pipeline *p, u8 reg,
+				  const u8 *buf, size_t len)
+{
+	struct spi_transfer *xfer = mfrc522_pipeline_xfer(p, len + 1, false);
+	u8 *tx_buf;
+
+	if (!xfer)
+		return;
+
+	tx_buf = (u8 *)xfer->tx_buf;
+	tx_buf[0] = mfrc522_address_byte(reg, false);
+	memcpy(tx_buf + 1, buf, len);
+}
+
+u8 *mfrc522_pipeline_read(struct mfrc522_pipeline *p, u8 reg, size_t len)
+{
+	struct spi_transfer *xfer = mfrc522_pipeline_xfer(p, len + 1, true);
+	u8 *tx_buf;
+
+	if (!xfer)
+		return NULL;
+
+	// Continuous read sequence, see mfrc522_register_read()
+	tx_buf = (u8 *)xfer->tx_buf;
+	memset(tx_buf, mfrc522_address_byte(reg, true), len);
+	tx_buf[len] = 0;
+
+	return (u8 *)xfer->rx_buf + 1;
+}
+
+/**
+ * Close the current stage, and make the next one wait for the given interrupts
+ */
+static void mfrc522_pipeline_end_stage(struct mfrc522_pipeline *p, u8 wait_irq)
+{
+	if (p->status < 0)
+		return;
+
+	p->stages[p->num_stages - 1].wait_irq = wait_irq;
+
+	if (p->num_stages == MFRC522_PIPELINE_MAX_STAGES) {
+		p->status = -ENOSPC;
+		return;
+	}
+
+	p->num_stages++;
+}
+
+void mfrc522_pipeline_command(struct mfrc522_pipeline *p, u8 rcv_off,
+			      u8 power_down, u8 command)
+{
+	// Clear interrupts left over by previous commands, so that only this
+	// command's completion moves the pipeline forward
+	mfrc522_pipeline_write(p, MFRC522_COM_IRQ_REG,
+			       MFRC522_COM_IRQ_CLEAR_ALL);
+	mfrc522_pipeline_write(p, MFRC522_COMMAND_REG,
+			       mfrc522_command_byte(rcv_off, power_down,
+						    command));
+
+	mfrc522_pipeline_end_stage(p, MFRC522_COM_IRQ_IDLE);
+}
+
+void mfrc522_pipeline_command_timed(struct mfrc522_pipeline *p, u8 command)
+{
+	mfrc522_pipeline_write(p, MFRC522_COM_IRQ_REG,
+			       MFRC522_COM_IRQ_CLEAR_ALL);
+	mfrc522_pipeline_write(p, MFRC522_COMMAND_REG,
+			       mfrc522_command_byte(MFRC522_COMMAND_REG_RCV_ON,
+						    MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+						    command));
+
+	mfrc522_pipeline_end_stage(p, MFRC522_COM_IRQ_IDLE |
+					      MFRC522_COM_IRQ_TIMER);
+}
+
+void mfrc522_pipeline_transceive(struct mfrc522_pipeline *p, u8 tx_last_bits,
+				 u8 rx_align)
+{
+	mfrc522_pipeline_write(p, MFRC522_COM_IRQ_REG,
+			       MFRC522_COM_IRQ_CLEAR_ALL);
+	mfrc522_pipeline_write(p, MFRC522_COMMAND_REG,
+			       mfrc522_command_byte(MFRC522_COMMAND_REG_RCV_ON,
+						    MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+						    MFRC522_COMMAND_TRANSCEIVE));
+
+	// Transceive only starts transmitting once StartSend is set, see 10.3.1.8.
+	// The MFRC522's timer then starts at the end of the transmission
+	mfrc522_pipeline_write(p, MFRC522_BIT_FRAMING_REG,
+			       MFRC522_BIT_FRAMING_REG_START_SEND |
+			       rx_align << MFRC522_BIT_FRAMING_REG_RX_ALIGN_SHIFT |
+			       tx_last_bits);
+
+	mfrc522_pipeline_end_stage(p, MFRC522_COM_IRQ_RX |
+					      MFRC522_COM_IRQ_TIMER);
+}
+
+/**
+ * Whether the MFRC522's timer expired before the PICC answered a Transceive or
+ * an MFAuthent
+ */
+static bool mfrc522_pipeline_no_answer(u8 wait_irq, u8 com_irq)
+{
+	return (wait_irq & MFRC522_COM_IRQ_TIMER) &&
+	       !(com_irq & wait_irq & ~MFRC522_COM_IRQ_TIMER);
+}
+
+/**
+ * End the pipeline and wake the caller up. Must be called with the pipeline's
+ * lock held
+ */
+static void mfrc522_pipeline_finish(struct mfrc522_pipeline *p, int status)
+{
+	if (p->finished)
+		return;
+
+	p->finished = true;
+	p->status = status;
+	complete(&p->wake);
+}
+
+static void mfrc522_pipeline_msg_complete(void *context);
+
+/**
+ * Submit the current stage. Must be called with the pipeline's lock held
+ *
+ * @param p Pipeline to run
+ * @param bus_locked Whether the caller holds the SPI bus lock
+ */
+static void mfrc522_pipeline_submit(struct mfrc522_pipeline *p,
+				    bool bus_locked)
+{
+	struct mfrc522_stage *stage = &p->stages[p->current];
+	int ret;
+
+	// On the last transfer of a message, cs_change would keep NSS asserted
+	stage->xfers[stage->num_xfers - 1].cs_change = 0;
+
+	spi_message_init_with_transfers(&stage->msg, stage->xfers,
+					stage->num_xfers);
+	stage->msg.complete = mfrc522_pipeline_msg_complete;
+	stage->msg.context = p;
+
+	// A stage waiting for the MFRC522 is over once both its message went
+	// through and the MFRC522 raised the awaited interrupt
+	p->pending = stage->wait_irq && p->irq_driven ? 2 : 1;
+	p->in_flight = true;
+	reinit_completion(&p->msg_done);
+
+	stage->submit_ns = ktime_get_ns();
+
+	bus_locked = bus_locked || READ_ONCE(p->state->bus_locked);
+	if (bus_locked)
+		ret = spi_async_locked(p->state->spi, &stage->msg);
+	else
+		ret = spi_async(p->state->spi, &stage->msg);
+
+	// Another device's batch holds the bus, which can only be waited for
+	// from the caller's context
+	if (ret == -EBUSY && !bus_locked) {
+		p->in_flight = false;
+		complete(&p->msg_done);
+		p->deferred = true;
+		complete(&p->wake);
+		return;
+	}
+
+	if (ret < 0) {
+		mfrc522_stats_spi(p->state, 0, ret);
+		p->in_flight = false;
+		complete(&p->msg_done);
+		mfrc522_pipeline_finish(p, ret);
+	}
+}
+
+/**
+ * Account for one of the events ending the current stage, and start the next
+ * stage once the current one is over. Must be called with the pipeline's lock held
+ */
+static void mfrc522_pipeline_stage_event(struct mfrc522_pipeline *p)
+{
+	struct mfrc522_stage *stage = &p->stages[p->current];
+
+	if (--p->pending)
+		return;
+
+	p->current++;
+
+	// Without an interrupt, the caller has to poll the MFRC522 before going on
+	if (stage->wait_irq && !p->irq_driven) {
+		complete(&p->wake);
+		return;
+	}
+
+	if (p->current == p->num_stages) {
+		mfrc522_pipeline_finish(p, 0);
+		return;
+	}
+
+	mfrc522_pipeline_submit(p, false);
+}
+
+static void mfrc522_pipeline_msg_complete(void *context)
+{
+	struct mfrc522_pipeline *p = context;
+	struct mfrc522_stage *stage;
+	unsigned long flags;
+
+	spin_lock_irqsave(&p->lock, flags);
+
+	stage = &p->stages[p->current];
+
+	p->in_flight = false;
+	complete(&p->msg_done);
+
+	mfrc522_stats_spi(p->state, ktime_get_ns() - stage->submit_ns,
+			  stage->msg.status);
+
+	if (p->aborted || p->finished)
+		goto out;
+
+	if (stage->msg.status < 0)
+		mfrc522_pipeline_finish(p, stage->msg.status);
+	else
+		mfrc522_pipeline_stage_event(p);
+
+out:
+	spin_unlock_irqrestore(&p->lock, flags);
+}
+
+void mfrc522_pipeline_irq(struct mfrc522_state *state, u8 com_irq)
+{
+	struct mfrc522_pipeline *p;
+	unsigned long flags;
+	u8 wait_irq;
+
+	spin_lock_irqsave(&state->pipeline_lock, flags);
+
+	p = state->pipeline_active;
+	if (!p)
+		goto out;
+
+	spin_lock(&p->lock);
+
+	if (p->aborted || p->finished || !p->pending)
+		goto unlock;
+
+	wait_irq = p->stages[p->current].wait_irq;
+	if (!(com_irq & wait_irq))
+		goto unlock;
+
+	p->com_irq = com_irq;
+
+	if (mfrc522_pipeline_no_answer(wait_irq, com_irq))
+		mfrc522_pipeline_finish(p, -ENODATA);
+	else
+		mfrc522_pipeline_stage_event(p);
+
+unlock:
+	spin_unlock(&p->lock);
+
+out:
+	spin_unlock_irqrestore(&state->pipeline_lock, flags);
+}
+
+static void mfrc522_pipeline_set_active(struct mfrc522_state *state,
+					struct mfrc522_pipeline *p)
+{
+	spin_lock_irq(&state->pipeline_lock);
+	state->pipeline_active = p;
+	spin_unlock_irq(&state->pipeline_lock);
+}
+
+/**
+ * Submit a deferred stage, once the device whose batch held the SPI bus is done
+ * with it
+ */
+static void mfrc522_pipeline_submit_deferred(struct mfrc522_pipeline *p)
+{
+	struct spi_controller *ctlr = p->state->spi->master;
+
+	spi_bus_lock(ctlr);
+
+	spin_lock_irq(&p->lock);
+	p->deferred = false;
+	mfrc522_pipeline_submit(p, true);
+	spin_unlock_irq(&p->lock);
+
+	// The message is queued already, it does not need the bus lock to go on
+	spi_bus_unlock(ctlr);
+}
+
+int mfrc522_pipeline_run(struct mfrc522_pipeline *p)
+{
+	unsigned long timeout;
+	bool in_flight;
+	u8 wait_irq;
+	int ret;
+
+	if (p->status < 0)
+		return p->status;
+
+	// Drop the empty stage opened by the last command
+	if (!p->stages[p->num_stages - 1].num_xfers)
+		p->num_stages--;
+
+	if (!p->num_stages)
+		return 0;
+
+	p->irq_driven = mfrc522_irq_available(p->state);
+	if (p->irq_driven)
+		mfrc522_pipeline_set_active(p->state, p);
+
+	// When driven by interrupts, the caller is only woken up at the very end
+	timeout = msecs_to_jiffies(MFRC522_PIPELINE_STAGE_TIMEOUT_MS);
+	if (p->irq_driven)
+		timeout *= p->num_stages;
+
+	spin_lock_irq(&p->lock);
+	mfrc522_pipeline_submit(p, false);
+	spin_unlock_irq(&p->lock);
+
+	while (true) {
+		if (!wait_for_completion_timeout(&p->wake, timeout)) {
+			mfrc522_stats_timeout(p->state);
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		spin_lock_irq(&p->lock);
+		if (p->finished) {
+			ret = p->status;
+			spin_unlock_irq(&p->lock);
+			break;
+		}
+
+		if (p->deferred) {
+			spin_unlock_irq(&p->lock);
+			mfrc522_pipeline_submit_deferred(p);
+			continue;
+		}
+		spin_unlock_irq(&p->lock);
+
+		wait_irq = p->stages[p->current - 1].wait_irq;
+		ret = mfrc522_poll_irq(p->state, wait_irq);
+		if (ret < 0)
+			break;
+
+		p->com_irq = ret;
+		if (mfrc522_pipeline_no_answer(wait_irq, p->com_irq)) {
+			ret = -ENODATA;
+			break;
+		}
+
+		spin_lock_irq(&p->lock);
+		if (p->current == p->num_stages)
+			mfrc522_pipeline_finish(p, 0);
+		else
+			mfrc522_pipeline_submit(p, false);
+		spin_unlock_irq(&p->lock);
+	}
+
+	// Make sure no message is still referencing the pipeline before handing it
+	// back to the caller
+	spin_lock_irq(&p->lock);
+	p->aborted = true;
+	in_flight = p->in_flight;
+	spin_unlock_irq(&p->lock);
+
+	// The completion callback signals msg_done with the lock held, and goes on
+	// using the pipeline until it drops the lock
+	if (in_flight) {
+		wait_for_completion(&p->msg_done);
+		spin_lock_irq(&p->lock);
+		spin_unlock_irq(&p->lock);
+	}
+
+	if (p->irq_driven)
+		mfrc522_pipeline_set_active(p->state, NULL);
+
+	trace_mfrc522_pipeline_run(p->state, p->num_stages, ret);
+
+	return ret;
+}
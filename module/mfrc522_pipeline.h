@@ -0,0 +1,186 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_PIPELINE_H
+#define MFRC522_PIPELINE_H
+
+#include <linux/cache.h>
+#include <linux/completion.h>
+#include <linux/spi/spi.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+#define MFRC522_PIPELINE_MAX_STAGES 8
+#define MFRC522_STAGE_MAX_XFERS 12
+#define MFRC522_PIPELINE_BUF_SIZE 1024
+
+struct mfrc522_pipeline;
+
+/**
+ * A pipeline stage is a single SPI message, made of consecutive register accesses.
+ * If the stage starts an MFRC522 command, the next stage only starts once one of
+ * the interrupts in wait_irq was raised: IdleIRq for commands ending by
+ * themselves, IdleIRq or TimerIRq for MFAuthent, RxIRq or TimerIRq for
+ * Transceive
+ */
+struct mfrc522_stage {
+	struct spi_message msg;
+	struct spi_transfer xfers[MFRC522_STAGE_MAX_XFERS];
+	unsigned int num_xfers;
+	u8 wait_irq;
+	u64 submit_ns;
+};
+
+/**
+ * A pipeline executes a sequence of stages asynchronously. Stages are submitted
+ * using spi_async(), and the next stage is submitted from the completion callback
+ * of the previous one, or from the interrupt handler if the previous stage has to
+ * wait for the MFRC522 to go idle. The caller only sleeps once, until the whole
+ * sequence is over. Without an interrupt line, the caller is woken up to poll
+ * the MFRC522 between stages.
+ *
+ * spi_async() refuses messages while another device on the bus holds the SPI
+ * bus lock for a batch of commands. The stage is then deferred: the caller is
+ * woken up, waits for the bus lock and submits the stage itself, after which
+ * the pipeline goes on as usual
+ *
+ * Pipelines bypass the register cache, and must therefore only access volatile
+ * registers
+ */
+struct mfrc522_pipeline {
+	struct mfrc522_state *state;
+	struct mfrc522_stage stages[MFRC522_PIPELINE_MAX_STAGES];
+	unsigned int num_stages;
+	unsigned int current;
+	size_t buf_used;
+	int status;
+
+	spinlock_t lock;
+	struct completion wake;
+	struct completion msg_done;
+	unsigned int pending;
+	u8 com_irq;
+	bool irq_driven;
+	bool in_flight;
+	bool deferred;
+	bool finished;
+	bool aborted;
+
+	u8 buf[MFRC522_PIPELINE_BUF_SIZE] ____cacheline_aligned;
+};
+
+/**
+ * Allocate a new, empty pipeline
+ *
+ * @param state Device the pipeline will talk to
+ *
+ * @return The new pipeline on success, NULL otherwise
+ */
+struct mfrc522_pipeline *mfrc522_pipeline_alloc(struct mfrc522_state *state);
+
+/**
+ * Free a pipeline which is not running
+ */
+void mfrc522_pipeline_free(struct mfrc522_pipeline *p);
+
+/**
+ * Queue a register write in the current stage. Errors are reported by
+ * mfrc522_pipeline_run()
+ *
+ * @param p Pipeline to build
+ * @param reg Register to write to
+ * @param value Value to write
+ */
+void mfrc522_pipeline_write(struct mfrc522_pipeline *p, u8 reg, u8 value);
+
+/**
+ * Queue a multi-byte write to a single register in the current stage
+ *
+ * @param p Pipeline to build
+ * @param reg Register to write to
+ * @param buf Data to write
+ * @param len Amount of bytes to write
+ */
+void mfrc522_pipeline_write_burst(struct mfrc522_pipeline *p, u8 reg,
+				  const u8 *buf, size_t len);
+
+/**
+ * Queue a register read in the current stage
+ *
+ * @param p Pipeline to build
+ * @param reg Register to read from
+ * @param len Amount of bytes to read
+ *
+ * @return A pointer to where the read bytes will be once the pipeline ran, or NULL
+ *         on error
+ */
+u8 *mfrc522_pipeline_read(struct mfrc522_pipeline *p, u8 reg, size_t len);
+
+/**
+ * Queue an MFRC522 command (9.3.1.2) in the current stage, and close that stage.
+ * The next stage will only be submitted once the MFRC522 went back to idle
+ *
+ * @param p Pipeline to build
+ * @param rcv_off If 1, turn off analog part of the receiver
+ * @param power_down If 1, enter soft power down mode
+ * @param command MFRC522 commands as described 10.3
+ */
+void mfrc522_pipeline_command(struct mfrc522_pipeline *p, u8 rcv_off,
+			      u8 power_down, u8 command);
+
+/**
+ * Queue an MFRC522 command exchanging frames with a PICC, such as MFAuthent, in
+ * the current stage, and close that stage. Such commands only end by themselves
+ * if the PICC answers: the next stage is submitted once the MFRC522 went back to
+ * idle, and the pipeline ends with -ENODATA if the MFRC522's timer expired first
+ *
+ * @param p Pipeline to build
+ * @param command MFRC522 commands as described 10.3
+ */
+void mfrc522_pipeline_command_timed(struct mfrc522_pipeline *p, u8 command);
+
+/**
+ * Queue a Transceive command in the current stage, and close that stage. The data
+ * to send must already have been queued into the FIFO. The next stage is
+ * submitted once the PICC answered, and the pipeline ends with -ENODATA if the
+ * MFRC522's timer expired first
+ *
+ * @param p Pipeline to build
+ * @param tx_last_bits Amount of bits of the last byte to transmit, 0 for all 8
+ * @param rx_align Bit position at which to store the first received bit
+ */
+void mfrc522_pipeline_transceive(struct mfrc522_pipeline *p, u8 tx_last_bits,
+				 u8 rx_align);
+
+/**
+ * Get the interrupts which ended the last stage waiting for the MFRC522
+ *
+ * @param p Pipeline which ran
+ *
+ * @return The content of ComIrqReg when the stage ended
+ */
+static inline u8 mfrc522_pipeline_com_irq(struct mfrc522_pipeline *p)
+{
+	return p->com_irq;
+}
+
+/**
+ * Execute a pipeline and wait for it to complete
+ *
+ * @param p Pipeline to run
+ *
+ * @return 0 on success, a negative number on error or timeout
+ */
+int mfrc522_pipeline_run(struct mfrc522_pipeline *p);
+
+/**
+ * Notify the pipeline running on a device that an interrupt was raised. Called by
+ * the interrupt handler
+ *
+ * @param state Device which raised the interrupt
+ * @param com_irq Content of the ComIrqReg register
+ */
+void mfrc522_pipeline_irq(struct mfrc522_state *state, u8 com_irq);
+
+#endif /* ! MFRC522_PIPELINE_H */
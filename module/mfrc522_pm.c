@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/delay.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/pm_runtime.h>
+#include <linux/spi/spi.h>
+
+#include "mfrc522_pm.h"
+#include "mfrc522_spi.h"
+#include "mfrc522_stats.h"
+
+// The oscillator typically starts within a few hundred microseconds, see 8.6.2
+#define MFRC522_PM_WAKE_TIMEOUT_US 5000
+#define MFRC522_PM_WAKE_POLL_MIN_US 10
+#define MFRC522_PM_WAKE_POLL_MAX_US 20
+
+// ISO/IEC 14443-3 gives PICCs 5ms after the field comes up before they have to
+// answer, so the first frame after a resume would otherwise go unanswered
+#define MFRC522_PM_FIELD_GUARD_MIN_US 5000
+#define MFRC522_PM_FIELD_GUARD_MAX_US 5500
+
+#define MFRC522_PM_ANTENNA \
+	(MFRC522_TX_CONTROL_REG_TX1_RF_EN | MFRC522_TX_CONTROL_REG_TX2_RF_EN)
+
+// The callbacks only run while nobody holds a reference taken through
+// mfrc522_pm_get(), so no command is running and the device's lock is not needed
+
+static int mfrc522_pm_runtime_suspend(struct device *dev)
+{
+	struct mfrc522_state *state = dev_get_drvdata(dev);
+	int ret;
+
+	ret = mfrc522_register_update_bits(state, MFRC522_TX_CONTROL_REG,
+					   MFRC522_PM_ANTENNA, 0);
+	if (ret < 0)
+		return ret;
+
+	// PICCs lose power along with the field, so the next MIFARE Classic
+	// command has to select its PICC again
+	state->mifare.session = false;
+
+	// The MFRC522 is idle between commands, and NoCmdChange keeps it that way
+	// while RcvOff turns the analog part of the receiver off too
+	return mfrc522_register_write(state, MFRC522_COMMAND_REG,
+				      mfrc522_command_byte(MFRC522_COMMAND_REG_RCV_OFF,
+							   MFRC522_COMMAND_REG_POWER_DOWN_ON,
+							   MFRC522_COMMAND_NO_CMD_CHANGE));
+}
+
+int mfrc522_pm_wake(struct mfrc522_state *state)
+{
+	u64 deadline = ktime_get_ns() + MFRC522_PM_WAKE_TIMEOUT_US * NSEC_PER_USEC;
+	u8 command;
+	int ret;
+
+	ret = mfrc522_register_write(state, MFRC522_COMMAND_REG,
+				     mfrc522_command_byte(MFRC522_COMMAND_REG_RCV_ON,
+							  MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+							  MFRC522_COMMAND_NO_CMD_CHANGE));
+	if (ret < 0)
+		return ret;
+
+	while (true) {
+		ret = mfrc522_register_read(state, MFRC522_COMMAND_REG, &command,
+					    1);
+		if (ret < 0)
+			return ret;
+
+		if (!(command & MFRC522_COMMAND_REG_POWER_DOWN))
+			return 0;
+
+		if (ktime_get_ns() > deadline) {
+			mfrc522_stats_timeout(state);
+			return -ETIMEDOUT;
+		}
+
+		usleep_range(MFRC522_PM_WAKE_POLL_MIN_US,
+			     MFRC522_PM_WAKE_POLL_MAX_US);
+	}
+}
+
+static int __maybe_unused mfrc522_pm_runtime_resume(struct device *dev)
+{
+	struct mfrc522_state *state = dev_get_drvdata(dev);
+	u64 start = ktime_get_ns();
+	int ret;
+
+	ret = mfrc522_pm_wake(state);
+	if (!ret)
+		ret = mfrc522_register_update_bits(state, MFRC522_TX_CONTROL_REG,
+						   MFRC522_PM_ANTENNA,
+						   MFRC522_PM_ANTENNA);
+	if (!ret)
+		usleep_range(MFRC522_PM_FIELD_GUARD_MIN_US,
+			     MFRC522_PM_FIELD_GUARD_MAX_US);
+
+	// This is how much later the first command after an idle period starts
+	mfrc522_stats_wake(state, ktime_get_ns() - start, ret);
+
+	return ret;
+}
+
+const struct dev_pm_ops mfrc522_pm_ops = {
+	SET_RUNTIME_PM_OPS(mfrc522_pm_runtime_suspend, mfrc522_pm_runtime_resume,
+			   NULL)
+};
+
+void mfrc522_pm_init(struct mfrc522_state *state)
+{
+	struct device *dev = &state->spi->dev;
+
+	pm_runtime_set_autosuspend_delay(dev, MFRC522_PM_AUTOSUSPEND_MS);
+	pm_runtime_use_autosuspend(dev);
+	pm_runtime_set_active(dev);
+	pm_runtime_enable(dev);
+
+	pm_runtime_mark_last_busy(dev);
+	pm_request_autosuspend(dev);
+}
+
+void mfrc522_pm_exit(struct mfrc522_state *state)
+{
+	struct device *dev = &state->spi->dev;
+
+	pm_runtime_disable(dev);
+	pm_runtime_dont_use_autosuspend(dev);
+
+	if (!pm_runtime_status_suspended(dev))
+		mfrc522_pm_runtime_suspend(dev);
+
+	pm_runtime_set_suspended(dev);
+}
+
+int mfrc522_pm_get(struct mfrc522_state *state)
+{
+	// Open files outlive the unbinding of the chip, and runtime PM with it
+	if (READ_ONCE(state->dead))
+		return -ENODEV;
+
+	return pm_runtime_resume_and_get(&state->spi->dev);
+}
+
+void mfrc522_pm_put(struct mfrc522_state *state)
+{
+	struct device *dev = &state->spi->dev;
+
+	pm_runtime_mark_last_busy(dev);
+	pm_runtime_put_autosuspend(dev);
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_PM_H
+#define MFRC522_PM_H
+
+#include <linux/pm.h>
+
+#include "mfrc522_module.h"
+
+// Idle time after which the MFRC522 enters soft power-down, tunable through
+// power/autosuspend_delay_ms
+#define MFRC522_PM_AUTOSUSPEND_MS 1000
+
+/**
+ * Runtime PM callbacks: suspending turns the antenna off and enters soft
+ * power-down, resuming waits for the oscillator to be stable again, see 8.6.2
+ */
+extern const struct dev_pm_ops mfrc522_pm_ops;
+
+/**
+ * Leave soft power-down, and wait for the PowerDown bit to read 0, which only
+ * happens once the oscillator is stable, see 9.3.1.2. Does nothing to an awake
+ * device
+ *
+ * @param state Device to wake up, without runtime PM enabled or with a
+ *              reference taken through mfrc522_pm_get()
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_pm_wake(struct mfrc522_state *state);
+
+/**
+ * Enable runtime PM of a device, which must be awake. It is suspended once it
+ * has been idle for MFRC522_PM_AUTOSUSPEND_MS
+ *
+ * @param state Device to manage
+ */
+void mfrc522_pm_init(struct mfrc522_state *state);
+
+/**
+ * Disable runtime PM of a device, and leave it in soft power-down
+ *
+ * @param state Device to manage
+ */
+void mfrc522_pm_exit(struct mfrc522_state *state);
+
+/**
+ * Wake a device up if needed, and keep it awake until mfrc522_pm_put(). Every
+ * access to the MFRC522 after probing must be done between the two
+ *
+ * @param state Device to wake up
+ *
+ * @return 0 on success, -ENODEV if the device was unbound, another negative
+ *         number if it could not be woken up
+ */
+int mfrc522_pm_get(struct mfrc522_state *state);
+
+/**
+ * Let a device be suspended once it has been idle for the autosuspend delay
+ *
+ * @param state Device woken up by mfrc522_pm_get()
+ */
+void mfrc522_pm_put(struct mfrc522_state *state);
+
+#endif /* ! MFRC522_PM_H */
@@ -0,0 +1,161 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/mm.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "mfrc522_ring.h"
+
+#define MFRC522_RING_DATA_SIZE                                                 \
+	(MFRC522_RING_RECORDS * sizeof(struct mfrc522_ring_record))
+#define MFRC522_RING_SIZE (PAGE_SIZE + MFRC522_RING_DATA_SIZE)
+
+// Each mapping holds a reference to the state, which frees the ring along with
+// it, so the ring is never freed while mapped
+
+static void mfrc522_ring_vm_open(struct vm_area_struct *vma)
+{
+	struct mfrc522_state *state = vma->vm_private_data;
+
+	mfrc522_state_get(state);
+	atomic_inc(&state->scan.ring.mappings);
+}
+
+static void mfrc522_ring_vm_close(struct vm_area_struct *vma)
+{
+	struct mfrc522_state *state = vma->vm_private_data;
+
+	atomic_dec(&state->scan.ring.mappings);
+	mfrc522_state_put(state);
+}
+
+static const struct vm_operations_struct mfrc522_ring_vm_ops = {
+	.open = mfrc522_ring_vm_open,
+	.close = mfrc522_ring_vm_close,
+};
+
+/**
+ * Allocate the ring of a device if it does not have one yet. Called with the
+ * device's lock held
+ *
+ * @return 0 on success, a negative number on error
+ */
+static int mfrc522_ring_alloc(struct mfrc522_state *state)
+{
+	struct mfrc522_ring *ring = &state->scan.ring;
+	struct mfrc522_ring_ctrl *ctrl;
+
+	BUILD_BUG_ON(sizeof(struct mfrc522_ring_ctrl) > PAGE_SIZE);
+	BUILD_BUG_ON_NOT_POWER_OF_2(MFRC522_RING_RECORDS);
+
+	if (ring->ctrl)
+		return 0;
+
+	// Zeroed, and page aligned so that it can be mapped to userspace
+	ctrl = vmalloc_user(MFRC522_RING_SIZE);
+	if (!ctrl)
+		return -ENOMEM;
+
+	ctrl->records = MFRC522_RING_RECORDS;
+	ctrl->record_size = sizeof(struct mfrc522_ring_record);
+	ctrl->data_offset = PAGE_SIZE;
+
+	ring->records = (void *)ctrl + PAGE_SIZE;
+	ring->head = 0;
+	WRITE_ONCE(ring->ctrl, ctrl);
+
+	return 0;
+}
+
+int mfrc522_ring_mmap(struct mfrc522_state *state, struct vm_area_struct *vma)
+{
+	struct mfrc522_ring *ring = &state->scan.ring;
+	int ret;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != MFRC522_RING_SIZE)
+		return -EINVAL;
+
+	// A private mapping would get a copy of the control page on the first
+	// store to tail, and the driver would never see the ring drained
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	mutex_lock(&state->lock);
+
+	if (state->dead)
+		ret = -ENODEV;
+	else
+		ret = mfrc522_ring_alloc(state);
+	if (!ret)
+		ret = remap_vmalloc_range(vma, ring->ctrl, 0);
+
+	if (!ret) {
+		vma->vm_private_data = state;
+		vma->vm_ops = &mfrc522_ring_vm_ops;
+		mfrc522_ring_vm_open(vma);
+	}
+
+	mutex_unlock(&state->lock);
+
+	return ret;
+}
+
+void mfrc522_ring_free(struct mfrc522_state *state)
+{
+	struct mfrc522_ring *ring = &state->scan.ring;
+
+	// Its pages would stay mapped in userspace after being freed
+	if (WARN_ON(mfrc522_ring_mapped(state)))
+		return;
+
+	vfree(ring->ctrl);
+	ring->ctrl = NULL;
+	ring->records = NULL;
+}
+
+int mfrc522_ring_push(struct mfrc522_state *state,
+		      const struct mfrc522_tag_event *event, int status)
+{
+	struct mfrc522_ring *ring = &state->scan.ring;
+	struct mfrc522_ring_ctrl *ctrl = ring->ctrl;
+	struct mfrc522_ring_record *record;
+	u32 head = ring->head;
+	u32 tail;
+
+	// Pairs with the release store of userspace once it consumed records. A
+	// corrupted tail only makes the ring look full
+	tail = smp_load_acquire(&ctrl->tail);
+	if (head - tail >= MFRC522_RING_RECORDS) {
+		WRITE_ONCE(ctrl->dropped, ctrl->dropped + 1);
+		return -ENOSPC;
+	}
+
+	record = &ring->records[head & (MFRC522_RING_RECORDS - 1)];
+	memset(record, 0, sizeof(*record));
+	record->timestamp_ns = event->timestamp_ns;
+	record->dropped = event->dropped;
+	record->status = status;
+	record->reader = state->id;
+	record->type = event->type;
+	record->sak = event->sak;
+	record->uid_len = event->uid_len;
+	memcpy(record->uid, event->uid, sizeof(record->uid));
+
+	// Userspace must see the record before the head covering it. Whatever
+	// userspace wrote to ctrl->head is overwritten
+	WRITE_ONCE(ring->head, head + 1);
+	smp_store_release(&ctrl->head, head + 1);
+
+	return 0;
+}
+
+bool mfrc522_ring_pending(struct mfrc522_state *state)
+{
+	struct mfrc522_ring *ring = &state->scan.ring;
+	struct mfrc522_ring_ctrl *ctrl = READ_ONCE(ring->ctrl);
+
+	if (!ctrl)
+		return false;
+
+	return READ_ONCE(ring->head) != READ_ONCE(ctrl->tail);
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_RING_H
+#define MFRC522_RING_H
+
+#include <linux/atomic.h>
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+struct vm_area_struct;
+
+/**
+ * Map the ring of tag events shared with userspace, allocating it on the first
+ * call, see struct mfrc522_ring_ctrl
+ *
+ * @param state Device whose ring to map
+ * @param vma Mapping requested by userspace
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_ring_mmap(struct mfrc522_state *state, struct vm_area_struct *vma);
+
+/**
+ * Free the ring of a device. Called when its state is freed, once every mapping
+ * is gone. Refuses to free a ring which is still mapped
+ *
+ * @param state Device whose ring to free
+ */
+void mfrc522_ring_free(struct mfrc522_state *state);
+
+/**
+ * Publish a tag event in the ring. Only called by the scan work, the only
+ * producer
+ *
+ * @param state Device which noticed the event
+ * @param event Event to publish
+ * @param status 0, or the negative errno of a failed scan
+ *
+ * @return 0 on success, -ENOSPC if userspace did not keep up and the event was
+ *         dropped
+ */
+int mfrc522_ring_push(struct mfrc522_state *state,
+		      const struct mfrc522_tag_event *event, int status);
+
+/**
+ * Whether tag events go to the ring rather than to read(), which is the case
+ * while userspace maps it
+ *
+ * @param state Device to check
+ */
+static inline bool mfrc522_ring_mapped(struct mfrc522_state *state)
+{
+	return atomic_read(&state->scan.ring.mappings) > 0;
+}
+
+/**
+ * Whether the ring holds records userspace did not consume yet
+ *
+ * @param state Device to check
+ */
+bool mfrc522_ring_pending(struct mfrc522_state *state);
+
+#endif /* ! MFRC522_RING_H */
@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/debugfs.h>
+#include <linux/hw_random.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+
+#include "mfrc522_pipeline.h"
+#include "mfrc522_pm.h"
+#include "mfrc522_rng.h"
+#include "mfrc522_spi.h"
+#include "mfrc522_user_command.h"
+
+// Each generation takes two stages, GenerateRandomID then Mem, and the last
+// one is read back in a stage of its own
+#define MFRC522_RNG_BATCH ((MFRC522_PIPELINE_MAX_STAGES - 1) / 2)
+
+// Amount of random bytes generated by each reading of rng_bench
+#define MFRC522_RNG_BENCH_SIZE 4096
+
+// Entropy credited per 1024 bits read. NXP does not document the generator, so
+// this is the lowest quality the hw_random core does not replace by its default
+// of full credit, which it does for 0 from Linux 5.18 on
+#define MFRC522_RNG_QUALITY 1
+
+/**
+ * Generate up to MFRC522_RNG_BATCH random IDs in a single pipeline
+ *
+ * GenerateRandomID always overwrites the start of the internal memory, and Mem
+ * only moves the memory to the FIFO when the FIFO is empty, so every ID has to
+ * be read back before the next one is generated. Reading an ID back shares its
+ * SPI message with the start of the next generation, and the caller only waits
+ * once for the whole batch
+ *
+ * @param state Device to talk to, with its lock held
+ * @param buf Buffer to fill
+ * @param max Size of the buffer
+ *
+ * @return The amount of bytes written to buf on success, a negative number on
+ *         error
+ */
+static int mfrc522_rng_batch(struct mfrc522_state *state, u8 *buf, size_t max)
+{
+	unsigned int count = min_t(size_t, DIV_ROUND_UP(max, MFRC522_ID_SIZE),
+				   MFRC522_RNG_BATCH);
+	u8 *level[MFRC522_RNG_BATCH];
+	u8 *data[MFRC522_RNG_BATCH];
+	struct mfrc522_pipeline *p;
+	size_t done = 0;
+	size_t len;
+	unsigned int i;
+	int ret;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	for (i = 0; i < count; i++) {
+		mfrc522_pipeline_command(p, MFRC522_COMMAND_REG_RCV_ON,
+					 MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+					 MFRC522_COMMAND_GENERATE_RANDOM_ID);
+
+		mfrc522_pipeline_write(p, MFRC522_FIFO_LEVEL_REG,
+				       MFRC522_FIFO_LEVEL_REG_FLUSH);
+		mfrc522_pipeline_command(p, MFRC522_COMMAND_REG_RCV_ON,
+					 MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+					 MFRC522_COMMAND_MEM);
+
+		// Only the ID is read, the rest of the FIFO is flushed by the
+		// next generation
+		level[i] = mfrc522_pipeline_read(p, MFRC522_FIFO_LEVEL_REG, 1);
+		data[i] = mfrc522_pipeline_read(p, MFRC522_FIFO_DATA_REG,
+						MFRC522_ID_SIZE);
+	}
+
+	ret = mfrc522_pipeline_run(p);
+	if (ret < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		if ((*level[i] & MFRC522_FIFO_LEVEL_REG_LEVEL_MASK) < MFRC522_ID_SIZE) {
+			ret = -EIO;
+			goto out;
+		}
+
+		len = min_t(size_t, max - done, MFRC522_ID_SIZE);
+		memcpy(buf + done, data[i], len);
+		done += len;
+	}
+
+	ret = done;
+
+out:
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+/**
+ * Read the internal memory, which GenerateRandomID is about to overwrite
+ */
+static int mfrc522_rng_save(struct mfrc522_state *state, u8 *saved)
+{
+	struct mfrc522_pipeline *p;
+	u8 *level;
+	u8 *data;
+	int ret;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	mfrc522_queue_mem_read(p, &level, &data);
+
+	ret = mfrc522_pipeline_run(p);
+	if (!ret && (*level & MFRC522_FIFO_LEVEL_REG_LEVEL_MASK) != MFRC522_MEM_SIZE)
+		ret = -EIO;
+	if (!ret)
+		memcpy(saved, data, MFRC522_MEM_SIZE);
+
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+/**
+ * Write the internal memory back once random IDs were generated
+ */
+static int mfrc522_rng_restore(struct mfrc522_state *state, const u8 *saved)
+{
+	struct mfrc522_pipeline *p;
+	int ret;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	mfrc522_queue_mem_write(p, saved);
+	ret = mfrc522_pipeline_run(p);
+
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+static int mfrc522_rng_read(struct hwrng *rng, void *buf, size_t max, bool wait)
+{
+	struct mfrc522_state *state = container_of(rng, struct mfrc522_state,
+						   rng.hwrng);
+	u8 saved[MFRC522_MEM_SIZE];
+	size_t done = 0;
+	u64 start;
+	int restored;
+	int ret;
+
+	ret = mfrc522_pm_get(state);
+	if (ret < 0)
+		return ret;
+
+	// A non-blocking read returns nothing rather than wait for a command
+	if (wait) {
+		ret = mutex_lock_interruptible(&state->lock);
+		if (ret) {
+			mfrc522_pm_put(state);
+			return ret;
+		}
+	} else if (!mutex_trylock(&state->lock)) {
+		mfrc522_pm_put(state);
+		return 0;
+	}
+
+	start = ktime_get_ns();
+
+	// hw_random reads come at any time, in between a mem_write and the
+	// mem_read expecting its data back. The internal memory is therefore
+	// saved and written back around the generations, as clock calibration
+	// does, while the lock keeps commands out
+	ret = mfrc522_rng_save(state, saved);
+	if (!ret) {
+		while (done < max) {
+			ret = mfrc522_rng_batch(state, (u8 *)buf + done,
+						max - done);
+			if (ret < 0)
+				break;
+
+			done += ret;
+		}
+
+		restored = mfrc522_rng_restore(state, saved);
+		if (restored < 0)
+			pr_err("[MFRC522] Couldn't restore the internal memory: %d\n",
+			       restored);
+	}
+
+	atomic64_add(ktime_get_ns() - start, &state->rng.busy_ns);
+	atomic64_add(done, &state->rng.bytes);
+
+	mutex_unlock(&state->lock);
+	mfrc522_pm_put(state);
+
+	if (ret < 0 && !done) {
+		pr_err("[MFRC522] Couldn't generate random bytes: %d\n", ret);
+		return ret;
+	}
+
+	return done;
+}
+
+int mfrc522_rng_init(struct mfrc522_state *state)
+{
+	state->rng.hwrng = (struct hwrng){
+		.name = state->name,
+		.read = mfrc522_rng_read,
+		// A better source registered by the SoC stays the current one,
+		// and the fill thread hardly credits anything from this one.
+		// rngd still tests and mixes what /dev/hwrng gives
+		.quality = MFRC522_RNG_QUALITY,
+	};
+
+	return hwrng_register(&state->rng.hwrng);
+}
+
+void mfrc522_rng_exit(struct mfrc522_state *state)
+{
+	hwrng_unregister(&state->rng.hwrng);
+}
+
+/**
+ * Bytes per second over a duration, 0 if nothing was measured
+ */
+static u64 mfrc522_rng_rate(u64 bytes, u64 ns)
+{
+	return ns ? div64_u64(bytes * NSEC_PER_SEC, ns) : 0;
+}
+
+static int mfrc522_rng_bench_show(struct seq_file *s, void *unused)
+{
+	struct mfrc522_state *state = s->private;
+	u8 buf[MFRC522_RNG_BATCH * MFRC522_ID_SIZE];
+	u64 bytes = atomic64_read(&state->rng.bytes);
+	u64 busy_ns = atomic64_read(&state->rng.busy_ns);
+	size_t done = 0;
+	u64 start;
+	u64 ns;
+	int ret;
+
+	seq_printf(s, "%-8s %10s %14s %12s\n", "source", "bytes", "ns", "bytes_per_s");
+	// Everything generated so far, earlier benches included
+	seq_printf(s, "%-8s %10llu %14llu %12llu\n", "total", bytes, busy_ns,
+		   mfrc522_rng_rate(bytes, busy_ns));
+
+	// Whole batches, going through the lock and runtime PM each time as
+	// hw_random reads do
+	start = ktime_get_ns();
+
+	while (done < MFRC522_RNG_BENCH_SIZE) {
+		ret = mfrc522_rng_read(&state->rng.hwrng, buf, sizeof(buf), true);
+		if (ret < 0)
+			return ret;
+
+		done += ret;
+	}
+
+	ns = ktime_get_ns() - start;
+
+	memzero_explicit(buf, sizeof(buf));
+
+	seq_printf(s, "%-8s %10zu %14llu %12llu\n", "bench", done, ns,
+		   mfrc522_rng_rate(done, ns));
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(mfrc522_rng_bench);
+
+void mfrc522_rng_debugfs_init(struct mfrc522_state *state)
+{
+	debugfs_create_file("rng_bench", 0400, state->debugfs, state,
+			    &mfrc522_rng_bench_fops);
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_RNG_H
+#define MFRC522_RNG_H
+
+#include <linux/kconfig.h>
+
+#include "mfrc522_module.h"
+
+#if IS_ENABLED(CONFIG_HW_RANDOM)
+
+/**
+ * Register a device with the hw_random framework, as a source backed by the
+ * MFRC522's GenerateRandomID command, named after its misc device
+ *
+ * @param state Device to register
+ *
+ * @return 0 on success, a negative number on error
+ */
+int mfrc522_rng_init(struct mfrc522_state *state);
+
+/**
+ * Unregister a device from the hw_random framework. Waits for any read in
+ * progress
+ *
+ * @param state Device to unregister
+ */
+void mfrc522_rng_exit(struct mfrc522_state *state);
+
+/**
+ * Create the rng_bench debugfs file of a device. Reading it generates random
+ * bytes the way hw_random reads do, and shows the sustained throughput
+ *
+ * @param state Device whose debugfs directory is set up
+ */
+void mfrc522_rng_debugfs_init(struct mfrc522_state *state);
+
+#else
+
+static inline int mfrc522_rng_init(struct mfrc522_state *state)
+{
+	return 0;
+}
+
+static inline void mfrc522_rng_exit(struct mfrc522_state *state)
+{
+}
+
+static inline void mfrc522_rng_debugfs_init(struct mfrc522_state *state)
+{
+}
+
+#endif /* IS_ENABLED(CONFIG_HW_RANDOM) */
+
+#endif /* ! MFRC522_RNG_H */
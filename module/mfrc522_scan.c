@@ -0,0 +1,213 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/uaccess.h>
+
+#include "mfrc522_picc.h"
+#include "mfrc522_pm.h"
+#include "mfrc522_scan.h"
+
+#define MFRC522_SCAN_DEFAULT_INTERVAL_MS 100
+
+/**
+ * Queue a tag event about the current tag, or account for it as dropped if
+ * userspace did not keep up. Only called from the scan work
+ *
+ * @param state Device which noticed the event
+ * @param type Type of the event, one of enum mfrc522_tag_event_type
+ * @param timestamp Time of the scan
+ * @param status 0, or the negative errno of the scan if it failed
+ */
+static void mfrc522_scan_push(struct mfrc522_state *state, u8 type,
+			      u64 timestamp, int status)
+{
+	struct mfrc522_scan *scan = &state->scan;
+	struct mfrc522_tag_event event = scan->tag;
+	bool queued;
+
+	if (type == MFRC522_TAG_SCAN_FAILED)
+		memset(&event, 0, sizeof(event));
+
+	event.timestamp_ns = timestamp;
+	event.type = type;
+	event.dropped = scan->dropped_pending;
+
+	// The scan work is the only producer, so no lock is needed on this side
+	if (mfrc522_ring_mapped(state))
+		queued = !mfrc522_ring_push(state, &event, status);
+	else
+		queued = kfifo_put(&scan->events, event);
+
+	if (!queued) {
+		scan->dropped_pending++;
+		atomic64_inc(&scan->dropped);
+		return;
+	}
+
+	scan->dropped_pending = 0;
+	wake_up_interruptible(&state->read_wait);
+}
+
+/**
+ * Compare the result of a scan with the tag seen by the previous one, and queue
+ * the matching events
+ *
+ * @param state Device which ran the scan
+ * @param uid UID of the tag found, or NULL if there was none
+ * @param timestamp Time of the scan
+ */
+static void mfrc522_scan_update(struct mfrc522_state *state,
+				const struct mfrc522_picc_uid *uid,
+				u64 timestamp)
+{
+	struct mfrc522_scan *scan = &state->scan;
+
+	if (uid && scan->tag_present && uid->size == scan->tag.uid_len &&
+	    !memcmp(uid->bytes, scan->tag.uid, uid->size))
+		return;
+
+	if (scan->tag_present) {
+		mfrc522_scan_push(state, MFRC522_TAG_LEFT, timestamp, 0);
+		scan->tag_present = false;
+	}
+
+	if (!uid)
+		return;
+
+	memset(&scan->tag, 0, sizeof(scan->tag));
+	scan->tag.sak = uid->sak;
+	scan->tag.uid_len = uid->size;
+	memcpy(scan->tag.uid, uid->bytes, uid->size);
+	scan->tag_present = true;
+
+	mfrc522_scan_push(state, MFRC522_TAG_ARRIVED, timestamp, 0);
+}
+
+static void mfrc522_scan_work(struct work_struct *work)
+{
+	struct mfrc522_scan *scan =
+		container_of(to_delayed_work(work), struct mfrc522_scan, work);
+	struct mfrc522_state *state =
+		container_of(scan, struct mfrc522_state, scan);
+	struct mfrc522_picc_uid uid;
+	u64 timestamp;
+	int pm;
+	int ret;
+
+	// A device which could not be woken up counts as a failed scan
+	pm = mfrc522_pm_get(state);
+
+	mutex_lock(&state->lock);
+
+	// Polling might have been disabled while we were waiting for the lock
+	if (!scan->enabled)
+		goto out;
+
+	timestamp = ktime_get_ns();
+
+	// A selected tag ignores WUPA. Halt it so that the next scan still sees it
+	ret = pm < 0 ? pm : mfrc522_picc_read_uid(state, &uid, true);
+	if (!ret) {
+		mfrc522_scan_update(state, &uid, timestamp);
+	} else if (ret == -ENODATA) {
+		mfrc522_scan_update(state, NULL, timestamp);
+	} else if (mfrc522_ring_mapped(state)) {
+		mfrc522_scan_push(state, MFRC522_TAG_SCAN_FAILED, timestamp,
+				  ret);
+	}
+
+	// Other errors, such as a tag leaving the field in the middle of the
+	// exchange, are sorted out by the next scan. Only the shared ring reports
+	// them, as readers of struct mfrc522_tag_event do not expect them
+	schedule_delayed_work(&scan->work, msecs_to_jiffies(scan->interval_ms));
+
+out:
+	mutex_unlock(&state->lock);
+
+	if (!pm)
+		mfrc522_pm_put(state);
+}
+
+void mfrc522_scan_init(struct mfrc522_state *state)
+{
+	struct mfrc522_scan *scan = &state->scan;
+
+	scan->interval_ms = MFRC522_SCAN_DEFAULT_INTERVAL_MS;
+	INIT_DELAYED_WORK(&scan->work, mfrc522_scan_work);
+	INIT_KFIFO(scan->events);
+	spin_lock_init(&scan->events_lock);
+}
+
+void mfrc522_scan_enable(struct mfrc522_state *state, bool enable)
+{
+	struct mfrc522_scan *scan = &state->scan;
+
+	lockdep_assert_held(&state->lock);
+
+	if (scan->enabled == enable)
+		return;
+
+	WRITE_ONCE(scan->enabled, enable);
+
+	if (enable) {
+		mod_delayed_work(system_wq, &scan->work, 0);
+		return;
+	}
+
+	// The scan work cannot be waited for here since it takes the lock. If it
+	// is already running, it stops by itself once it gets the lock
+	cancel_delayed_work(&scan->work);
+	scan->tag_present = false;
+
+	// Readers waiting for events have nothing left to wait for
+	wake_up_interruptible(&state->read_wait);
+}
+
+void mfrc522_scan_stop(struct mfrc522_state *state)
+{
+	mutex_lock(&state->lock);
+	mfrc522_scan_enable(state, false);
+	mutex_unlock(&state->lock);
+
+	cancel_delayed_work_sync(&state->scan.work);
+}
+
+ssize_t mfrc522_scan_read(struct mfrc522_state *state, char __user *buffer,
+			  size_t len, bool nonblock)
+{
+	struct mfrc522_scan *scan = &state->scan;
+	struct mfrc522_tag_event event;
+	size_t copied = 0;
+	int ret;
+
+	if (len < sizeof(event))
+		return -EINVAL;
+
+	if (!mfrc522_scan_pending(state)) {
+		if (nonblock)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(state->read_wait,
+					       READ_ONCE(state->dead) ||
+					       !mfrc522_scan_readable(state) ||
+					       mfrc522_scan_pending(state));
+		if (ret)
+			return ret;
+
+		if (READ_ONCE(state->dead))
+			return -ENODEV;
+	}
+
+	while (copied + sizeof(event) <= len &&
+	       kfifo_out_spinlocked(&scan->events, &event, 1,
+				    &scan->events_lock)) {
+		if (copy_to_user(buffer + copied, &event, sizeof(event)))
+			return copied ? copied : -EFAULT;
+
+		copied += sizeof(event);
+	}
+
+	return copied;
+}
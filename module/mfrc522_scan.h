@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_SCAN_H
+#define MFRC522_SCAN_H
+
+#include <linux/kfifo.h>
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+#include "mfrc522_ring.h"
+
+#define MFRC522_SCAN_MIN_INTERVAL_MS 10
+#define MFRC522_SCAN_MAX_INTERVAL_MS 60000
+
+/**
+ * Initialize the tag polling state of a device. Polling starts disabled
+ *
+ * @param state Device to initialize
+ */
+void mfrc522_scan_init(struct mfrc522_state *state);
+
+/**
+ * Enable or disable tag polling. Must be called with the device's lock held
+ *
+ * @param state Device to poll
+ * @param enable Whether to poll for tags
+ */
+void mfrc522_scan_enable(struct mfrc522_state *state, bool enable);
+
+/**
+ * Disable tag polling, and wait for the scan work to be over
+ *
+ * @param state Device to stop polling
+ */
+void mfrc522_scan_stop(struct mfrc522_state *state);
+
+/**
+ * Whether tag events are waiting to be read
+ *
+ * @param state Device to check
+ */
+static inline bool mfrc522_scan_pending(struct mfrc522_state *state)
+{
+	if (mfrc522_ring_mapped(state))
+		return mfrc522_ring_pending(state);
+
+	return !kfifo_is_empty(&state->scan.events);
+}
+
+/**
+ * Whether read() should return tag events rather than an empty answer. It never
+ * does while the shared ring is mapped
+ *
+ * @param state Device to check
+ */
+static inline bool mfrc522_scan_readable(struct mfrc522_state *state)
+{
+	if (mfrc522_ring_mapped(state))
+		return false;
+
+	return READ_ONCE(state->scan.enabled) || mfrc522_scan_pending(state);
+}
+
+/**
+ * Copy as many queued tag events as possible to userspace. If none is queued,
+ * wait for one unless nonblock is set
+ *
+ * @param state Device to read events from
+ * @param buffer Userspace buffer, filled with struct mfrc522_tag_event
+ * @param len Size of the buffer
+ * @param nonblock Whether to return -EAGAIN instead of waiting
+ *
+ * @return The amount of bytes copied on success, a negative number on error
+ */
+ssize_t mfrc522_scan_read(struct mfrc522_state *state, char __user *buffer,
+			  size_t len, bool nonblock);
+
+#endif /* ! MFRC522_SCAN_H */
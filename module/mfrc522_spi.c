@@ -1,35 +1,70 @@
 // SPDX-License-Identifier: GPL-2.0
 
+#include <linux/completion.h>
+#include <linux/delay.h>
+#include <linux/interrupt.h>
+#include <linux/irq.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/regmap.h>
 #include <linux/spi/spi.h>
+#include <linux/slab.h>
 #include <linux/string.h>
 
+#include "mfrc522_pipeline.h"
 #include "mfrc522_spi.h"
+#include "mfrc522_stats.h"
+#include "mfrc522_trace.h"
+
+#define MFRC522_COM_IEN_REG_IRQ_INV BIT(7)
+#define MFRC522_DIV_IEN_REG_IRQ_PUSH_PULL BIT(7)
+
+// Interrupts waited upon by the driver
+#define MFRC522_COM_IRQ_ENABLED                                                \
+	(MFRC522_COM_IRQ_IDLE | MFRC522_COM_IRQ_RX | MFRC522_COM_IRQ_TIMER)
+
+#define MFRC522_MAX_REGISTER 0x3F
+
+#define MFRC522_CMD_TIMEOUT_MS 50
+#define MFRC522_CMD_POLL_MIN_US 20
+#define MFRC522_CMD_POLL_MAX_US 100
+
+/**
+ * Send a single SPI message made of the given transfers, and account for it
+ *
+ * @param state Device to talk to
+ * @param xfers Transfers making up the message
+ * @param num_xfers Amount of transfers
+ *
+ * @return A negative number on error, 0 on success
+ */
+static int mfrc522_spi_transfer(struct mfrc522_state *state,
+				struct spi_transfer *xfers,
+				unsigned int num_xfers)
+{
+	u64 start = ktime_get_ns();
+	struct spi_message msg;
+	int ret;
 
-#define MFRC522_FIFO_LEVEL_REG_FLUSH_SHIFT 7
-#define MFRC522_FIFO_LEVEL_REG_LEVEL_MASK 0x7F
-
-#define MFRC522_COMMAND_REG_RCV_OFF_SHIFT 5
-#define MFRC522_COMMAND_REG_POWER_DOWN_SHIFT 4
-#define MFRC522_COMMAND_REG_COMMAND_MASK 0xF
+	// spi_sync() would wait for the bus lock a batch is holding
+	if (READ_ONCE(state->bus_locked)) {
+		spi_message_init_with_transfers(&msg, xfers, num_xfers);
+		ret = spi_sync_locked(state->spi, &msg);
+	} else {
+		ret = spi_sync_transfer(state->spi, xfers, num_xfers);
+	}
 
-struct spi_device *mfrc522_spi;
+	mfrc522_stats_spi(state, ktime_get_ns() - start, ret);
 
-struct address_byte address_byte_build(u8 mode, u8 addr)
-{
-	struct address_byte byte = {
-		.addr = addr,
-		.rw = mode,
-	};
-
-	return byte;
+	return ret;
 }
 
-int mfrc522_get_version(void)
+int mfrc522_get_version(struct mfrc522_state *state)
 {
 	u8 version;
 	int ret;
 
-	ret = mfrc522_register_read(mfrc522_spi, MFRC522_VERSION_REG, &version,
+	ret = mfrc522_register_read(state, MFRC522_VERSION_REG, &version,
 				    1);
 
 	if (ret < 0)
@@ -38,44 +73,210 @@ int mfrc522_get_version(void)
 	return version;
 }
 
-void mfrc522_fifo_flush(void)
+void mfrc522_fifo_flush(struct mfrc522_state *state)
 {
-	u8 flush_byte = 1 << MFRC522_FIFO_LEVEL_REG_FLUSH_SHIFT;
+	mfrc522_register_write(state, MFRC522_FIFO_LEVEL_REG,
+			       MFRC522_FIFO_LEVEL_REG_FLUSH);
+}
 
-	mfrc522_register_write(mfrc522_spi, MFRC522_FIFO_LEVEL_REG, flush_byte);
+bool mfrc522_irq_available(struct mfrc522_state *state)
+{
+	return state->irq > 0;
 }
 
-static void wait_for_cmd(void)
+int mfrc522_poll_idle(struct mfrc522_state *state)
 {
+	unsigned long timeout =
+		jiffies + msecs_to_jiffies(MFRC522_CMD_TIMEOUT_MS);
 	int cmd;
 
-	do {
-		cmd = mfrc522_read_command();
-		pr_info("[MFRC522] Current command is: 0x%x\n", cmd);
-	} while (cmd != MFRC522_COMMAND_IDLE);
+	while (true) {
+		cmd = mfrc522_read_command(state);
+		if (cmd < 0)
+			return cmd;
+
+		if (cmd == MFRC522_COMMAND_IDLE)
+			return 0;
+
+		if (time_after(jiffies, timeout)) {
+			mfrc522_stats_timeout(state);
+			return -ETIMEDOUT;
+		}
+
+		usleep_range(MFRC522_CMD_POLL_MIN_US, MFRC522_CMD_POLL_MAX_US);
+	}
+}
+
+int mfrc522_poll_irq(struct mfrc522_state *state, u8 mask)
+{
+	unsigned long timeout =
+		jiffies + msecs_to_jiffies(MFRC522_CMD_TIMEOUT_MS);
+	u8 com_irq;
+	int ret;
+
+	while (true) {
+		ret = mfrc522_register_read(state, MFRC522_COM_IRQ_REG,
+					    &com_irq, 1);
+		if (ret < 0)
+			return ret;
+
+		if (com_irq & mask)
+			return com_irq;
+
+		if (time_after(jiffies, timeout)) {
+			mfrc522_stats_timeout(state);
+			return -ETIMEDOUT;
+		}
+
+		usleep_range(MFRC522_CMD_POLL_MIN_US, MFRC522_CMD_POLL_MAX_US);
+	}
 }
 
-int mfrc522_send_command(u8 rcv_off, u8 power_down, u8 command)
+/**
+ * Sleep until the interrupt handler signals that the MFRC522 went back to idle
+ *
+ * @return 0 on success, a negative number on error or timeout
+ */
+static int wait_for_cmd(struct mfrc522_state *state)
 {
-	u8 command_byte = rcv_off << MFRC522_COMMAND_REG_RCV_OFF_SHIFT |
-			  power_down << MFRC522_COMMAND_REG_POWER_DOWN_SHIFT |
-			  command;
+	if (!wait_for_completion_timeout(
+		    &state->irq_done,
+		    msecs_to_jiffies(MFRC522_CMD_TIMEOUT_MS))) {
+		mfrc522_stats_timeout(state);
+		return -ETIMEDOUT;
+	}
+
+	if (!(READ_ONCE(state->irq_latched) & MFRC522_COM_IRQ_IDLE))
+		return -EIO;
+
+	return 0;
+}
+
+/**
+ * Write a command to the MFRC522, and wait for it to go back to idle
+ *
+ * @return 0 on success, a negative number on error or timeout
+ */
+static int __mfrc522_send_command(struct mfrc522_state *state, u8 command_byte)
+{
+	int ret;
+
+	if (!state->irq) {
+		ret = mfrc522_register_write(state, MFRC522_COMMAND_REG,
+					     command_byte);
+		if (ret < 0)
+			return ret;
+
+		return mfrc522_poll_idle(state);
+	}
+
+	// Clear interrupts left over by previous commands, so that only this
+	// command's completion wakes us up
+	ret = mfrc522_register_write(state, MFRC522_COM_IRQ_REG,
+				     MFRC522_COM_IRQ_CLEAR_ALL);
+	if (ret < 0)
+		return ret;
+
+	WRITE_ONCE(state->irq_latched, 0);
+	reinit_completion(&state->irq_done);
+
+	ret = mfrc522_register_write(state, MFRC522_COMMAND_REG,
+				     command_byte);
+	if (ret < 0)
+		return ret;
+
+	return wait_for_cmd(state);
+}
+
+int mfrc522_send_command(struct mfrc522_state *state, u8 rcv_off,
+			 u8 power_down, u8 command)
+{
+	int ret;
+
+	ret = __mfrc522_send_command(state,
+				     mfrc522_command_byte(rcv_off, power_down,
+							  command));
+	trace_mfrc522_chip_cmd(state, command, ret);
+
+	return ret;
+}
+
+static irqreturn_t mfrc522_irq_handler(int irq, void *data)
+{
+	struct mfrc522_state *state = data;
+	u8 com_irq;
+
+	if (mfrc522_register_read(state, MFRC522_COM_IRQ_REG, &com_irq,
+				  1) < 0)
+		return IRQ_NONE;
+
+	com_irq &= MFRC522_COM_IRQ_ENABLED;
+	if (!com_irq)
+		return IRQ_NONE;
+
+	// Acknowledge the interrupts so that the IRQ pin is released
+	mfrc522_register_write(state, MFRC522_COM_IRQ_REG, com_irq);
+
+	WRITE_ONCE(state->irq_latched,
+		   READ_ONCE(state->irq_latched) | com_irq);
+	complete(&state->irq_done);
+
+	mfrc522_pipeline_irq(state, com_irq);
+
+	return IRQ_HANDLED;
+}
+
+int mfrc522_irq_init(struct mfrc522_state *state)
+{
+	struct spi_device *client = state->spi;
+	unsigned int trigger;
+	u8 com_ien = MFRC522_COM_IRQ_ENABLED;
+	int ret;
+
+	if (client->irq <= 0)
+		return 0;
+
+	// The IRQ pin is active low by default. Only keep that inversion if the
+	// interrupt controller expects it
+	trigger = irq_get_trigger_type(client->irq);
+	if (!(trigger & (IRQ_TYPE_EDGE_RISING | IRQ_TYPE_LEVEL_HIGH))) {
+		com_ien |= MFRC522_COM_IEN_REG_IRQ_INV;
+		if (trigger == IRQ_TYPE_NONE)
+			trigger = IRQ_TYPE_EDGE_FALLING;
+	}
 
-	if (mfrc522_register_write(mfrc522_spi, MFRC522_COMMAND_REG,
-				   command_byte) < 0)
-		return -1;
+	ret = mfrc522_register_write(state, MFRC522_COM_IRQ_REG,
+				     MFRC522_COM_IRQ_CLEAR_ALL);
+	if (ret < 0)
+		return ret;
 
-	wait_for_cmd();
+	ret = mfrc522_register_write(state, MFRC522_DIV_IEN_REG,
+				     MFRC522_DIV_IEN_REG_IRQ_PUSH_PULL);
+	if (ret < 0)
+		return ret;
+
+	ret = mfrc522_register_write(state, MFRC522_COM_IEN_REG, com_ien);
+	if (ret < 0)
+		return ret;
+
+	ret = devm_request_threaded_irq(&client->dev, client->irq, NULL,
+					mfrc522_irq_handler,
+					trigger | IRQF_ONESHOT,
+					dev_name(&client->dev), state);
+	if (ret < 0)
+		return ret;
+
+	state->irq = client->irq;
 
 	return 0;
 }
 
-int mfrc522_read_command(void)
+int mfrc522_read_command(struct mfrc522_state *state)
 {
 	u8 command_reg;
 	int ret;
 
-	ret = mfrc522_register_read(mfrc522_spi, MFRC522_COMMAND_REG,
+	ret = mfrc522_register_read(state, MFRC522_COMMAND_REG,
 				    &command_reg, 1);
 
 	if (ret < 0)
@@ -84,12 +285,12 @@ int mfrc522_read_command(void)
 	return command_reg & MFRC522_COMMAND_REG_COMMAND_MASK;
 }
 
-int mfrc522_fifo_level(void)
+int mfrc522_fifo_level(struct mfrc522_state *state)
 {
 	u8 fifo_level;
 	int ret;
 
-	ret = mfrc522_register_read(mfrc522_spi, MFRC522_FIFO_LEVEL_REG,
+	ret = mfrc522_register_read(state, MFRC522_FIFO_LEVEL_REG,
 				    &fifo_level, 1);
 	if (ret < 0)
 		return ret;
@@ -97,68 +298,237 @@ int mfrc522_fifo_level(void)
 	// Mask the MSb to get the amount of bytes in the FIFO buffer
 	fifo_level &= MFRC522_FIFO_LEVEL_REG_LEVEL_MASK;
 
-	pr_info("[MFRC522] Fifo level: %d\n", fifo_level);
-
 	return fifo_level;
 }
 
-int mfrc522_fifo_read(u8 *buf)
+int mfrc522_fifo_read(struct mfrc522_state *state, u8 *buf)
 {
 	int ret;
-	int fifo_level = mfrc522_fifo_level();
+	int fifo_level = mfrc522_fifo_level(state);
 
 	if (fifo_level < 0)
 		return fifo_level;
 
-	ret = mfrc522_register_read(mfrc522_spi, MFRC522_FIFO_DATA_REG, buf,
+	ret = mfrc522_register_read(state, MFRC522_FIFO_DATA_REG, buf,
 				    fifo_level);
 	if (ret < 0)
 		return ret;
 
+	trace_mfrc522_fifo_read(state, buf, fifo_level);
+
 	return fifo_level;
 }
 
-int mfrc522_fifo_write(const u8 *buf, size_t len)
+int mfrc522_fifo_write(struct mfrc522_state *state, const u8 *buf,
+		       size_t len)
 {
-	size_t i;
-	int ret;
+	if (len > MFRC522_MAX_FIFO_SIZE)
+		return -EINVAL;
 
-	for (i = 0; i < len; i++) {
-		ret = mfrc522_register_write(mfrc522_spi, MFRC522_FIFO_DATA_REG,
-					     buf[i]);
-		if (ret < 0)
-			return ret;
-	}
+	trace_mfrc522_fifo_write(state, buf, len);
 
-	return 0;
+	return mfrc522_register_write_burst(state, MFRC522_FIFO_DATA_REG,
+					    buf, len);
 }
 
-int mfrc522_register_read(struct spi_device *client, u8 reg, u8 *read_buff,
+int mfrc522_register_read(struct mfrc522_state *state, u8 reg, u8 *read_buff,
 			  u8 read_len)
 {
-	size_t i;
+	unsigned int value;
 	int ret;
-	struct address_byte reg_read =
-		address_byte_build(MFRC522_SPI_READ, reg);
 
-	for (i = 0; i < read_len; i++) {
-		ret = spi_write_then_read(client, &reg_read, 1, read_buff + i,
-					  1);
+	if (read_len == 1) {
+		ret = regmap_read(state->regmap, reg, &value);
 		if (ret < 0)
 			return ret;
+
+		*read_buff = value;
+		trace_mfrc522_reg_read(state, reg, read_buff, 1);
+
+		return 1;
 	}
 
+	ret = regmap_noinc_read(state->regmap, reg, read_buff, read_len);
+	if (ret < 0)
+		return ret;
+
+	trace_mfrc522_reg_read(state, reg, read_buff, read_len);
+
 	return read_len;
 }
 
-int mfrc522_register_write(struct spi_device *client, u8 reg, u8 value)
+int mfrc522_register_write(struct mfrc522_state *state, u8 reg, u8 value)
 {
-	struct address_byte reg_write =
-		address_byte_build(MFRC522_SPI_WRITE, reg);
-	u8 data[2] = { 0, value };
+	trace_mfrc522_reg_write(state, reg, &value, 1);
 
-	// We cannot directly put reg_write in data[0] at init time
-	memcpy(&data[0], &reg_write, sizeof(u8));
+	return regmap_write(state->regmap, reg, value);
+}
 
-	return spi_write(client, &data, 2);
+int mfrc522_register_write_burst(struct mfrc522_state *state, u8 reg,
+				 const u8 *buf, size_t len)
+{
+	if (!len)
+		return 0;
+
+	trace_mfrc522_reg_write(state, reg, buf, len);
+
+	return regmap_noinc_write(state->regmap, reg, buf, len);
+}
+
+int mfrc522_register_update_bits(struct mfrc522_state *state, u8 reg, u8 mask,
+				 u8 value)
+{
+	return regmap_update_bits(state->regmap, reg, mask, value);
+}
+
+/**
+ * Regmap bus read callback. Multi-byte reads are done in a single SPI message,
+ * using the continuous read sequence described in section 8.1.2.1
+ */
+static int mfrc522_regmap_bus_read(void *context, const void *reg_buf,
+				   size_t reg_size, void *val_buf,
+				   size_t val_size)
+{
+	struct mfrc522_state *state = context;
+	struct spi_transfer xfer = { 0 };
+	u8 *tx_buf;
+	u8 *rx_buf;
+	int ret;
+
+	if (reg_size != 1)
+		return -EINVAL;
+
+	// The address byte is clocked out once per byte to read, and the sequence is
+	// ended by a zero byte. The MFRC522 answers each address byte during the
+	// following one, so the first received byte is meaningless. SPI buffers must
+	// be DMA-safe, so they cannot live on the stack
+	tx_buf = kmalloc(2 * (val_size + 1), GFP_KERNEL);
+	if (!tx_buf)
+		return -ENOMEM;
+
+	rx_buf = tx_buf + val_size + 1;
+
+	memset(tx_buf, *(const u8 *)reg_buf, val_size);
+	tx_buf[val_size] = 0;
+
+	xfer.tx_buf = tx_buf;
+	xfer.rx_buf = rx_buf;
+	xfer.len = val_size + 1;
+
+	ret = mfrc522_spi_transfer(state, &xfer, 1);
+	if (!ret)
+		memcpy(val_buf, rx_buf + 1, val_size);
+
+	kfree(tx_buf);
+
+	return ret;
+}
+
+/**
+ * Regmap bus write callback. The address byte is only sent once, and every
+ * following byte is written to that same address, as described in section 8.1.2.2
+ */
+static int mfrc522_regmap_bus_write(void *context, const void *data,
+				    size_t count)
+{
+	struct mfrc522_state *state = context;
+	struct spi_transfer xfer = {
+		.tx_buf = data,
+		.len = count,
+	};
+
+	// Regmap hands us its own heap allocated buffer, which is DMA-safe
+	return mfrc522_spi_transfer(state, &xfer, 1);
+}
+
+static const struct regmap_bus mfrc522_regmap_bus = {
+	.read = mfrc522_regmap_bus_read,
+	.write = mfrc522_regmap_bus_write,
+	.reg_format_endian_default = REGMAP_ENDIAN_BIG,
+	.val_format_endian_default = REGMAP_ENDIAN_BIG,
+};
+
+static bool mfrc522_readable_reg(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	// Reserved registers, see table 20 of section 9.2
+	case 0x00:
+	case 0x0F:
+	case 0x10:
+	case 0x1A:
+	case 0x1B:
+	case 0x1E:
+	case 0x20:
+	case 0x23:
+	case 0x25:
+	case 0x30:
+	case 0x3C ... 0x3F:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/**
+ * Registers updated by the MFRC522 itself, which must never be cached
+ */
+static bool mfrc522_volatile_reg(struct device *dev, unsigned int reg)
+{
+	switch (reg) {
+	case MFRC522_COMMAND_REG:
+	case MFRC522_COM_IRQ_REG:
+	case MFRC522_DIV_IRQ_REG:
+	case MFRC522_ERROR_REG:
+	case MFRC522_STATUS_1_REG:
+	case MFRC522_STATUS_2_REG:
+	case MFRC522_FIFO_DATA_REG:
+	case MFRC522_FIFO_LEVEL_REG:
+	case MFRC522_CONTROL_REG:
+	case MFRC522_BIT_FRAMING_REG:
+	case MFRC522_COLL_REG:
+	case MFRC522_CRC_RESULT_MSB_REG:
+	case MFRC522_CRC_RESULT_LSB_REG:
+	case MFRC522_T_COUNTER_VAL_MSB_REG:
+	case MFRC522_T_COUNTER_VAL_LSB_REG:
+	case MFRC522_TEST_PIN_VALUE_REG:
+	case MFRC522_TEST_BUS_REG:
+	case MFRC522_TEST_ADC_REG:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool mfrc522_noinc_reg(struct device *dev, unsigned int reg)
+{
+	return reg == MFRC522_FIFO_DATA_REG;
+}
+
+static const struct regmap_config mfrc522_regmap_config = {
+	.reg_bits = 8,
+	.val_bits = 8,
+	.reg_shift = -MFRC522_ADDRESS_BYTE_SHIFT,
+	.read_flag_mask = MFRC522_ADDRESS_BYTE_READ,
+	.max_register = MFRC522_MAX_REGISTER,
+	.max_raw_read = MFRC522_MAX_FIFO_SIZE,
+	.max_raw_write = MFRC522_MAX_FIFO_SIZE,
+	.readable_reg = mfrc522_readable_reg,
+	.volatile_reg = mfrc522_volatile_reg,
+	.readable_noinc_reg = mfrc522_noinc_reg,
+	.writeable_noinc_reg = mfrc522_noinc_reg,
+	.cache_type = REGCACHE_RBTREE,
+};
+
+int mfrc522_regmap_init(struct mfrc522_state *state)
+{
+	struct regmap *regmap;
+
+	regmap = devm_regmap_init(&state->spi->dev, &mfrc522_regmap_bus, state,
+				  &mfrc522_regmap_config);
+	if (IS_ERR(regmap))
+		return PTR_ERR(regmap);
+
+	state->regmap = regmap;
+
+	return 0;
 }
@@ -3,25 +3,20 @@
 #ifndef MFRC522_SPI_H
 #define MFRC522_SPI_H
 
+#include <linux/bits.h>
 #include <linux/spi/spi.h>
 #include <linux/types.h>
 #include <linux/spi/spi.h>
 #include <linux/compiler.h>
 
-/**
- * Abstraction on the format used to define the address bytes sent to the MFRC522
- * as part of an SPI transfer
- */
-struct address_byte {
-	u8 lsb : 1; // 0
-	u8 addr : 6;
-	u8 rw : 1; // 1 -> Read, 0 -> Write
-} __packed;
+#include "mfrc522_module.h"
 
-#define MFRC522_SPI_MAX_CLOCK_SPEED 1000000
+// Section 8.1.2: the SPI interface runs at up to 10 Mbit/s. Probing starts at a
+// speed slow enough for long cables, and calibration goes up from there
+#define MFRC522_SPI_MAX_CLOCK_SPEED 10000000
+#define MFRC522_SPI_SAFE_CLOCK_SPEED 1000000
 
-#define MFRC522_SPI_WRITE 0
-#define MFRC522_SPI_READ 1
+#define MFRC522_MAX_FIFO_SIZE 64
 
 // MFRC522 commands, see 10.3
 #define MFRC522_COMMAND_IDLE 0b0000
@@ -37,9 +32,114 @@ struct address_byte {
 
 // MFRC522 registers, see 9.2
 #define MFRC522_COMMAND_REG 0x1
+#define MFRC522_COM_IEN_REG 0x2
+#define MFRC522_DIV_IEN_REG 0x3
+#define MFRC522_COM_IRQ_REG 0x4
+#define MFRC522_DIV_IRQ_REG 0x5
+#define MFRC522_ERROR_REG 0x6
+#define MFRC522_STATUS_1_REG 0x7
+#define MFRC522_STATUS_2_REG 0x8
 #define MFRC522_FIFO_DATA_REG 0x9
 #define MFRC522_FIFO_LEVEL_REG 0xA
+#define MFRC522_WATER_LEVEL_REG 0xB
+#define MFRC522_CONTROL_REG 0xC
+#define MFRC522_BIT_FRAMING_REG 0xD
+#define MFRC522_COLL_REG 0xE
+#define MFRC522_MODE_REG 0x11
+#define MFRC522_TX_MODE_REG 0x12
+#define MFRC522_RX_MODE_REG 0x13
+#define MFRC522_TX_CONTROL_REG 0x14
+#define MFRC522_TX_ASK_REG 0x15
+#define MFRC522_TX_SEL_REG 0x16
+#define MFRC522_RX_SEL_REG 0x17
+#define MFRC522_RX_THRESHOLD_REG 0x18
+#define MFRC522_DEMOD_REG 0x19
+#define MFRC522_MF_TX_REG 0x1C
+#define MFRC522_MF_RX_REG 0x1D
+#define MFRC522_SERIAL_SPEED_REG 0x1F
+#define MFRC522_CRC_RESULT_MSB_REG 0x21
+#define MFRC522_CRC_RESULT_LSB_REG 0x22
+#define MFRC522_MOD_WIDTH_REG 0x24
+#define MFRC522_RF_CFG_REG 0x26
+#define MFRC522_GS_N_REG 0x27
+#define MFRC522_CW_GS_P_REG 0x28
+#define MFRC522_MOD_GS_P_REG 0x29
+#define MFRC522_T_MODE_REG 0x2A
+#define MFRC522_T_PRESCALER_REG 0x2B
+#define MFRC522_T_RELOAD_MSB_REG 0x2C
+#define MFRC522_T_RELOAD_LSB_REG 0x2D
+#define MFRC522_T_COUNTER_VAL_MSB_REG 0x2E
+#define MFRC522_T_COUNTER_VAL_LSB_REG 0x2F
+#define MFRC522_TEST_SEL_1_REG 0x31
+#define MFRC522_TEST_SEL_2_REG 0x32
+#define MFRC522_TEST_PIN_EN_REG 0x33
+#define MFRC522_TEST_PIN_VALUE_REG 0x34
+#define MFRC522_TEST_BUS_REG 0x35
+#define MFRC522_AUTO_TEST_REG 0x36
 #define MFRC522_VERSION_REG 0x37
+#define MFRC522_ANALOG_TEST_REG 0x38
+#define MFRC522_TEST_DAC_1_REG 0x39
+#define MFRC522_TEST_DAC_2_REG 0x3A
+#define MFRC522_TEST_ADC_REG 0x3B
+
+// ComIrqReg bits, see 9.3.1.5
+#define MFRC522_COM_IRQ_TX BIT(6)
+#define MFRC522_COM_IRQ_RX BIT(5)
+#define MFRC522_COM_IRQ_IDLE BIT(4)
+#define MFRC522_COM_IRQ_HI_ALERT BIT(3)
+#define MFRC522_COM_IRQ_LO_ALERT BIT(2)
+#define MFRC522_COM_IRQ_ERR BIT(1)
+#define MFRC522_COM_IRQ_TIMER BIT(0)
+
+// Writing a bit to 1 in ComIrqReg while Set1 is 0 clears it
+#define MFRC522_COM_IRQ_CLEAR_ALL 0x7F
+
+// DivIrqReg bits, see 9.3.1.6
+#define MFRC522_DIV_IRQ_CRC BIT(2)
+
+// ErrorReg bits, see 9.3.1.7
+#define MFRC522_ERROR_WR_ERR BIT(7)
+#define MFRC522_ERROR_TEMP_ERR BIT(6)
+#define MFRC522_ERROR_BUFFER_OVFL BIT(4)
+#define MFRC522_ERROR_COLL_ERR BIT(3)
+#define MFRC522_ERROR_CRC_ERR BIT(2)
+#define MFRC522_ERROR_PARITY_ERR BIT(1)
+#define MFRC522_ERROR_PROTOCOL_ERR BIT(0)
+
+// Status2Reg bits, see 9.3.1.9
+#define MFRC522_STATUS_2_REG_MF_CRYPTO1_ON BIT(3)
+
+// ControlReg bits, see 9.3.1.13
+#define MFRC522_CONTROL_REG_T_STOP_NOW BIT(7)
+#define MFRC522_CONTROL_REG_RX_LAST_BITS_MASK 0x07
+
+// BitFramingReg bits, see 9.3.1.14
+#define MFRC522_BIT_FRAMING_REG_START_SEND BIT(7)
+#define MFRC522_BIT_FRAMING_REG_RX_ALIGN_SHIFT 4
+#define MFRC522_BIT_FRAMING_REG_TX_LAST_BITS_MASK 0x07
+
+// CollReg bits, see 9.3.1.15
+#define MFRC522_COLL_REG_VALUES_AFTER_COLL BIT(7)
+#define MFRC522_COLL_REG_POS_NOT_VALID BIT(5)
+#define MFRC522_COLL_REG_POS_MASK 0x1F
+
+// ModeReg bits, see 9.3.2.2. CRCPreset 01 is the 0x6363 preset of CRC_A
+#define MFRC522_MODE_REG_CRC_PRESET_MASK 0x03
+#define MFRC522_MODE_REG_CRC_PRESET_6363 0x01
+
+// TxControlReg bits, see 9.3.2.5
+#define MFRC522_TX_CONTROL_REG_TX2_RF_EN BIT(1)
+#define MFRC522_TX_CONTROL_REG_TX1_RF_EN BIT(0)
+
+// TxASKReg bits, see 9.3.2.6
+#define MFRC522_TX_ASK_REG_FORCE_100_ASK BIT(6)
+
+// TModeReg bits, see 9.3.3.10
+#define MFRC522_T_MODE_REG_T_AUTO BIT(7)
+#define MFRC522_T_MODE_REG_PRESCALER_HI_MASK 0x0F
+
+#define MFRC522_FIFO_LEVEL_REG_FLUSH BIT(7)
+#define MFRC522_FIFO_LEVEL_REG_LEVEL_MASK 0x7F
 
 // Helpers for command register values
 #define MFRC522_COMMAND_REG_RCV_ON 0
@@ -47,98 +147,214 @@ struct address_byte {
 #define MFRC522_COMMAND_REG_POWER_DOWN_ON 1
 #define MFRC522_COMMAND_REG_POWER_DOWN_OFF 0
 
+#define MFRC522_COMMAND_REG_RCV_OFF_SHIFT 5
+#define MFRC522_COMMAND_REG_POWER_DOWN_SHIFT 4
+#define MFRC522_COMMAND_REG_COMMAND_MASK 0xF
+
+// CommandReg's PowerDown bit reads 1 until the MFRC522 is awake, see 9.3.1.2
+#define MFRC522_COMMAND_REG_POWER_DOWN BIT(MFRC522_COMMAND_REG_POWER_DOWN_SHIFT)
+
+// Section 8.1.2.3: The register address is held in bits 6 to 1 of the address
+// byte, and its MSb selects a read
+#define MFRC522_ADDRESS_BYTE_SHIFT 1
+#define MFRC522_ADDRESS_BYTE_READ BIT(7)
+
+/**
+ * Build the SPI address byte used to access a register
+ */
+static inline u8 mfrc522_address_byte(u8 reg, bool read)
+{
+	return (read ? MFRC522_ADDRESS_BYTE_READ : 0) |
+	       reg << MFRC522_ADDRESS_BYTE_SHIFT;
+}
+
 /**
- * Global SPI device registered by our driver during probing
+ * Build a CommandReg value, see 9.3.1.2
  */
-extern struct spi_device *mfrc522_spi;
+static inline u8 mfrc522_command_byte(u8 rcv_off, u8 power_down, u8 command)
+{
+	return rcv_off << MFRC522_COMMAND_REG_RCV_OFF_SHIFT |
+	       power_down << MFRC522_COMMAND_REG_POWER_DOWN_SHIFT | command;
+}
 
 /**
- * Build a SPI address byte from a given address and a mode
+ * Setup the register map of the MFRC522. Registers are accessed through regmap,
+ * which caches every register not modified by the MFRC522 itself
+ *
+ * @param state Device to talk to
+ *
+ * @return 0 on success, a negative number on error
  */
-struct address_byte address_byte_build(u8 mode, u8 addr);
+int mfrc522_regmap_init(struct mfrc522_state *state);
 
 /**
  * Get the version number of the attached MFRC522
  *
+ * @param state Device to talk to
+ *
  * @return A negative number on error, the version number otherwise
  */
-int mfrc522_get_version(void);
+int mfrc522_get_version(struct mfrc522_state *state);
 
 /**
  * Read the FIFO level of the MFRC522
  *
+ * @param state Device to talk to
+ *
  * @return A positive number indicating the amount of bytes in the FIFO on success,
  *         a negative number otherwise
  */
-int mfrc522_fifo_level(void);
+int mfrc522_fifo_level(struct mfrc522_state *state);
 
 /**
  * Flush the FIFO buffer of the MFRC522
+ *
+ * @param state Device to talk to
+ */
+void mfrc522_fifo_flush(struct mfrc522_state *state);
+
+/**
+ * Setup the MFRC522's interrupt line, if one is described in the device tree. Once
+ * done, command completion is signaled by the IdleIRq interrupt instead of being
+ * polled
+ *
+ * @param state Device to talk to
+ *
+ * @return 0 on success or if no interrupt is available, a negative number on error
+ */
+int mfrc522_irq_init(struct mfrc522_state *state);
+
+/**
+ * Whether command completion is signaled through the MFRC522's interrupt line
+ *
+ * @param state Device to talk to
+ */
+bool mfrc522_irq_available(struct mfrc522_state *state);
+
+/**
+ * Poll the CommandReg register until the MFRC522 goes back to idle. Only used when
+ * no interrupt line is available
+ *
+ * @param state Device to talk to
+ *
+ * @return 0 on success, a negative number on error or timeout
+ */
+int mfrc522_poll_idle(struct mfrc522_state *state);
+
+/**
+ * Poll the ComIrqReg register until one of the given interrupts is raised. Only
+ * used when no interrupt line is available
+ *
+ * @param state Device to talk to
+ * @param mask Interrupts to wait for, as defined by the MFRC522_COM_IRQ_* macros
+ *
+ * @return The content of ComIrqReg on success, a negative number on error or
+ *         timeout
  */
-void mfrc522_fifo_flush(void);
+int mfrc522_poll_irq(struct mfrc522_state *state, u8 mask);
 
 /**
- * Send an MFRC522 command (9.3.1.2)
+ * Send an MFRC522 command (9.3.1.2) and wait for the MFRC522 to go back to idle.
+ * The wait sleeps on the IdleIRq interrupt if an interrupt line is available, and
+ * polls CommandReg otherwise
  * Parameters are not checked, you should use provided macros
  *
+ * @param state Device to talk to
  * @param rcv_off If 1, turn off analog part of the receiver
  * @param power_down If 1, enter soft power down mode
  * @param command MFRC522 commands as described 10.3
  *
- * @return 0 on success, -1 on error
+ * @return 0 on success, a negative number on error or timeout
  */
-int mfrc522_send_command(u8 rcv_off, u8 power_down, u8 command);
+int mfrc522_send_command(struct mfrc522_state *state, u8 rcv_off,
+			 u8 power_down, u8 command);
 
 /**
  * Read the CommandReg register and return the MFRC522's current command
  *
+ * @param state Device to talk to
+ *
  * @return The current command on success, a negative number on error
  */
-int mfrc522_read_command(void);
+int mfrc522_read_command(struct mfrc522_state *state);
 
 /**
  * Read FIFO content into a provided buffer
  *
+ * @param state Device to talk to
  * @param buf Buffer to write the FIFO content to. It must be at least MFRC522_MAX_FIFO_SIZE wide
  *
  * @return A negative number on error, number of byte read otherwise
  */
-int mfrc522_fifo_read(u8 *buf);
+int mfrc522_fifo_read(struct mfrc522_state *state, u8 *buf);
 
 /**
- * Write content to the MFRC522's FIFO
+ * Write content to the MFRC522's FIFO in a single SPI message
  *
  * @warn The FIFO's max size is 64 bytes
  *
+ * @param state Device to talk to
  * @param buf Buffer from which to write into the FIFO
  * @param len Amount of bytes to write to the FIFO
  *
- * @return 0 on success, -1 on error
+ * @return 0 on success, a negative number on error
  */
-int mfrc522_fifo_write(const u8 *buf, size_t len);
+int mfrc522_fifo_write(struct mfrc522_state *state, const u8 *buf,
+		       size_t len);
 
 /**
- * Reads a mfrc522 register
+ * Reads a mfrc522 register. Single byte reads of non-volatile registers are served
+ * from the register cache. Multi-byte reads, only allowed on FIFODataReg, are done
+ * in a single SPI message, using the continuous read sequence described in
+ * section 8.1.2.1
  *
- * @param client SPI client to talk to
+ * @param state Device to talk to
  * @param reg Register to read from
  * @param read_buff Buffer to write the read content to. It must be at least read_len wide
  * @param read_len Number of bytes to read
  *
- * @return A negative number on error, 0 on success
+ * @return A negative number on error, the amount of bytes read on success
  */
-int mfrc522_register_read(struct spi_device *client, u8 reg, u8 *read_buff,
+int mfrc522_register_read(struct mfrc522_state *state, u8 reg, u8 *read_buff,
 			  u8 read_len);
 
 /**
  * Write a value to a mfrc522 register
  *
- * @param client SPI client to talk to
+ * @param state Device to talk to
  * @param reg Register to write to
  * @param value Data to write in the register
  *
  * @return A negative number on error, 0 on success
  */
-int mfrc522_register_write(struct spi_device *client, u8 reg, u8 value);
+int mfrc522_register_write(struct mfrc522_state *state, u8 reg, u8 value);
+
+/**
+ * Write multiple bytes to FIFODataReg in a single SPI message, as described in
+ * section 8.1.2.2
+ *
+ * @param state Device to talk to
+ * @param reg Register to write to
+ * @param buf Data to write in the register
+ * @param len Amount of bytes to write
+ *
+ * @return A negative number on error, 0 on success
+ */
+int mfrc522_register_write_burst(struct mfrc522_state *state, u8 reg,
+				 const u8 *buf, size_t len);
+
+/**
+ * Update some bits of a mfrc522 register. For cached registers, no read is
+ * performed on the bus, and the write is skipped if the value does not change
+ *
+ * @param state Device to talk to
+ * @param reg Register to update
+ * @param mask Bits to update
+ * @param value New value of the bits to update
+ *
+ * @return A negative number on error, 0 on success
+ */
+int mfrc522_register_update_bits(struct mfrc522_state *state, u8 reg, u8 mask,
+				 u8 value);
 
 #endif /* !MFRC522_SPI_H */
@@ -0,0 +1,109 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/kernel.h>
+#include <linux/seq_file.h>
+
+#include "mfrc522_parser.h"
+#include "mfrc522_stats.h"
+
+static void mfrc522_histogram_add(struct mfrc522_histogram *hist,
+				  u64 latency_ns)
+{
+	unsigned int bucket = min_t(unsigned int, fls64(latency_ns),
+				    MFRC522_STATS_BUCKETS - 1);
+
+	atomic64_inc(&hist->buckets[bucket]);
+}
+
+void mfrc522_stats_cmd(struct mfrc522_state *state, u8 cmd, u64 latency_ns,
+		       bool error, s64 timeouts)
+{
+	struct mfrc522_op_stats *op;
+
+	if (cmd >= MFRC522_STATS_CMDS)
+		return;
+
+	op = &state->stats.cmds[cmd];
+
+	atomic64_inc(&op->count);
+	if (error)
+		atomic64_inc(&op->errors);
+	if (timeouts)
+		atomic64_add(timeouts, &op->timeouts);
+
+	mfrc522_histogram_add(&op->latency, latency_ns);
+}
+
+void mfrc522_stats_spi(struct mfrc522_state *state, u64 latency_ns,
+		       int status)
+{
+	struct mfrc522_op_stats *op = &state->stats.spi;
+
+	atomic64_inc(&op->count);
+	if (status < 0)
+		atomic64_inc(&op->errors);
+
+	mfrc522_histogram_add(&op->latency, latency_ns);
+}
+
+void mfrc522_stats_wake(struct mfrc522_state *state, u64 latency_ns,
+			int status)
+{
+	struct mfrc522_op_stats *op = &state->stats.wake;
+
+	atomic64_inc(&op->count);
+	if (status < 0)
+		atomic64_inc(&op->errors);
+	if (status == -ETIMEDOUT)
+		atomic64_inc(&op->timeouts);
+
+	mfrc522_histogram_add(&op->latency, latency_ns);
+	WRITE_ONCE(state->stats.last_wake_latency_ns, latency_ns);
+}
+
+static void mfrc522_stats_show_op(struct seq_file *s, const char *name,
+				  struct mfrc522_op_stats *op)
+{
+	int i;
+
+	seq_printf(s, "%-12s %llu %llu %llu", name,
+		   (u64)atomic64_read(&op->count),
+		   (u64)atomic64_read(&op->errors),
+		   (u64)atomic64_read(&op->timeouts));
+
+	for (i = 0; i < MFRC522_STATS_BUCKETS; i++)
+		seq_printf(s, " %llu",
+			   (u64)atomic64_read(&op->latency.buckets[i]));
+
+	seq_putc(s, '\n');
+}
+
+// One line per type of command, then one for SPI messages and one for wake ups,
+// so that the whole file can be scraped at once
+static int mfrc522_stats_show(struct seq_file *s, void *unused)
+{
+	struct mfrc522_state *state = s->private;
+	int i;
+
+	seq_printf(s, "# name count errors timeouts latency_lt_2^0ns..2^%dns latency_ge_2^%dns\n",
+		   MFRC522_STATS_BUCKETS - 2, MFRC522_STATS_BUCKETS - 2);
+
+	for (i = 0; i < MFRC522_STATS_CMDS; i++)
+		mfrc522_stats_show_op(s, mfrc522_command_name(i),
+				      &state->stats.cmds[i]);
+
+	mfrc522_stats_show_op(s, "spi", &state->stats.spi);
+	mfrc522_stats_show_op(s, "wake", &state->stats.wake);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(mfrc522_stats);
+
+void mfrc522_stats_debugfs_init(struct mfrc522_state *state)
+{
+	debugfs_create_file("stats", 0400, state->debugfs, state,
+			    &mfrc522_stats_fops);
+}
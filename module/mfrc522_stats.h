@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#ifndef MFRC522_STATS_H
+#define MFRC522_STATS_H
+
+#include <linux/atomic.h>
+#include <linux/types.h>
+
+#include "mfrc522_module.h"
+
+/**
+ * Account for a command once it ran
+ *
+ * @param state Device which ran the command
+ * @param cmd Command, as defined in the MFRC522_CMD_* values
+ * @param latency_ns End-to-end latency of the command
+ * @param error Whether the command failed
+ * @param timeouts Amount of timeouts the command ran into
+ */
+void mfrc522_stats_cmd(struct mfrc522_state *state, u8 cmd, u64 latency_ns,
+		       bool error, s64 timeouts);
+
+/**
+ * Account for an SPI message once it went through. Safe to call from any
+ * context
+ *
+ * @param state Device the message was sent to
+ * @param latency_ns Time between the submission and the completion of the
+ *                   message
+ * @param status Status of the message
+ */
+void mfrc522_stats_spi(struct mfrc522_state *state, u64 latency_ns,
+		       int status);
+
+/**
+ * Account for the MFRC522 waking up from soft power-down
+ *
+ * @param state Device which woke up
+ * @param latency_ns Time between the start of the wake up and the moment the
+ *                   MFRC522 was ready for commands
+ * @param status Status of the wake up
+ */
+void mfrc522_stats_wake(struct mfrc522_state *state, u64 latency_ns,
+			int status);
+
+/**
+ * Account for the MFRC522 not being done with a command, or not raising an
+ * interrupt, in time
+ *
+ * @param state Device which timed out
+ */
+static inline void mfrc522_stats_timeout(struct mfrc522_state *state)
+{
+	atomic64_inc(&state->stats.timeouts);
+}
+
+/**
+ * Get the total amount of SPI messages sent to a device
+ */
+static inline s64 mfrc522_stats_spi_messages(struct mfrc522_state *state)
+{
+	return atomic64_read(&state->stats.spi.count);
+}
+
+/**
+ * Create the debugfs file showing the statistics of a device, in its debugfs
+ * directory
+ *
+ * @param state Device whose statistics are shown
+ */
+void mfrc522_stats_debugfs_init(struct mfrc522_state *state);
+
+#endif /* ! MFRC522_STATS_H */
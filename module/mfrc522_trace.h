@@ -0,0 +1,249 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mfrc522
+
+#if !defined(MFRC522_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define MFRC522_TRACE_H
+
+#include <linux/string.h>
+#include <linux/tracepoint.h>
+
+#include "mfrc522_module.h"
+#include "mfrc522_parser.h"
+#include "mfrc522_user_command.h"
+
+#ifndef MFRC522_TRACE_REDACT
+#define MFRC522_TRACE_REDACT
+
+/**
+ * Amount of bytes of user input recorded by the mfrc522_parse event. mf_key
+ * carries a MIFARE key, of which only the command name is kept
+ */
+static inline size_t mfrc522_trace_input_len(const char *input, size_t len)
+{
+	const char *name = mfrc522_command_name(MFRC522_CMD_MF_KEY);
+	size_t name_len = strlen(name);
+
+	if (len >= name_len && !memcmp(input, name, name_len))
+		return name_len;
+
+	return len;
+}
+
+#endif /* ! MFRC522_TRACE_REDACT */
+
+DECLARE_EVENT_CLASS(mfrc522_reg,
+	TP_PROTO(struct mfrc522_state *state, u8 reg, const u8 *data,
+		 size_t len),
+	TP_ARGS(state, reg, data, len),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u8, reg)
+		__dynamic_array(u8, data, len)
+	),
+
+	TP_fast_assign(
+		__entry->id = state->id;
+		__entry->reg = reg;
+		memcpy(__get_dynamic_array(data), data, len);
+	),
+
+	TP_printk("mfrc522_misc%d reg=0x%02x data=%s", __entry->id,
+		  __entry->reg,
+		  __print_hex(__get_dynamic_array(data),
+			      __get_dynamic_array_len(data)))
+);
+
+DEFINE_EVENT(mfrc522_reg, mfrc522_reg_read,
+	TP_PROTO(struct mfrc522_state *state, u8 reg, const u8 *data,
+		 size_t len),
+	TP_ARGS(state, reg, data, len)
+);
+
+DEFINE_EVENT(mfrc522_reg, mfrc522_reg_write,
+	TP_PROTO(struct mfrc522_state *state, u8 reg, const u8 *data,
+		 size_t len),
+	TP_ARGS(state, reg, data, len)
+);
+
+DECLARE_EVENT_CLASS(mfrc522_fifo,
+	TP_PROTO(struct mfrc522_state *state, const u8 *data, size_t len),
+	TP_ARGS(state, data, len),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__dynamic_array(u8, data, len)
+	),
+
+	TP_fast_assign(
+		__entry->id = state->id;
+		memcpy(__get_dynamic_array(data), data, len);
+	),
+
+	TP_printk("mfrc522_misc%d len=%u data=%s", __entry->id,
+		  __get_dynamic_array_len(data),
+		  __print_hex(__get_dynamic_array(data),
+			      __get_dynamic_array_len(data)))
+);
+
+DEFINE_EVENT(mfrc522_fifo, mfrc522_fifo_read,
+	TP_PROTO(struct mfrc522_state *state, const u8 *data, size_t len),
+	TP_ARGS(state, data, len)
+);
+
+DEFINE_EVENT(mfrc522_fifo, mfrc522_fifo_write,
+	TP_PROTO(struct mfrc522_state *state, const u8 *data, size_t len),
+	TP_ARGS(state, data, len)
+);
+
+TRACE_EVENT(mfrc522_chip_cmd,
+	TP_PROTO(struct mfrc522_state *state, u8 command, int ret),
+	TP_ARGS(state, command, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u8, command)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = state->id;
+		__entry->command = command;
+		__entry->ret = ret;
+	),
+
+	TP_printk("mfrc522_misc%d command=0x%02x ret=%d", __entry->id,
+		  __entry->command, __entry->ret)
+);
+
+TRACE_EVENT(mfrc522_pipeline_run,
+	TP_PROTO(struct mfrc522_state *state, unsigned int stages, int ret),
+	TP_ARGS(state, stages, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(unsigned int, stages)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->id = state->id;
+		__entry->stages = stages;
+		__entry->ret = ret;
+	),
+
+	TP_printk("mfrc522_misc%d stages=%u ret=%d", __entry->id,
+		  __entry->stages, __entry->ret)
+);
+
+TRACE_EVENT(mfrc522_parse,
+	TP_PROTO(struct mfrc522_state *state, const char *input, size_t len,
+		 const struct mfrc522_command *cmd, int ret),
+	TP_ARGS(state, input, len, cmd, ret),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__dynamic_array(char, input, mfrc522_trace_input_len(input, len) + 1)
+		__field(size_t, len)
+		__field(u8, cmd)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		size_t input_len = mfrc522_trace_input_len(input, len);
+
+		__entry->id = state->id;
+		memcpy(__get_dynamic_array(input), input, input_len);
+		((char *)__get_dynamic_array(input))[input_len] = '\0';
+		__entry->len = len;
+		__entry->cmd = cmd->cmd;
+		__entry->ret = ret;
+	),
+
+	TP_printk("mfrc522_misc%d input=\"%s\" len=%zu cmd=%u ret=%d",
+		  __entry->id, __get_str(input), __entry->len, __entry->cmd,
+		  __entry->ret)
+);
+
+TRACE_EVENT(mfrc522_cmd_start,
+	TP_PROTO(struct mfrc522_state *state,
+		 const struct mfrc522_command *cmd),
+	TP_ARGS(state, cmd),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u8, cmd)
+		__field(size_t, len)
+		__array(char, data, MFRC522_MAX_DATA_LEN + 1)
+	),
+
+	TP_fast_assign(
+		__entry->id = state->id;
+		__entry->cmd = cmd->cmd;
+		__entry->len = strnlen(cmd->data, MFRC522_MAX_DATA_LEN);
+		// The data of mf_key is a MIFARE key, only its length is kept
+		if (cmd->cmd == MFRC522_CMD_MF_KEY)
+			__entry->data[0] = '\0';
+		else
+			strscpy(__entry->data, cmd->data, sizeof(__entry->data));
+	),
+
+	TP_printk("mfrc522_misc%d cmd=%u len=%zu data=\"%s\"", __entry->id,
+		  __entry->cmd, __entry->len, __entry->data)
+);
+
+TRACE_EVENT(mfrc522_cmd_end,
+	TP_PROTO(struct mfrc522_state *state,
+		 const struct mfrc522_command *cmd, int answer_size,
+		 u64 latency_ns, unsigned long spi_messages),
+	TP_ARGS(state, cmd, answer_size, latency_ns, spi_messages),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__field(u8, cmd)
+		__field(int, answer_size)
+		__field(u64, latency_ns)
+		__field(unsigned long, spi_messages)
+	),
+
+	TP_fast_assign(
+		__entry->id = state->id;
+		__entry->cmd = cmd->cmd;
+		__entry->answer_size = answer_size;
+		__entry->latency_ns = latency_ns;
+		__entry->spi_messages = spi_messages;
+	),
+
+	TP_printk("mfrc522_misc%d cmd=%u answer_size=%d latency_ns=%llu spi_messages=%lu",
+		  __entry->id, __entry->cmd, __entry->answer_size,
+		  __entry->latency_ns, __entry->spi_messages)
+);
+
+TRACE_EVENT(mfrc522_random_id,
+	TP_PROTO(struct mfrc522_state *state, const u8 *id),
+	TP_ARGS(state, id),
+
+	TP_STRUCT__entry(
+		__field(int, id)
+		__array(u8, random, MFRC522_ID_SIZE)
+	),
+
+	TP_fast_assign(
+		__entry->id = state->id;
+		memcpy(__entry->random, id, MFRC522_ID_SIZE);
+	),
+
+	TP_printk("mfrc522_misc%d id=%s", __entry->id,
+		  __print_hex(__entry->random, MFRC522_ID_SIZE))
+);
+
+#endif /* ! MFRC522_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mfrc522_trace
+
+#include <trace/define_trace.h>
@@ -4,16 +4,22 @@
 #include "linux/kernel.h"
 #include "linux/slab.h"
 #include "linux/string.h"
+#include "mfrc522_debug.h"
+#include "mfrc522_mifare.h"
+#include "mfrc522_ntag.h"
+#include "mfrc522_picc.h"
+#include "mfrc522_pipeline.h"
+#include "mfrc522_scan.h"
 #include "mfrc522_spi.h"
+#include "mfrc522_trace.h"
 
-#define MFRC522_ID_SIZE 10
 
 int mfrc522_command_init(struct mfrc522_command *cmd, u8 cmd_byte, char *data,
 			 u8 data_len)
 {
-	if (data_len > MFRC522_MEM_SIZE) {
-		pr_err("[MFRC522] Invalid length for command: Got %d, expected length inferior to 25\n",
-		       data_len);
+	if (data_len > MFRC522_MAX_DATA_LEN) {
+		pr_err("[MFRC522] Invalid length for command: Got %d, expected length inferior to %d\n",
+		       data_len, MFRC522_MAX_DATA_LEN);
 		return -1;
 	}
 
@@ -26,7 +32,8 @@ int mfrc522_command_init(struct mfrc522_command *cmd, u8 cmd_byte, char *data,
 
 	// Copy the user's extra data into the command, and zero out the remaining bytes
 	strncpy(cmd->data, data, data_len);
-	memset(cmd->data + data_len, '\0', MFRC522_MEM_SIZE - data_len);
+	memset(cmd->data + data_len, '\0', sizeof(cmd->data) - data_len);
+	cmd->data_len = strnlen(cmd->data, data_len);
 
 	return 0;
 }
@@ -36,34 +43,75 @@ int mfrc522_command_simple_init(struct mfrc522_command *cmd, u8 cmd_byte)
 	return mfrc522_command_init(cmd, cmd_byte, NULL, 0);
 }
 
+void mfrc522_queue_mem_read(struct mfrc522_pipeline *p, u8 **level, u8 **data)
+{
+	mfrc522_pipeline_write(p, MFRC522_FIFO_LEVEL_REG,
+			       MFRC522_FIFO_LEVEL_REG_FLUSH);
+	mfrc522_pipeline_command(p, MFRC522_COMMAND_REG_RCV_ON,
+				 MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+				 MFRC522_COMMAND_MEM);
+
+	// The Mem command always transfers the whole memory to the FIFO, which can
+	// therefore be drained without waiting for its level first
+	*level = mfrc522_pipeline_read(p, MFRC522_FIFO_LEVEL_REG, 1);
+	*data = mfrc522_pipeline_read(p, MFRC522_FIFO_DATA_REG,
+				      MFRC522_MEM_SIZE);
+}
+
+void mfrc522_queue_mem_write(struct mfrc522_pipeline *p, const u8 *data)
+{
+	mfrc522_pipeline_write(p, MFRC522_FIFO_LEVEL_REG,
+			       MFRC522_FIFO_LEVEL_REG_FLUSH);
+	mfrc522_pipeline_write_burst(p, MFRC522_FIFO_DATA_REG, data,
+				     MFRC522_MEM_SIZE);
+	mfrc522_pipeline_command(p, MFRC522_COMMAND_REG_RCV_ON,
+				 MFRC522_COMMAND_REG_POWER_DOWN_OFF,
+				 MFRC522_COMMAND_MEM);
+}
+
+/**
+ * Get the amount of bytes read by the stages queued by mfrc522_queue_mem_read()
+ */
+static int mem_read_size(const u8 *level)
+{
+	return min_t(int, *level & MFRC522_FIFO_LEVEL_REG_LEVEL_MASK,
+		     MFRC522_MEM_SIZE);
+}
+
 /**
  * Read the internal memory of the MFRC522
  *
+ * @param state Driver state
  * @param answer Buffer in which to store the memory's content
- * @param stats Statistics in which to accumulate data
  *
- * @return The size of the read on success, -1 on error
+ * @return The size of the read on success, a negative errno on error
  */
-static int mem_read(char *answer, struct mfrc522_statistics *stats)
+static int mem_read(struct mfrc522_state *state, char *answer)
 {
-	int byte_amount = 0;
+	struct mfrc522_pipeline *p;
+	int byte_amount;
+	u8 *level;
+	u8 *data;
 
-	mfrc522_fifo_flush();
-	if (mfrc522_send_command(MFRC522_COMMAND_REG_RCV_ON,
-				 MFRC522_COMMAND_REG_POWER_DOWN_OFF,
-				 MFRC522_COMMAND_MEM) < 0)
-		return -1;
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
+
+	mfrc522_queue_mem_read(p, &level, &data);
 
-	byte_amount = mfrc522_fifo_read(answer);
+	byte_amount = mfrc522_pipeline_run(p);
 	if (byte_amount < 0) {
 		pr_err("[MFRC522] An error happened when reading MFRC522's internal memory\n");
-		return -1;
+		goto out;
 	}
 
-	pr_info("[MFRC522] Read %d bytes from memory\n", byte_amount);
+	byte_amount = mem_read_size(level);
+	memcpy(answer, data, byte_amount);
+
+	atomic64_add(byte_amount, &state->stats.bytes_read);
 
-	if (stats)
-		stats->bytes_read += byte_amount;
+out:
+	mfrc522_pipeline_free(p);
 
 	return byte_amount;
 }
@@ -71,79 +119,326 @@ static int mem_read(char *answer, struct mfrc522_statistics *stats)
 /**
  * Write 25 bytes of data into the MFRC522's internal memory
  *
- * @param data User input to write to the memory
- * @param stats Statistics in which to accumulate data
+ * @param state Driver state
+ * @param cmd Command holding the data to write, padded with zeroes
  *
- * @return 0 on success, -1 on error
+ * @return 0 on success, a negative errno on error
  */
-static int mem_write(char *data, struct mfrc522_statistics *stats)
+static int mem_write(struct mfrc522_state *state,
+		     const struct mfrc522_command *cmd)
 {
-	// We know that data is zero-filled since we initialized it using
-	// mfrc522_command_init()
-	if (mfrc522_fifo_write(data, MFRC522_MEM_SIZE) < 0) {
-		pr_err("[MFRC522] Couldn't write to FIFO\n");
-		return -1;
-	}
+	u8 data[MFRC522_MEM_SIZE] = { 0 };
+	struct mfrc522_pipeline *p;
+	int ret;
 
-	mfrc522_send_command(MFRC522_COMMAND_REG_RCV_ON,
-			     MFRC522_COMMAND_REG_POWER_DOWN_OFF,
-			     MFRC522_COMMAND_MEM);
+	if (cmd->data_len > MFRC522_MEM_SIZE)
+		return -EINVAL;
 
-	pr_info("[MFRC522] Wrote data to memory\n");
+	memcpy(data, cmd->data, cmd->data_len);
 
-	if (stats)
-		stats->bytes_written += MFRC522_MEM_SIZE;
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
 
-	return 0;
+	mfrc522_queue_mem_write(p, data);
+
+	ret = mfrc522_pipeline_run(p);
+	if (ret < 0) {
+		pr_err("[MFRC522] Couldn't write to memory\n");
+		goto out;
+	}
+
+	atomic64_add(MFRC522_MEM_SIZE, &state->stats.bytes_written);
+
+out:
+	mfrc522_pipeline_free(p);
+
+	return ret;
 }
 
 /**
  * Generate a 10-byte wide random ID
  *
- * @param stats Statistics in which to accumulate data
+ * @param state Driver state
  *
- * @return The amount of bytes received on success, -1 on error
+ * @return The amount of bytes received on success, a negative errno on error
  */
-static int generate_random(struct mfrc522_statistics *stats)
+static int generate_random(struct mfrc522_state *state)
 {
-	u8 buffer[MFRC522_MEM_SIZE] = { 0 };
-	char char_buffer[MFRC522_ID_SIZE * 2 + 1] = { 0 };
-	int i = 0;
+	u8 zero_buffer[MFRC522_MEM_SIZE] = { 0 };
+	struct mfrc522_pipeline *p;
+	int ret = 0;
+	u8 *level;
+	u8 *data;
+
+	p = mfrc522_pipeline_alloc(state);
+	if (!p)
+		return -ENOMEM;
 
 	// Clear the internal buffer
-	if (mem_write(buffer, stats) < 0)
-		return -1;
+	mfrc522_queue_mem_write(p, zero_buffer);
 
-	if (mfrc522_send_command(MFRC522_COMMAND_REG_RCV_ON,
+	mfrc522_pipeline_command(p, MFRC522_COMMAND_REG_RCV_ON,
 				 MFRC522_COMMAND_REG_POWER_DOWN_OFF,
-				 MFRC522_COMMAND_GENERATE_RANDOM_ID) < 0)
-		return -1;
+				 MFRC522_COMMAND_GENERATE_RANDOM_ID);
+
+	// Read the ID back for tracing
+	mfrc522_queue_mem_read(p, &level, &data);
 
-	/* We are reading for debug print, we don't need to report an error now
-	 * but at the next mem_read command. So we don't check mem_read return
-	 * value
-	 */
-	mem_read(buffer, stats);
+	ret = mfrc522_pipeline_run(p);
+	if (ret < 0)
+		goto out;
 
-	for (i = 0; i < MFRC522_ID_SIZE; i++) {
-		// Each byte is 2 char wide in hexa so i*2
-		sprintf(char_buffer + i * 2, "%02X", buffer[i]);
+	atomic64_add(MFRC522_MEM_SIZE, &state->stats.bytes_written);
+	atomic64_add(mem_read_size(level), &state->stats.bytes_read);
+
+	trace_mfrc522_random_id(state, data);
+
+out:
+	mfrc522_pipeline_free(p);
+
+	return ret;
+}
+
+/**
+ * Read the UID of the tag in the field, and halt it
+ *
+ * @param state Driver state
+ * @param answer Buffer in which to store the UID and SAK, in hexadecimal and
+ *               separated by a colon. Left empty if no tag is in the field
+ *
+ * @return The size of the answer on success, a negative errno on error
+ */
+static int read_uid(struct mfrc522_state *state, char *answer)
+{
+	struct mfrc522_picc_uid uid;
+	int len = 0;
+	int ret;
+	int i;
+
+	ret = mfrc522_picc_read_uid(state, &uid, true);
+	if (ret == -ENODATA)
+		return 0;
+
+	if (ret < 0) {
+		pr_err("[MFRC522] Couldn't read the tag's UID: %d\n", ret);
+		return ret;
 	}
 
-	pr_info("[MFRC522] Generated random ID: %s\n", char_buffer);
+	for (i = 0; i < uid.size; i++)
+		len += sprintf(answer + len, "%02X", uid.bytes[i]);
+
+	len += sprintf(answer + len, ":%02X", uid.sak);
+
+	return len;
+}
+
+/**
+ * Load a MIFARE Classic key into the device's keyring
+ *
+ * @param state Driver state
+ * @param cmd Command holding the sector, "*" for every sector without a key of
+ *            its own, the key type, A or B, and the key in hexadecimal, separated
+ *            by commas
+ *
+ * @return 0 on success, a negative errno on error
+ */
+static int mf_set_key(struct mfrc522_state *state,
+		      const struct mfrc522_command *cmd)
+{
+	char args[sizeof(cmd->data)];
+	char *input = args;
+	char *sector_arg;
+	char *type_arg;
+	u8 key[MFRC522_MF_KEY_SIZE];
+	int sector = MFRC522_MF_DEFAULT_KEY;
+	int ret = -EINVAL;
+
+	strscpy(args, cmd->data, sizeof(args));
+	sector_arg = strsep(&input, ",");
+	type_arg = strsep(&input, ",");
+
+	if (!input || strlen(input) != MFRC522_MF_KEY_SIZE * 2)
+		goto out;
+
+	if (strcmp(sector_arg, "*") && kstrtoint(sector_arg, 10, &sector))
+		goto out;
+
+	if (strcmp(type_arg, "A") && strcmp(type_arg, "B"))
+		goto out;
+
+	if (hex2bin(key, input, MFRC522_MF_KEY_SIZE) < 0)
+		goto out;
+
+	ret = mfrc522_mf_set_key(state, sector, type_arg[0] == 'B', key);
+
+out:
+	memzero_explicit(args, sizeof(args));
+	memzero_explicit(key, sizeof(key));
+
+	return ret;
+}
+
+/**
+ * Parse a range of sectors or pages, "<first>" or "<first>-<last>"
+ *
+ * @param data Range to parse
+ * @param first Filled with the start of the range
+ * @param last Filled with the end of the range, which is the start if there is
+ *             only one
+ *
+ * @return 0 on success, a negative errno on error
+ */
+static int parse_range(const char *data, unsigned int *first,
+		       unsigned int *last)
+{
+	char args[MFRC522_MAX_DATA_LEN + 1];
+	char *input = args;
+
+	strscpy(args, data, sizeof(args));
+
+	if (kstrtouint(strsep(&input, "-"), 10, first))
+		return -EINVAL;
+
+	*last = *first;
+	if (input && kstrtouint(input, 10, last))
+		return -EINVAL;
 
 	return 0;
 }
 
+/**
+ * Read a range of sectors of the MIFARE Classic PICC in the field
+ *
+ * @param state Driver state
+ * @param cmd Command holding the first sector, and optionally the last one,
+ *            separated by a dash
+ * @param answer Buffer in which to store the content of the sectors' blocks
+ *
+ * @return The size of the answer on success, a negative errno on error
+ */
+static int mf_read(struct mfrc522_state *state,
+		   const struct mfrc522_command *cmd, char *answer)
+{
+	unsigned int first;
+	unsigned int last;
+	int ret;
+
+	ret = parse_range(cmd->data, &first, &last);
+	if (ret < 0)
+		return ret;
+
+	ret = mfrc522_mf_read_sectors(state, first, last, (u8 *)answer,
+				      MFRC522_MAX_ANSWER_SIZE);
+	if (ret < 0) {
+		pr_err("[MFRC522] Couldn't read sectors %u to %u: %d\n", first,
+		       last, ret);
+		return ret;
+	}
+
+	atomic64_add(ret, &state->stats.bytes_read);
+
+	return ret;
+}
+
+/**
+ * Write a block of the MIFARE Classic PICC in the field
+ *
+ * @param state Driver state
+ * @param cmd Command holding the block and its data in hexadecimal, separated by
+ *            a comma
+ *
+ * @return 0 on success, a negative errno on error
+ */
+static int mf_write(struct mfrc522_state *state,
+		    const struct mfrc522_command *cmd)
+{
+	char args[sizeof(cmd->data)];
+	char *input = args;
+	u8 data[MFRC522_MF_BLOCK_SIZE];
+	unsigned int block;
+	int ret;
+
+	strscpy(args, cmd->data, sizeof(args));
+
+	if (kstrtouint(strsep(&input, ","), 10, &block))
+		return -EINVAL;
+
+	if (!input || strlen(input) != MFRC522_MF_BLOCK_SIZE * 2 ||
+	    hex2bin(data, input, MFRC522_MF_BLOCK_SIZE) < 0)
+		return -EINVAL;
+
+	ret = mfrc522_mf_write_block(state, block, data);
+	if (ret < 0) {
+		pr_err("[MFRC522] Couldn't write block %u: %d\n", block, ret);
+		return ret;
+	}
+
+	atomic64_add(MFRC522_MF_BLOCK_SIZE, &state->stats.bytes_written);
+
+	return 0;
+}
+
+/**
+ * Read a range of pages of the NFC Forum Type 2 PICC in the field
+ *
+ * @param state Driver state
+ * @param cmd Command holding the first page, and optionally the last one,
+ *            separated by a dash
+ * @param answer Buffer in which to store the content of the pages
+ *
+ * @return The size of the answer on success, 0 if there is no PICC, a negative errno
+ *         on error
+ */
+static int ntag_read(struct mfrc522_state *state,
+		     const struct mfrc522_command *cmd, char *answer)
+{
+	unsigned int first;
+	unsigned int last;
+	int ret;
+
+	ret = parse_range(cmd->data, &first, &last);
+	if (ret < 0)
+		return ret;
+
+	ret = mfrc522_ntag_read_pages(state, first, last, (u8 *)answer,
+				      MFRC522_MAX_ANSWER_SIZE);
+	if (ret == -ENODATA)
+		return 0;
+
+	if (ret < 0) {
+		pr_err("[MFRC522] Couldn't read pages %u to %u: %d\n", first,
+		       last, ret);
+		return ret;
+	}
+
+	atomic64_add(ret, &state->stats.bytes_read);
+
+	return ret;
+}
+
 static int set_debug(struct mfrc522_state *state,
 		     const struct mfrc522_command *cmd)
 {
 	if (!strncmp(cmd->data, "on", 3))
-		state->debug_on = true;
+		mfrc522_debug_enable(state, true);
 	else if (!strncmp(cmd->data, "off", 4))
-		state->debug_on = false;
+		mfrc522_debug_enable(state, false);
 	else
-		return -1;
+		return -EINVAL;
+
+	return 0;
+}
+
+static int set_polling(struct mfrc522_state *state,
+		       const struct mfrc522_command *cmd)
+{
+	if (!strncmp(cmd->data, "on", 3))
+		mfrc522_scan_enable(state, true);
+	else if (!strncmp(cmd->data, "off", 4))
+		mfrc522_scan_enable(state, false);
+	else
+		return -EINVAL;
 
 	return 0;
 }
@@ -151,24 +446,44 @@ static int set_debug(struct mfrc522_state *state,
 int mfrc522_execute(struct mfrc522_state *state, char *answer,
 		    struct mfrc522_command *cmd)
 {
-	int ret = -1;
+	int ret;
 
 	switch (cmd->cmd) {
 	case MFRC522_CMD_GET_VERSION:
-		ret = sprintf(answer, "%d", mfrc522_get_version());
+		ret = mfrc522_get_version(state);
+		if (ret >= 0)
+			ret = sprintf(answer, "%d", ret);
 		break;
 	case MFRC522_CMD_MEM_READ:
-		ret = mem_read(answer, &state->stats);
+		ret = mem_read(state, answer);
 		break;
 	case MFRC522_CMD_MEM_WRITE:
-		ret = mem_write(cmd->data, &state->stats);
+		ret = mem_write(state, cmd);
 		break;
 	case MFRC522_CMD_GEN_RANDOM:
-		ret = generate_random(&state->stats);
+		ret = generate_random(state);
 		break;
 	case MFRC522_CMD_DEBUG:
 		ret = set_debug(state, cmd);
 		break;
+	case MFRC522_CMD_POLL:
+		ret = set_polling(state, cmd);
+		break;
+	case MFRC522_CMD_READ_UID:
+		ret = read_uid(state, answer);
+		break;
+	case MFRC522_CMD_MF_KEY:
+		ret = mf_set_key(state, cmd);
+		break;
+	case MFRC522_CMD_MF_READ:
+		ret = mf_read(state, cmd, answer);
+		break;
+	case MFRC522_CMD_MF_WRITE:
+		ret = mf_write(state, cmd);
+		break;
+	case MFRC522_CMD_NTAG_READ:
+		ret = ntag_read(state, cmd, answer);
+		break;
 	default:
 		ret = sprintf(answer, "%s", "Command unimplemented");
 	}
@@ -4,19 +4,28 @@
 #define MFRC522_COMMAND_H
 
 #include <linux/types.h>
+#include <linux/mfrc522.h>
 
 #include "mfrc522_module.h"
 
 #define MFRC522_MEM_SIZE 25
-#define MFRC522_MAX_DATA_LEN 25
+#define MFRC522_ID_SIZE 10
+#define MFRC522_MAX_DATA_LEN 48
 #define MFRC522_MAX_FIFO_LEN 64
 
+// Commands share their values with the opcodes of the binary interface
 enum mfrc522_commands {
-	MFRC522_CMD_MEM_WRITE = 0x00,
-	MFRC522_CMD_MEM_READ,
-	MFRC522_CMD_GET_VERSION,
-	MFRC522_CMD_GEN_RANDOM,
-	MFRC522_CMD_DEBUG,
+	MFRC522_CMD_MEM_WRITE = MFRC522_OP_MEM_WRITE,
+	MFRC522_CMD_MEM_READ = MFRC522_OP_MEM_READ,
+	MFRC522_CMD_GET_VERSION = MFRC522_OP_GET_VERSION,
+	MFRC522_CMD_GEN_RANDOM = MFRC522_OP_GEN_RANDOM,
+	MFRC522_CMD_DEBUG = MFRC522_OP_DEBUG,
+	MFRC522_CMD_POLL = MFRC522_OP_POLL,
+	MFRC522_CMD_READ_UID = MFRC522_OP_READ_UID,
+	MFRC522_CMD_MF_KEY = MFRC522_OP_MF_KEY,
+	MFRC522_CMD_MF_READ = MFRC522_OP_MF_READ,
+	MFRC522_CMD_MF_WRITE = MFRC522_OP_MF_WRITE,
+	MFRC522_CMD_NTAG_READ = MFRC522_OP_NTAG_READ,
 };
 
 /**
@@ -25,7 +34,10 @@ enum mfrc522_commands {
  */
 struct mfrc522_command {
 	u8 cmd;
-	char data[MFRC522_MEM_SIZE];
+	// Amount of bytes of data, which may hold NUL bytes when it comes from the
+	// binary interface
+	u8 data_len;
+	char data[MFRC522_MAX_DATA_LEN + 1];
 };
 
 /**
@@ -52,13 +64,34 @@ int mfrc522_command_init(struct mfrc522_command *cmd, u8 cmd_byte, char *data,
 int mfrc522_command_simple_init(struct mfrc522_command *cmd, u8 cmd_byte);
 
 /**
- * Execute a MFRC522 command and check for its validity
+ * Execute a MFRC522 command and check for its validity. Must be called with the
+ * device's lock held
  *
+ * @param state Device to run the command on
  * @param answer Buffer in which to store the MFRC522's answer
  * @param cmd Command to send to the MFRC522
  *
- * @return The size of the answer on success, -1 on error
+ * @return The size of the answer on success, a negative errno on error
  */
 int mfrc522_execute(struct mfrc522_state *state, char *answer, struct mfrc522_command *cmd);
 
+/**
+ * Queue the pipeline stages copying the internal memory of the MFRC522 to its FIFO,
+ * and reading it back
+ *
+ * @param p Pipeline to build
+ * @param level Set to where the FIFO level will be read
+ * @param data Set to where the memory's content will be read
+ */
+void mfrc522_queue_mem_read(struct mfrc522_pipeline *p, u8 **level, u8 **data);
+
+/**
+ * Queue the pipeline stages writing 25 bytes of data into the MFRC522's internal
+ * memory
+ *
+ * @param p Pipeline to build
+ * @param data Data to write to the memory
+ */
+void mfrc522_queue_mem_write(struct mfrc522_pipeline *p, const u8 *data);
+
 #endif /* ! MFRC522_COMMAND_H */
@@ -1,5 +1,6 @@
-use crate::mfrc522_inner::{Mfrc522Command, Mfrc522Spi};
+use crate::mfrc522_inner::{reg, Mfrc522Command, Mfrc522Dev, Mfrc522Spi, Transaction};
 
+use core::fmt::{self, Write};
 use kernel::pr_info;
 
 /// Maximum amount of bytes handled by the MFRC522's internal memory
@@ -9,6 +10,38 @@ pub const MAX_DATA_LEN: usize = 25;
 /// memory of the MFRC522, and is not guaranteed to be valid ASCII or UTF-8.
 pub type Answer = [u8; MAX_DATA_LEN];
 
+/// Formatter writing into a fixed-size buffer, so that text answers need no allocation
+pub struct SliceWriter<'a> {
+    buf: &'a mut [u8],
+    len: usize,
+}
+
+impl<'a> SliceWriter<'a> {
+    pub fn new(buf: &'a mut [u8]) -> Self {
+        SliceWriter { buf, len: 0 }
+    }
+
+    /// Amount of bytes written so far
+    pub fn len(&self) -> usize {
+        self.len
+    }
+}
+
+impl Write for SliceWriter<'_> {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        let end = self.len + s.len();
+
+        if end > self.buf.len() {
+            return Err(fmt::Error);
+        }
+
+        self.buf[self.len..end].copy_from_slice(s.as_bytes());
+        self.len = end;
+
+        Ok(())
+    }
+}
+
 /// Result of a successful command execution
 pub enum CommandSuccess {
     /// Amount of bytes written if any
@@ -41,7 +74,8 @@ impl Cmd {
         match cmd {
             "mem_read" => Some(Cmd::MemRead),
             "mem_write" => Some(Cmd::MemWrite),
-            "get_version" => Some(Cmd::GetVersion),
+            // "version" is the name used by the C module
+            "get_version" | "version" => Some(Cmd::GetVersion),
             "gen_rand_id" => Some(Cmd::GenRand),
             _ => None,
         }
@@ -95,31 +129,49 @@ impl Command {
         Command { cmd, arg: None }
     }
 
-    fn mem_write(&self, spi_dev: &mut crate::SpiDevice) -> CommandResult {
-        Mfrc522Spi::fifo_write(spi_dev, &self.arg.as_ref().unwrap().data)?;
-        Mfrc522Spi::send_command(spi_dev, Mfrc522Command::Mem)?;
+    fn mem_write(&self, dev: &mut Mfrc522Dev<'_>) -> CommandResult {
+        let mut t = Transaction::new(dev);
+
+        t.fifo_flush()
+            .write_burst::<reg::FifoData>(&self.arg.as_ref().unwrap().data)
+            .command(Mfrc522Command::Mem);
+        t.run()?;
+
+        Mfrc522Spi::wait_for_command(dev)?;
+
+        dev.stats.bytes_written(MAX_DATA_LEN);
 
         Ok(CommandSuccess::BytesWritten(MAX_DATA_LEN))
     }
 
-    fn mem_read(&self, spi_dev: &mut crate::SpiDevice, answer: &mut Answer) -> CommandResult {
-        Mfrc522Spi::fifo_flush(spi_dev)?;
+    fn mem_read(&self, dev: &mut Mfrc522Dev<'_>, answer: &mut Answer) -> CommandResult {
+        let mut t = Transaction::new(dev);
+
+        t.fifo_flush().command(Mfrc522Command::Mem);
+        t.run()?;
 
-        Mfrc522Spi::send_command(spi_dev, Mfrc522Command::Mem)?;
-        let bytes_read = Mfrc522Spi::fifo_read(spi_dev, answer)?;
+        Mfrc522Spi::wait_for_command(dev)?;
+
+        let bytes_read = Mfrc522Spi::fifo_read(dev, answer)?;
+
+        dev.stats.bytes_read(bytes_read.into());
 
         Ok(CommandSuccess::BytesRead(bytes_read.into()))
     }
 
-    fn get_version(&self, spi_dev: &mut crate::SpiDevice) -> CommandResult {
-        Mfrc522Spi::get_version(spi_dev)?;
+    /// Answer the content of VersionReg in decimal, as the C module does
+    fn get_version(&self, dev: &mut Mfrc522Dev<'_>, answer: &mut Answer) -> CommandResult {
+        let version = Mfrc522Spi::get_version(dev)?;
+        let mut writer = SliceWriter::new(answer);
 
-        Ok(CommandSuccess::NoAnswer)
+        write!(writer, "{}", version as u8).map_err(|_| kernel::Error::EINVAL)?;
+
+        Ok(CommandSuccess::BytesRead(writer.len()))
     }
 
-    fn show_generated_id(&self, spi_dev: &mut crate::SpiDevice) -> CommandResult {
+    fn show_generated_id(&self, dev: &mut Mfrc522Dev<'_>) -> CommandResult {
         let mut dbg_buffer = [0u8; MAX_DATA_LEN];
-        self.mem_read(spi_dev, &mut dbg_buffer)?;
+        self.mem_read(dev, &mut dbg_buffer)?;
 
         // FIXME: Disgusting
         pr_info!("[MFRC522-RS] Generated random ID: ");
@@ -133,29 +185,26 @@ impl Command {
         Ok(CommandSuccess::NoAnswer)
     }
 
-    fn generate_random_id(&self, spi_dev: &mut crate::SpiDevice) -> CommandResult {
+    fn generate_random_id(&self, dev: &mut Mfrc522Dev<'_>) -> CommandResult {
         // Clear out the internal memory
         let zero_buffer = [0u8; MAX_DATA_LEN];
         let cmd = Command::new(Cmd::MemWrite, MAX_DATA_LEN as u8, zero_buffer);
-        cmd.mem_write(spi_dev)?;
+        cmd.mem_write(dev)?;
 
-        Mfrc522Spi::send_command(spi_dev, Mfrc522Command::GenerateRandomId)?;
+        Mfrc522Spi::send_command(dev, Mfrc522Command::GenerateRandomId)?;
 
-        self.show_generated_id(spi_dev)?;
+        self.show_generated_id(dev)?;
 
         Ok(CommandSuccess::NoAnswer)
     }
 
     /// Execute the required command, sending and receiving information to the MFRC522.
-    pub fn execute(&self, answer: &mut Answer) -> CommandResult {
-        // As we can't get here if the device is not present, unwrap is safe
-        let mut spi_dev = unsafe { &mut crate::SPI_DEVICE.unwrap() };
-
+    pub fn execute(&self, dev: &mut Mfrc522Dev<'_>, answer: &mut Answer) -> CommandResult {
         match &self.cmd {
-            Cmd::MemWrite => self.mem_write(&mut spi_dev),
-            Cmd::MemRead => self.mem_read(&mut spi_dev, answer),
-            Cmd::GetVersion => self.get_version(&mut spi_dev),
-            Cmd::GenRand => self.generate_random_id(&mut spi_dev),
+            Cmd::MemWrite => self.mem_write(dev),
+            Cmd::MemRead => self.mem_read(dev, answer),
+            Cmd::GetVersion => self.get_version(dev, answer),
+            Cmd::GenRand => self.generate_random_id(dev),
         }
     }
 }
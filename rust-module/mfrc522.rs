@@ -6,24 +6,45 @@
 mod command;
 mod mfrc522_inner;
 mod parser;
+mod queue;
+mod stats;
 
+use command::SliceWriter;
 use mfrc522_inner::Mfrc522Spi;
 use parser::Parser;
+use queue::{CommandQueue, FileState, Worker};
 
 use alloc::boxed::Box;
+use alloc::sync::Arc;
+use core::cmp::min;
+use core::fmt::Write;
 use core::pin::Pin;
+use core::sync::atomic::{AtomicU32, Ordering};
 use kernel::prelude::*;
 use kernel::{
+    bindings,
+    c_types::{c_int, c_void},
     file::File,
     file_operations::{FileOpener, FileOperations},
     io_buffer::{IoBufferReader, IoBufferWriter},
     spi::{SpiDevice, SpiMethods},
+    str::CStr,
     miscdev, spi, declare_spi_methods, Error, c_str,
 };
 
-pub static mut SPI_DEVICE: Option<SpiDevice> = None;
+// The device trees allow up to 10MHz, which the C module only uses once calibration showed the
+// wiring copes with it. Without calibration, stay at a speed any wiring supports
 const MAX_SPI_CLOCK_SPEED: u32 = 1_000_000; // Hz
 
+/// Maximum amount of readers handled at once
+const MAX_READERS: u32 = 32;
+
+/// Size of the names of the misc devices of a reader, NUL included
+const NAME_SIZE: usize = 32;
+
+/// Numbers of the probed readers, one bit each, used in the names of their devices
+static READER_IDS: AtomicU32 = AtomicU32::new(0);
+
 module! {
     type: Mfrc522Driver,
     name: b"mfrc522",
@@ -34,13 +55,18 @@ module! {
     },
 }
 
-struct Mfrc522FileOps;
-
-impl FileOpener<()> for Mfrc522FileOps {
-    fn open(_ctx: &()) -> Result<Self::Wrapper> {
-        pr_info!("[MFRC522-RS] File opened\n");
+/// State of an open file. Each file gets the answers of its own commands, as with the C module
+struct Mfrc522FileOps {
+    state: Pin<Arc<FileState>>,
+    queue: Pin<Arc<CommandQueue>>,
+}
 
-        Ok(Box::try_new(Self)?)
+impl FileOpener<Pin<Arc<CommandQueue>>> for Mfrc522FileOps {
+    fn open(queue: &Pin<Arc<CommandQueue>>) -> Result<Self::Wrapper> {
+        Ok(Box::try_new(Self {
+            state: FileState::try_new()?,
+            queue: queue.clone(),
+        })?)
     }
 }
 
@@ -49,49 +75,178 @@ impl FileOperations for Mfrc522FileOps {
 
     kernel::declare_file_operations!(read, write);
 
-    fn read<T: IoBufferWriter>(&self, _file: &File, _data: &mut T, _offset: u64) -> Result<usize> {
-        pr_info!("[MFRC522-RS] Being read from\n");
+    /// Wait for the commands written so far, and return the answer of the last one which
+    /// answered
+    fn read<T: IoBufferWriter>(&self, _file: &File, data: &mut T, _offset: u64) -> Result<usize> {
+        let mut answer = [0u8; command::MAX_DATA_LEN];
+        let count = self.state.read(&mut answer[..min(data.len(), command::MAX_DATA_LEN)])?;
+
+        data.write_slice(&answer[..count])?;
 
-        Ok(0)
+        Ok(count)
     }
 
+    /// Queue a command and return without waiting for it to run. The queue being full is
+    /// reported with EAGAIN
     fn write<T: IoBufferReader>(&self, _: &File, data: &mut T, _offset: u64) -> Result<usize> {
-        let kernel_vec = data.read_all()?;
+        let len = data.len();
+        let mut input = [0u8; parser::MAX_INPUT_LEN];
 
-        // FIXME: Should we use from_utf8 and return an error on invalid UTF8?
-        // If not, document SAFETY here too
-        let user_input = unsafe { core::str::from_utf8_unchecked(&kernel_vec) };
+        if len > parser::MAX_INPUT_LEN {
+            return Err(Error::EINVAL);
+        }
 
-        pr_info!("[MFRC522-RS] Being written to: {}\n", user_input);
+        data.read_slice(&mut input[..len])?;
 
-        // TODO: Implement core::convert::To<KernelError> for ParseError?
-        // let cmd = parser::Parse(...)?;
-        let cmd = match Parser::parse(user_input) {
-            Err(_) => return Err(Error::EINVAL),
-            Ok(cmd) => cmd,
-        };
+        let user_input = core::str::from_utf8(&input[..len]).map_err(|_| Error::EINVAL)?;
+        let cmd = Parser::parse(user_input).map_err(|_| Error::EINVAL)?;
 
-        if unsafe { SPI_DEVICE.is_none() } {
-            pr_info!("[MFRC522-RS] Can not talk to the device, MFRC522 not present");
-            return Err(Error::EPERM);
-        }
+        // Fails with ENODEV once the reader went away
+        self.queue.submit(cmd, &self.state)?;
 
-        let mut answer = [0u8; command::MAX_DATA_LEN];
+        Ok(len)
+    }
+}
+
+/// Size of the text of every counter, with room to spare
+const STATS_TEXT_SIZE: usize = 512;
+
+/// Device exposing the counters of a reader, one "<name> <value>" line per counter, the same way
+/// for every read so that `cat` works
+struct Mfrc522StatsFileOps {
+    queue: Pin<Arc<CommandQueue>>,
+}
+
+impl FileOpener<Pin<Arc<CommandQueue>>> for Mfrc522StatsFileOps {
+    fn open(queue: &Pin<Arc<CommandQueue>>) -> Result<Self::Wrapper> {
+        Ok(Box::try_new(Self {
+            queue: queue.clone(),
+        })?)
+    }
+}
 
-        // FIXME: We need to store the answer, if some bytes were written, into the driver's
-        // state
-        match cmd.execute(&mut answer) {
-            // FIXME: Once the Command API is reworked, this will make more sense
-            Ok(_) => Ok(kernel_vec.len()),
-            Err(_) => Err(Error::EINVAL),
+impl FileOperations for Mfrc522StatsFileOps {
+    type Wrapper = Box<Self>;
+
+    kernel::declare_file_operations!(read);
+
+    fn read<T: IoBufferWriter>(&self, _file: &File, data: &mut T, offset: u64) -> Result<usize> {
+        let mut text = [0u8; STATS_TEXT_SIZE];
+        let len = self.queue.stats().show(&mut text);
+        let offset = min(offset, len as u64) as usize;
+        let count = min(len - offset, data.len());
+
+        data.write_slice(&text[offset..offset + count])?;
+
+        Ok(count)
+    }
+}
+
+/// Number of a probed reader, given back when dropped
+struct ReaderId(u32);
+
+impl ReaderId {
+    fn alloc() -> Result<Self> {
+        let mut ids = READER_IDS.load(Ordering::Relaxed);
+
+        loop {
+            let id = (!ids).trailing_zeros();
+
+            if id >= MAX_READERS {
+                return Err(Error::from_kernel_errno(-(bindings::ENOSPC as c_int)));
+            }
+
+            match READER_IDS.compare_exchange_weak(
+                ids,
+                ids | (1 << id),
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            ) {
+                Ok(_) => return Ok(ReaderId(id)),
+                Err(current) => ids = current,
+            }
         }
     }
 }
 
+impl Drop for ReaderId {
+    fn drop(&mut self) {
+        READER_IDS.fetch_and(!(1 << self.0), Ordering::Relaxed);
+    }
+}
+
+/// Names of the misc devices of a reader, which must outlive their registrations
+struct ReaderNames {
+    dev: [u8; NAME_SIZE],
+    stats: [u8; NAME_SIZE],
+}
+
+/// Write "mfrc522_chrdev<id><suffix>" into `buf`, and return it as a C string
+fn reader_name(buf: &mut [u8; NAME_SIZE], id: u32, suffix: &str) -> Result<&'static CStr> {
+    let mut writer = SliceWriter::new(buf);
+
+    write!(writer, "mfrc522_chrdev{}{}\0", id, suffix).map_err(|_| Error::EINVAL)?;
+
+    let len = writer.len();
+    let name = CStr::from_bytes_with_nul(&buf[..len]).map_err(|_| Error::EINVAL)?;
+
+    // SAFETY: The names live in a `ReaderNames` box, which `Mfrc522Reader` drops after the
+    // registrations using them
+    Ok(unsafe { &*(name as *const CStr) })
+}
+
+/// One probed MFRC522, with its own command queue, worker thread and misc devices,
+/// /dev/mfrc522_chrdev<N> and /dev/mfrc522_chrdev<N>_stats. Owned by the driver data of its SPI
+/// device from probe to remove. Fields are dropped in order
+struct Mfrc522Reader {
+    // Deregistered first, so that no file is opened on a reader going away
+    _misc: Pin<Box<miscdev::Registration<Pin<Arc<CommandQueue>>>>>,
+    _stats: Pin<Box<miscdev::Registration<Pin<Arc<CommandQueue>>>>>,
+    // Then stopped, so that no command runs once the SPI device is gone. Files still open keep
+    // the queue, where their commands fail with ENODEV
+    _worker: Worker,
+    _names: Box<ReaderNames>,
+    _id: ReaderId,
+}
+
+impl Mfrc522Reader {
+    fn try_new(queue: Pin<Arc<CommandQueue>>) -> Result<Box<Self>> {
+        let id = ReaderId::alloc()?;
+        let mut names = Box::try_new(ReaderNames {
+            dev: [0u8; NAME_SIZE],
+            stats: [0u8; NAME_SIZE],
+        })?;
+
+        let dev_name = reader_name(&mut names.dev, id.0, "")?;
+        let stats_name = reader_name(&mut names.stats, id.0, "_stats")?;
+
+        let worker = Worker::try_new(queue.clone(), id.0)?;
+
+        let stats = miscdev::Registration::new_pinned::<Mfrc522StatsFileOps>(
+            stats_name,
+            None,
+            queue.clone(),
+        )?;
+
+        let misc =
+            miscdev::Registration::new_pinned::<Mfrc522FileOps>(dev_name, None, queue)?;
+
+        pr_info!("[MFRC522-RS] Reader {} registered\n", id.0);
+
+        Ok(Box::try_new(Mfrc522Reader {
+            _misc: misc,
+            _stats: stats,
+            _worker: worker,
+            _names: names,
+            _id: id,
+        })?)
+    }
+}
+
 struct Mfrc522SpiMethods;
 
 impl SpiMethods for Mfrc522SpiMethods {
-    declare_spi_methods!(probe);
+    declare_spi_methods!(probe, remove);
 
     fn probe(mut spi_device: SpiDevice) -> Result {
         pr_info!("[MFRC522-RS] SPI Registered\n");
@@ -107,40 +262,60 @@ impl SpiMethods for Mfrc522SpiMethods {
             }
         }
 
-        let version = match Mfrc522Spi::get_version(&mut spi_device) {
+        let queue = CommandQueue::try_new(spi_device)?;
+
+        let version = match queue.with_dev(Mfrc522Spi::get_version) {
             Ok(v) => v,
             Err(_) => return Err(kernel::Error::from_kernel_errno(-1)),
         };
 
         pr_info!("[MFRC522-RS] MFRC522 {:?} detected\n", version);
 
-        unsafe { SPI_DEVICE = Some(spi_device) };
+        let reader = Mfrc522Reader::try_new(queue)?;
+
+        // Open-coded spi_set_drvdata(), which is inline and therefore not part of the bindings
+        // SAFETY: The device is valid during probe, and only remove takes the reader back
+        unsafe {
+            (*spi_device.to_ptr()).dev.driver_data = Box::into_raw(reader) as *mut c_void;
+        }
+
+        Ok(())
+    }
+
+    fn remove(mut spi_device: SpiDevice) -> Result {
+        // SAFETY: The device is valid during remove, and its driver data was set by probe
+        let reader = unsafe {
+            let dev = &mut (*spi_device.to_ptr()).dev;
+            let reader = dev.driver_data as *mut Mfrc522Reader;
+
+            dev.driver_data = core::ptr::null_mut();
+            reader
+        };
+
+        if !reader.is_null() {
+            // SAFETY: `reader` comes from `Box::into_raw()` in probe
+            drop(unsafe { Box::from_raw(reader) });
+        }
 
         Ok(())
     }
 }
 
 struct Mfrc522Driver {
+    // Unregistering the driver removes every reader
     _spi: Pin<Box<spi::DriverRegistration>>,
-    _misc: Pin<Box<miscdev::Registration>>,
 }
 
 impl KernelModule for Mfrc522Driver {
     fn init() -> Result<Self> {
         pr_info!("[MFRC522-RS] Init\n");
 
-        let misc =
-            miscdev::Registration::new_pinned::<Mfrc522FileOps>(c_str!("mfrc522_chrdev"), None, ())?;
-
         let spi = spi::DriverRegistration::new_pinned::<Mfrc522SpiMethods>(
             &THIS_MODULE,
             c_str!("mfrc522"),
         )?;
 
-        Ok(Mfrc522Driver {
-            _spi: spi,
-            _misc: misc,
-        })
+        Ok(Mfrc522Driver { _spi: spi })
     }
 }
 
@@ -1,5 +1,7 @@
 mod command;
+mod register;
 mod spi;
 
 pub use command::{Mfrc522Command, Mfrc522CommandByte, Mfrc522PowerDown, Mfrc522Receiver};
-pub use spi::Mfrc522Spi;
+pub use register::reg;
+pub use spi::{Mfrc522Dev, Mfrc522Spi, SpiBufs, Transaction};
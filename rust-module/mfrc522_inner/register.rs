@@ -0,0 +1,173 @@
+/// Represent the SPI address byte mode, Table 8 of section 8.1.2.3
+#[derive(Clone, Copy)]
+#[repr(u8)]
+pub enum AddressByteMode {
+    Write = 0,
+    Read = 1,
+}
+
+/// Represent the SPI address byte, section 8.1.2.3
+#[repr(packed)]
+pub struct AddressByte {
+    addr: Mfrc522Register,
+    mode: AddressByteMode,
+}
+
+impl AddressByte {
+    pub const fn new(addr: Mfrc522Register, mode: AddressByteMode) -> Self {
+        AddressByte { addr, mode }
+    }
+
+    /// Convert the AddressByte to a real byte encoded as described in Table 8
+    /// of section 8.1.2.3
+    pub const fn to_byte(&self) -> u8 {
+        (((self.mode as u8) & 0b1) << 7) | (((self.addr as u8) & 0b00111111) << 1) & 0xFE
+    }
+}
+
+/// Register known at compile time. Implemented by the types of the `reg` module, so that the
+/// address bytes of an access are constants rather than computed on every access
+pub trait Register {
+    const ADDRESS: Mfrc522Register;
+
+    /// Address byte reading the register
+    const READ: u8 = AddressByte::new(Self::ADDRESS, AddressByteMode::Read).to_byte();
+
+    /// Address byte writing the register
+    const WRITE: u8 = AddressByte::new(Self::ADDRESS, AddressByteMode::Write).to_byte();
+}
+
+/// Define `Mfrc522Register`, and a type implementing `Register` for each of its variants
+macro_rules! registers {
+    ($($(#[$doc:meta])* $name:ident = $addr:expr,)*) => {
+        /// Address of the MFRC522 registers, Table 20 section 9.2
+        #[derive(Clone, Copy)]
+        #[allow(dead_code)]
+        pub enum Mfrc522Register {
+            $($(#[$doc])* $name = $addr,)*
+        }
+
+        /// Registers as types, to be used with `Transaction`
+        #[allow(dead_code)]
+        pub mod reg {
+            $(
+                $(#[$doc])*
+                pub struct $name;
+
+                impl super::Register for $name {
+                    const ADDRESS: super::Mfrc522Register = super::Mfrc522Register::$name;
+                }
+            )*
+        }
+    };
+}
+
+registers! {
+    // Command and status, section 9.3.1
+    /// Command register, section 9.3.1.2
+    Command = 0x01,
+    /// Enable bits of the interrupt requests of ComIrqReg, section 9.3.1.3
+    ComIEn = 0x02,
+    /// Enable bits of the interrupt requests of DivIrqReg, section 9.3.1.4
+    DivIEn = 0x03,
+    /// Interrupt request bits, section 9.3.1.5
+    ComIrq = 0x04,
+    /// Interrupt request bits of the CRC coprocessor and of MfinActIRq, section 9.3.1.6
+    DivIrq = 0x05,
+    /// Error bits of the last command, section 9.3.1.7
+    Error = 0x06,
+    /// Status of the timer, of the CRC coprocessor and of the FIFO, section 9.3.1.8
+    Status1 = 0x07,
+    /// Status of the receiver, the transmitter and the MIFARE Crypto1 unit, section 9.3.1.9
+    Status2 = 0x08,
+    /// FIFO Data register, section 9.3.1.10
+    FifoData = 0x09,
+    /// FIFO Level register, section 9.3.1.11
+    FifoLevel = 0x0A,
+    /// Level for FIFO underflow and overflow warnings, section 9.3.1.12
+    WaterLevel = 0x0B,
+    /// Miscellaneous control bits, section 9.3.1.13
+    Control = 0x0C,
+    /// Adjustments for bit-oriented frames, section 9.3.1.14
+    BitFraming = 0x0D,
+    /// Position of the first bit collision, section 9.3.1.15
+    Coll = 0x0E,
+
+    // Command, section 9.3.2
+    /// General modes for transmitting and receiving, section 9.3.2.2
+    Mode = 0x11,
+    /// Transmission data rate and framing, section 9.3.2.3
+    TxMode = 0x12,
+    /// Reception data rate and framing, section 9.3.2.4
+    RxMode = 0x13,
+    /// Antenna driver pins TX1 and TX2, section 9.3.2.5
+    TxControl = 0x14,
+    /// Transmit modulation, section 9.3.2.6
+    TxAsk = 0x15,
+    /// Internal sources of the antenna driver, section 9.3.2.7
+    TxSel = 0x16,
+    /// Internal receiver settings, section 9.3.2.8
+    RxSel = 0x17,
+    /// Thresholds of the bit decoder, section 9.3.2.9
+    RxThreshold = 0x18,
+    /// Demodulator settings, section 9.3.2.10
+    Demod = 0x19,
+    /// MIFARE transmission parameters, section 9.3.2.13
+    MfTx = 0x1C,
+    /// MIFARE reception parameters, section 9.3.2.14
+    MfRx = 0x1D,
+    /// Speed of the serial UART interface, section 9.3.2.16
+    SerialSpeed = 0x1F,
+
+    // Configuration, section 9.3.3
+    /// MSB of the CRC calculation result, section 9.3.3.2
+    CrcResultHigh = 0x21,
+    /// LSB of the CRC calculation result, section 9.3.3.2
+    CrcResultLow = 0x22,
+    /// Modulation width, section 9.3.3.4
+    ModWidth = 0x24,
+    /// Receiver gain, section 9.3.3.6
+    RfCfg = 0x26,
+    /// Conductance of the antenna driver pins when not modulating, section 9.3.3.7
+    GsN = 0x27,
+    /// Conductance of the p-driver output when not modulating, section 9.3.3.8
+    CwGsP = 0x28,
+    /// Conductance of the p-driver output when modulating, section 9.3.3.9
+    ModGsP = 0x29,
+    /// Timer settings and high bits of the prescaler, section 9.3.3.10
+    TMode = 0x2A,
+    /// Low bits of the timer prescaler, section 9.3.3.10
+    TPrescaler = 0x2B,
+    /// High byte of the timer reload value, section 9.3.3.11
+    TReloadHigh = 0x2C,
+    /// Low byte of the timer reload value, section 9.3.3.11
+    TReloadLow = 0x2D,
+    /// High byte of the timer value, section 9.3.3.12
+    TCounterValHigh = 0x2E,
+    /// Low byte of the timer value, section 9.3.3.12
+    TCounterValLow = 0x2F,
+
+    // Test, section 9.3.4
+    /// General test signal configuration, section 9.3.4.2
+    TestSel1 = 0x31,
+    /// General test signal configuration and PRBS control, section 9.3.4.3
+    TestSel2 = 0x32,
+    /// Enable of the output drivers of pins D1 to D7, section 9.3.4.4
+    TestPinEn = 0x33,
+    /// Values of pins D1 to D7 used as an I/O bus, section 9.3.4.5
+    TestPinValue = 0x34,
+    /// Status of the internal test bus, section 9.3.4.6
+    TestBus = 0x35,
+    /// Digital self-test, section 9.3.4.7
+    AutoTest = 0x36,
+    /// Version register, section 9.3.4.8
+    Version = 0x37,
+    /// Pins AUX1 and AUX2, section 9.3.4.9
+    AnalogTest = 0x38,
+    /// Test value of TestDAC1, section 9.3.4.10
+    TestDac1 = 0x39,
+    /// Test value of TestDAC2, section 9.3.4.11
+    TestDac2 = 0x3A,
+    /// Value of the ADC I and Q channels, section 9.3.4.12
+    TestAdc = 0x3B,
+}
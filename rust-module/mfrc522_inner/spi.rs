@@ -1,23 +1,29 @@
+use alloc::boxed::Box;
+use kernel::bindings;
+use kernel::c_types::{c_int, c_ulong};
 use kernel::spi::{Spi, SpiDevice};
 use kernel::{pr_info, Error, Result};
 
+use super::register::{reg, Register};
 use super::{Mfrc522Command, Mfrc522CommandByte, Mfrc522PowerDown, Mfrc522Receiver};
+use crate::stats::{self, Stats};
 
 const FIFO_LEVEL_REG_FLUSH_SHIFT: u8 = 7;
+const FIFO_LEVEL_REG_LEVEL_MASK: u8 = 0x7F;
 
-/// Address of the MFRC522 registers, Table 20 section 9.2
-#[derive(Clone, Copy)]
-#[allow(dead_code)]
-pub enum Mfrc522Register {
-    /// VersionReg register, section 9.3.4.8
-    Version = 0x37,
-    /// FIFO Level register, section 9.3.1.11
-    FifoLevel = 0xA,
-    /// FIFO Data register, section FIXME
-    FifoData = 0x9,
-    /// Command register, section FIXME
-    Command = 0x1,
-}
+/// Longest a command may take before `wait_for_command()` gives up, as in the C module
+const CMD_TIMEOUT_NS: u64 = 50_000_000;
+const CMD_POLL_MIN_US: c_ulong = 20;
+const CMD_POLL_MAX_US: c_ulong = 100;
+
+/// Size of the MFRC522's FIFO buffer
+const FIFO_SIZE: usize = 64;
+
+/// Maximum amount of register accesses in a transaction, as in a stage of the C module
+const TRANSACTION_MAX_ACCESSES: usize = 12;
+
+/// Size of the buffers of a transaction: a full FIFO, and room for the accesses around it
+const TRANSACTION_BUF_SIZE: usize = 2 * FIFO_SIZE;
 
 /// Describe the different possible value of VersionReg register, section 9.3.4.8
 #[derive(Debug)]
@@ -37,30 +43,151 @@ impl From<u8> for Mfrc522Version {
     }
 }
 
-/// Represent the SPI address byte mode, Table 8 of section 8.1.2.3
+/// Memory of the SPI messages sent to an MFRC522, allocated once per reader. SPI controllers may
+/// DMA to and from the buffers, which buffers on the stack do not allow, and the transfers alone
+/// would take a good part of the stack
+pub struct SpiBufs {
+    tx: [u8; TRANSACTION_BUF_SIZE],
+    rx: [u8; TRANSACTION_BUF_SIZE],
+    xfers: [bindings::spi_transfer; TRANSACTION_MAX_ACCESSES],
+}
+
+impl SpiBufs {
+    pub fn try_new() -> Result<Box<Self>> {
+        Ok(Box::try_new(SpiBufs {
+            tx: [0u8; TRANSACTION_BUF_SIZE],
+            rx: [0u8; TRANSACTION_BUF_SIZE],
+            // SAFETY: spi_transfer is a plain C structure, for which an all-zero value is a
+            // valid empty state
+            xfers: unsafe { core::mem::zeroed() },
+        })?)
+    }
+}
+
+/// MFRC522 on an SPI bus, along with the counters of its reader, which account for every SPI
+/// message sent to it, and the memory of these messages
+pub struct Mfrc522Dev<'a> {
+    pub spi: SpiDevice,
+    pub stats: &'a Stats,
+    pub bufs: &'a mut SpiBufs,
+}
+
+/// Position of the answer to a read queued in a `Transaction`
 #[derive(Clone, Copy)]
-#[repr(u8)]
-enum AddressByteMode {
-    Write = 0,
-    Read = 1,
+pub struct Read {
+    start: usize,
+    len: usize,
 }
 
-/// Represent the SPI address byte, section 8.1.2.3
-#[repr(packed)]
-struct AddressByte {
-    addr: Mfrc522Register,
-    mode: AddressByteMode,
+/// Register accesses sent to the MFRC522 as a single SPI message. Each access still is a
+/// sequence of its own, ended by releasing NSS as sections 8.1.2.1 and 8.1.2.2 require, but the
+/// SPI controller gets all of them at once. Queuing too many accesses makes `run()` fail. The
+/// accesses are built in the buffers of the device, which the transaction borrows
+pub struct Transaction<'d, 'a> {
+    dev: &'d mut Mfrc522Dev<'a>,
+    used: usize,
+    /// End of each access in the buffers
+    ends: [usize; TRANSACTION_MAX_ACCESSES],
+    accesses: usize,
+    overflow: bool,
 }
 
-impl AddressByte {
-    fn new(addr: Mfrc522Register, mode: AddressByteMode) -> Self {
-        AddressByte { addr, mode }
+impl<'d, 'a> Transaction<'d, 'a> {
+    pub fn new(dev: &'d mut Mfrc522Dev<'a>) -> Self {
+        Transaction {
+            dev,
+            used: 0,
+            ends: [0; TRANSACTION_MAX_ACCESSES],
+            accesses: 0,
+            overflow: false,
+        }
+    }
+
+    /// Reserve `len` bytes for a new access, and return where they start
+    fn reserve(&mut self, len: usize) -> Option<usize> {
+        if self.overflow
+            || self.accesses == TRANSACTION_MAX_ACCESSES
+            || self.used + len > TRANSACTION_BUF_SIZE
+        {
+            self.overflow = true;
+            return None;
+        }
+
+        let start = self.used;
+
+        self.used += len;
+        self.ends[self.accesses] = self.used;
+        self.accesses += 1;
+
+        Some(start)
+    }
+
+    /// Queue a write to a register
+    pub fn write<R: Register>(&mut self, value: u8) -> &mut Self {
+        self.write_burst::<R>(&[value])
+    }
+
+    /// Queue several writes to the same register, sent after a single address byte as
+    /// described in section 8.1.2.2
+    pub fn write_burst<R: Register>(&mut self, data: &[u8]) -> &mut Self {
+        if let Some(start) = self.reserve(data.len() + 1) {
+            let tx = &mut self.dev.bufs.tx;
+
+            tx[start] = R::WRITE;
+            tx[start + 1..self.used].copy_from_slice(data);
+        }
+
+        self
+    }
+
+    /// Queue `len` reads of the same register, in the continuous read sequence of section
+    /// 8.1.2.1. The bytes read are available through `get()` once the transaction ran
+    pub fn read<R: Register>(&mut self, len: usize) -> Read {
+        match self.reserve(len + 1) {
+            Some(start) => {
+                let tx = &mut self.dev.bufs.tx;
+
+                for byte in &mut tx[start..start + len] {
+                    *byte = R::READ;
+                }
+                tx[start + len] = 0;
+
+                // The MFRC522 answers each address byte during the following one
+                Read {
+                    start: start + 1,
+                    len,
+                }
+            }
+            None => Read { start: 0, len: 0 },
+        }
+    }
+
+    /// Queue a flush of the FIFO
+    pub fn fifo_flush(&mut self) -> &mut Self {
+        self.write::<reg::FifoLevel>(1u8 << FIFO_LEVEL_REG_FLUSH_SHIFT)
+    }
+
+    /// Queue the start of a command. Whoever runs the transaction waits for the command to
+    /// finish afterwards, see `Mfrc522Spi::wait_for_command()`
+    pub fn command(&mut self, cmd: Mfrc522Command) -> &mut Self {
+        let cmd_byte =
+            Mfrc522CommandByte::new(cmd, Mfrc522PowerDown::Off, Mfrc522Receiver::On).to_byte();
+
+        self.write::<reg::Command>(cmd_byte)
+    }
+
+    /// Bytes read by a queued read
+    pub fn get(&self, read: Read) -> &[u8] {
+        &self.dev.bufs.rx[read.start..read.start + read.len]
     }
 
-    /// Convert the AddressByte to a real byte encoded as described in Table 8
-    /// of section 8.1.2.3
-    fn to_byte(&self) -> u8 {
-        (((self.mode as u8) & 0b1) << 7) | (((self.addr as u8) & 0b00111111) << 1) & 0xFE
+    /// Send every queued access in one SPI message
+    pub fn run(&mut self) -> Result {
+        if self.overflow {
+            return Err(Error::EINVAL);
+        }
+
+        Mfrc522Spi::transfer(self.dev, self.used, &self.ends[..self.accesses])
     }
 }
 
@@ -68,40 +195,133 @@ impl AddressByte {
 pub struct Mfrc522Spi;
 
 impl Mfrc522Spi {
-    /// Read an MFRC522 register
-    fn register_read(
-        dev: &mut SpiDevice,
-        reg: Mfrc522Register,
-        read_buf: &mut [u8],
-        read_len: u8,
-    ) -> Result {
-        pr_info!("[MFRC522-RS] register_read\n");
-
-        let address_byte = AddressByte::new(reg, AddressByteMode::Read).to_byte();
-        let address_byte_slice = &[address_byte];
-
-        for i in 0..read_len as usize {
-            Spi::write_then_read(dev, address_byte_slice, &mut read_buf[i..i + 1])?;
+    /// Perform full-duplex transfers of the first `len` bytes of the device's buffers, clocking
+    /// `tx` out while filling `rx`, in one SPI message. `ends` gives the end of each transfer,
+    /// NSS being released in between
+    ///
+    /// The kernel's `Spi` abstraction only offers half-duplex helpers, which cannot
+    /// express the MFRC522's continuous read sequence of section 8.1.2.1
+    fn transfer(dev: &mut Mfrc522Dev<'_>, len: usize, ends: &[usize]) -> Result {
+        if len > TRANSACTION_BUF_SIZE
+            || ends.is_empty()
+            || ends.len() > TRANSACTION_MAX_ACCESSES
+            || ends[ends.len() - 1] != len
+        {
+            return Err(Error::EINVAL);
         }
 
+        let SpiBufs { tx, rx, xfers } = &mut *dev.bufs;
+
+        // SAFETY: spi_message is a plain C structure, for which an all-zero value is a valid
+        // empty state
+        let mut msg: bindings::spi_message = unsafe { core::mem::zeroed() };
+
+        // Open-coded spi_message_init_with_transfers(), which is inline and therefore
+        // not part of the bindings
+        let transfers: *mut bindings::list_head = &mut msg.transfers;
+        let resources: *mut bindings::list_head = &mut msg.resources;
+
+        msg.transfers.next = transfers;
+        msg.transfers.prev = transfers;
+        msg.resources.next = resources;
+        msg.resources.prev = resources;
+
+        let mut start = 0;
+
+        for (i, xfer) in xfers[..ends.len()].iter_mut().enumerate() {
+            let end = ends[i];
+
+            if end <= start {
+                return Err(Error::EINVAL);
+            }
+
+            // SAFETY: As above, the previous message's transfer is reset to an empty state
+            *xfer = unsafe { core::mem::zeroed() };
+
+            xfer.tx_buf = tx[start..].as_ptr() as _;
+            xfer.rx_buf = rx[start..].as_mut_ptr() as _;
+            xfer.len = (end - start) as _;
+
+            // NSS goes high between accesses, but not after the last one
+            if i + 1 < ends.len() {
+                xfer.set_cs_change(1);
+            }
+
+            let entry: *mut bindings::list_head = &mut xfer.transfer_list;
+
+            // SAFETY: `entry` and the list's nodes live in `xfers` and `msg`, which outlive
+            // the list. This is list_add_tail()
+            unsafe {
+                let last = (*transfers).prev;
+
+                (*entry).next = transfers;
+                (*entry).prev = last;
+                (*last).next = entry;
+                (*transfers).prev = entry;
+            }
+
+            start = end;
+        }
+
+        // SAFETY: `msg`, `xfers` and the buffers they point to outlive the synchronous
+        // call, and the device pointer is valid for as long as `dev` is
+        let ret = unsafe { bindings::spi_sync(dev.spi.to_ptr(), &mut msg) };
+
+        let result = match ret {
+            0 => Ok(()),
+            errno => Err(Error::from_kernel_errno(errno)),
+        };
+
+        dev.stats.spi(&result);
+
+        result
+    }
+
+    /// Send a single SPI message, without reading anything back
+    fn write(dev: &mut Mfrc522Dev<'_>, tx: &[u8]) -> Result {
+        let result = Spi::write(&mut dev.spi, tx);
+
+        dev.stats.spi(&result);
+
+        result
+    }
+
+    /// Read an MFRC522 register. Multi-byte reads are done in a single SPI message: the
+    /// address byte is sent once per byte to read and the sequence is ended by a zero
+    /// byte, as described in section 8.1.2.1
+    fn register_read<R: Register>(dev: &mut Mfrc522Dev<'_>, read_buf: &mut [u8], read_len: u8) -> Result {
+        let read_len = read_len as usize;
+
+        if read_len > FIFO_SIZE || read_len > read_buf.len() {
+            return Err(Error::EINVAL);
+        }
+
+        if read_len == 0 {
+            return Ok(());
+        }
+
+        let mut t = Transaction::new(dev);
+        let read = t.read::<R>(read_len);
+
+        t.run()?;
+
+        read_buf[..read_len].copy_from_slice(t.get(read));
+
         Ok(())
     }
 
     /// Write to an MFRC522 register
-    fn register_write(dev: &mut SpiDevice, reg: Mfrc522Register, value: u8) -> Result {
-        let address_byte = AddressByte::new(reg, AddressByteMode::Write).to_byte();
-        let data = &[address_byte, value];
-
-        Spi::write(dev, data)
+    fn register_write<R: Register>(dev: &mut Mfrc522Dev<'_>, value: u8) -> Result {
+        Self::write(dev, &[R::WRITE, value])
     }
 
     /// Get the MFRC522 version stored in VersionReg register, section 9.3.4.8
-    pub fn get_version(dev: &mut SpiDevice) -> Result<Mfrc522Version> {
+    pub fn get_version(dev: &mut Mfrc522Dev<'_>) -> Result<Mfrc522Version> {
         let mut version = [0u8];
 
         pr_info!("[MFRC522-RS] get_version\n");
 
-        Mfrc522Spi::register_read(dev, Mfrc522Register::Version, &mut version, 1)?;
+        Mfrc522Spi::register_read::<reg::Version>(dev, &mut version, 1)?;
 
         pr_info!("[MFRC522-RS] version: {:#X}\n", version[0]);
 
@@ -111,72 +331,64 @@ impl Mfrc522Spi {
         }
     }
 
-    /// Get the current FIFO level of the MFRC522
-    pub fn fifo_level(dev: &mut SpiDevice) -> Result<u8> {
-        let mut level = [0u8];
-
-        Mfrc522Spi::register_read(dev, Mfrc522Register::FifoLevel, &mut level, 1)?;
-
-        let fifo_level = level[0] & 0x7F; // FIFO Level Mask
+    /// Read up to `data.len()` bytes from the MFRC522's FIFO. The level and the data are read in
+    /// the same SPI message, so bytes past the level are left as they were in `data`
+    pub fn fifo_read(dev: &mut Mfrc522Dev<'_>, data: &mut [u8]) -> Result<u8> {
+        if data.len() > FIFO_SIZE {
+            return Err(Error::EINVAL);
+        }
 
-        pr_info!("[MFRC522-RS] Fifo level: {}\n", fifo_level);
+        let mut t = Transaction::new(dev);
+        let level = t.read::<reg::FifoLevel>(1);
+        let fifo = t.read::<reg::FifoData>(data.len());
 
-        Ok(fifo_level)
-    }
+        t.run()?;
 
-    /// Read data from the MFRC522's FIFO
-    pub fn fifo_read(dev: &mut SpiDevice, data: &mut [u8]) -> Result<u8> {
-        let fifo_level = Self::fifo_level(dev)?;
+        let fifo_level = core::cmp::min(
+            (t.get(level)[0] & FIFO_LEVEL_REG_LEVEL_MASK) as usize,
+            data.len(),
+        );
 
-        Self::register_read(dev, Mfrc522Register::FifoData, data, fifo_level)?;
+        data[..fifo_level].copy_from_slice(&t.get(fifo)[..fifo_level]);
 
-        Ok(fifo_level)
+        Ok(fifo_level as u8)
     }
 
-    /// Write data to the MFRC522's FIFO
-    pub fn fifo_write(dev: &mut SpiDevice, data: &[u8]) -> Result {
-        for byte in data {
-            Mfrc522Spi::register_write(dev, Mfrc522Register::FifoData, *byte)?;
-        }
+    /// Wait for a command to finish executing. Fails with ETIMEDOUT if the MFRC522 is still busy
+    /// after `CMD_TIMEOUT_NS`, so that a chip which never goes idle does not hold the worker
+    pub fn wait_for_command(dev: &mut Mfrc522Dev<'_>) -> Result {
+        let deadline = stats::now_ns() + CMD_TIMEOUT_NS;
 
-        Ok(())
-    }
-
-    pub fn fifo_flush(dev: &mut SpiDevice) -> Result {
-        let flush_byte: u8 = 1u8 << FIFO_LEVEL_REG_FLUSH_SHIFT;
-
-        Mfrc522Spi::register_write(dev, Mfrc522Register::FifoLevel, flush_byte)?;
-
-        Ok(())
-    }
-
-    /// Wait for a command to finish executing
-    fn wait_for_command(dev: &mut SpiDevice) -> Result {
         loop {
             let current_cmd = Mfrc522Spi::read_command(dev)?;
             if current_cmd == Mfrc522Command::Idle {
-                break;
+                return Ok(());
             }
-        }
 
-        Ok(())
+            if stats::now_ns() > deadline {
+                return Err(Error::from_kernel_errno(-(bindings::ETIMEDOUT as c_int)));
+            }
+
+            // SAFETY: Called from the worker, or from probe, which may both sleep
+            unsafe { bindings::usleep_range(CMD_POLL_MIN_US, CMD_POLL_MAX_US) };
+        }
     }
 
     /// Send a command to the MFRC522
-    pub fn send_command(dev: &mut SpiDevice, cmd: Mfrc522Command) -> Result {
+    pub fn send_command(dev: &mut Mfrc522Dev<'_>, cmd: Mfrc522Command) -> Result {
         let cmd_byte =
             Mfrc522CommandByte::new(cmd, Mfrc522PowerDown::Off, Mfrc522Receiver::On).to_byte();
 
-        Mfrc522Spi::register_write(dev, Mfrc522Register::Command, cmd_byte)?;
+        Mfrc522Spi::register_write::<reg::Command>(dev, cmd_byte)?;
 
         Mfrc522Spi::wait_for_command(dev)
     }
 
     /// Read the current command byte
-    pub fn read_command(dev: &mut SpiDevice) -> Result<Mfrc522Command> {
+    pub fn read_command(dev: &mut Mfrc522Dev<'_>) -> Result<Mfrc522Command> {
         let mut cmd_byte = [0u8];
 
-        Mfrc522Spi::register_read(dev, Mfrc522Register::Command, &mut cmd_byte, 1)?;
+        Mfrc522Spi::register_read::<reg::Command>(dev, &mut cmd_byte, 1)?;
 
         Ok(Mfrc522CommandByte::from_byte(cmd_byte[0]).cmd)
     }
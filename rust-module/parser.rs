@@ -4,6 +4,9 @@ use core::str::FromStr;
 const SEPARATOR: char = ':';
 const INPUT_SIZE: usize = 25;
 
+/// Longest input accepted from userspace, as in the C module
+pub const MAX_INPUT_LEN: usize = 255;
+
 /// Possible errors when parsing user input
 #[derive(Debug, PartialEq)]
 pub enum ParseError {
@@ -203,4 +206,58 @@ mod tests {
 
         assert_eq!(cmd, Err(ParseError::EmptyInput));
     }
+
+    /// Inputs both parsers accept, but for "get_version", the original name of
+    /// "version", which the C parser, module/mfrc522_parser.c, does not know
+    const VALID_CORPUS: [&str; 7] = [
+        "get_version",
+        "version",
+        "mem_read",
+        "gen_rand_id",
+        "mem_write:3:Hey",
+        "mem_write:25:0123456789abcdefghijklmno",
+        "mem_write:2:Hey",
+    ];
+
+    /// Inputs both parsers refuse, except for "mem_write:0:": the C parser
+    /// writes zeroes for it, while this one needs at least one byte of data
+    const INVALID_CORPUS: [(&str, ParseError); 14] = [
+        ("", ParseError::EmptyInput),
+        ("m", ParseError::UnknownCommand),
+        ("not_a_cmd", ParseError::UnknownCommand),
+        ("mem_reed", ParseError::UnknownCommand),
+        ("MEM_READ", ParseError::UnknownCommand),
+        ("mem_read ", ParseError::UnknownCommand),
+        ("mem_write", ParseError::InvalidArgNumber),
+        ("mem_write:3", ParseError::InvalidArgNumber),
+        ("mem_write:0:", ParseError::InvalidArgNumber),
+        ("mem_write::Hey", ParseError::InvalidArgNumber),
+        ("mem_write:NotANumber:Hey", ParseError::InvalidDataLen),
+        ("mem_write:-15:Hey", ParseError::InvalidDataLen),
+        ("mem_write:26:Hey", ParseError::DataLenTooBig),
+        ("get_version:", ParseError::InvalidArgNumber),
+    ];
+
+    #[test]
+    fn valid_corpus() {
+        for input in VALID_CORPUS {
+            assert!(Parser::parse(input).is_ok(), "input: {:?}", input);
+        }
+    }
+
+    #[test]
+    fn valid_mem_write_full() {
+        let cmd = Parser::parse("mem_write:25:0123456789abcdefghijklmno");
+        let mut ref_data = [0u8; INPUT_SIZE];
+        ref_data.copy_from_slice(b"0123456789abcdefghijklmno");
+
+        assert_eq!(cmd, Ok(Command::new(Cmd::MemWrite, 25, ref_data)));
+    }
+
+    #[test]
+    fn invalid_corpus() {
+        for (input, err) in INVALID_CORPUS {
+            assert_eq!(Parser::parse(input), Err(err), "input: {:?}", input);
+        }
+    }
 }
@@ -0,0 +1,391 @@
+// SPDX-License-Identifier: GPL-2.0
+
+use alloc::boxed::Box;
+use alloc::sync::Arc;
+use core::pin::Pin;
+
+use kernel::prelude::*;
+use kernel::{
+    bindings, c_str,
+    c_types::{c_int, c_uint, c_void},
+    spi::SpiDevice,
+    sync::{CondVar, Mutex},
+    Error,
+};
+
+use crate::command::{Answer, Command, CommandResult, CommandSuccess, MAX_DATA_LEN};
+use crate::mfrc522_inner::{Mfrc522Dev, SpiBufs};
+use crate::stats::Stats;
+
+/// Maximum amount of commands waiting for the worker. Submitting more fails with EAGAIN
+pub const QUEUE_DEPTH: usize = 16;
+
+/// Results of the commands submitted through one open file
+struct FileResults {
+    data: Answer,
+    len: usize,
+    pos: usize,
+    /// Commands submitted but not executed yet
+    pending: usize,
+    /// Whether a command failed since the last read
+    failed: bool,
+    /// Whether commands were dropped because the reader went away
+    gone: bool,
+}
+
+/// State shared by an open file and the worker executing its commands
+pub struct FileState {
+    results: Mutex<FileResults>,
+    /// Notified each time one of the file's commands has been executed
+    done: CondVar,
+}
+
+impl FileState {
+    pub fn try_new() -> Result<Pin<Arc<Self>>> {
+        let state = Arc::try_pin(FileState {
+            // SAFETY: `mutex_init!` is called below
+            results: unsafe {
+                Mutex::new(FileResults {
+                    data: [0u8; MAX_DATA_LEN],
+                    len: 0,
+                    pos: 0,
+                    pending: 0,
+                    failed: false,
+                    gone: false,
+                })
+            },
+            // SAFETY: `condvar_init!` is called below
+            done: unsafe { CondVar::new() },
+        })?;
+
+        // SAFETY: `results` is pinned behind `Arc`
+        let results = unsafe { Pin::new_unchecked(&state.results) };
+        kernel::mutex_init!(results, "FileState::results");
+
+        // SAFETY: `done` is pinned behind `Arc`
+        let done = unsafe { Pin::new_unchecked(&state.done) };
+        kernel::condvar_init!(done, "FileState::done");
+
+        Ok(state)
+    }
+
+    /// Wait for every submitted command to be executed, then copy the answer of the last one
+    /// which answered. Fails with EINVAL once if a command failed since the last read, and with
+    /// ENODEV if the reader went away before executing them
+    pub fn read(&self, buf: &mut [u8]) -> Result<usize> {
+        let mut results = self.results.lock();
+
+        while results.pending > 0 {
+            if self.done.wait(&mut results) {
+                return Err(Error::EINTR);
+            }
+        }
+
+        if results.gone {
+            return Err(Error::ENODEV);
+        }
+
+        if results.failed {
+            results.failed = false;
+            return Err(Error::EINVAL);
+        }
+
+        let count = core::cmp::min(results.len - results.pos, buf.len());
+        let pos = results.pos;
+
+        buf[..count].copy_from_slice(&results.data[pos..pos + count]);
+        results.pos += count;
+
+        // Once fully read, the answer is gone and the next read returns 0
+        if results.pos == results.len {
+            results.len = 0;
+            results.pos = 0;
+        }
+
+        Ok(count)
+    }
+
+    /// Take note of a command being submitted. Its answer replaces any answer left unread
+    fn submitted(&self) {
+        let mut results = self.results.lock();
+
+        results.pending += 1;
+        results.len = 0;
+        results.pos = 0;
+    }
+
+    fn complete(&self, result: &CommandResult, answer: &Answer) {
+        let mut results = self.results.lock();
+
+        results.pending -= 1;
+
+        match result {
+            Ok(CommandSuccess::BytesRead(len)) => {
+                results.data = *answer;
+                results.len = *len;
+                results.pos = 0;
+            }
+            Ok(_) => {}
+            Err(_) => results.failed = true,
+        }
+
+        drop(results);
+
+        self.done.notify_all();
+    }
+
+    /// Take note of a command dropped without being executed, because its reader went away
+    fn cancelled(&self) {
+        let mut results = self.results.lock();
+
+        results.pending -= 1;
+        results.gone = true;
+
+        drop(results);
+
+        self.done.notify_all();
+    }
+}
+
+struct Entry {
+    cmd: Command,
+    file: Pin<Arc<FileState>>,
+}
+
+struct QueueInner {
+    /// Ring of submitted commands, `len` of them starting at `head`
+    entries: [Option<Entry>; QUEUE_DEPTH],
+    head: usize,
+    len: usize,
+    stopping: bool,
+}
+
+/// Commands of an MFRC522, executed in order by a kernel thread of their own, so that writers
+/// never wait for the chip or for a PICC. Each probed reader has its own queue
+pub struct CommandQueue {
+    inner: Mutex<QueueInner>,
+    /// Notified when a command is submitted, or when the worker has to stop
+    changed: CondVar,
+    /// Only used by the worker, which is stopped before the device goes away
+    spi: SpiDevice,
+    stats: Stats,
+    /// Memory of the SPI messages, see `with_dev()`
+    bufs: Mutex<Box<SpiBufs>>,
+}
+
+// SAFETY: The SPI device is only used through `with_dev()`, by probe and then by the worker. The
+// raw pointers of the SPI buffers only point into them while their lock is held, and everything
+// else is either behind a mutex or atomic
+unsafe impl Send for CommandQueue {}
+unsafe impl Sync for CommandQueue {}
+
+impl CommandQueue {
+    pub fn try_new(spi: SpiDevice) -> Result<Pin<Arc<Self>>> {
+        let queue = Arc::try_pin(CommandQueue {
+            // SAFETY: `mutex_init!` is called below
+            inner: unsafe {
+                Mutex::new(QueueInner {
+                    entries: Default::default(),
+                    head: 0,
+                    len: 0,
+                    stopping: false,
+                })
+            },
+            // SAFETY: `condvar_init!` is called below
+            changed: unsafe { CondVar::new() },
+            spi,
+            stats: Stats::new(),
+            // SAFETY: `mutex_init!` is called below
+            bufs: unsafe { Mutex::new(SpiBufs::try_new()?) },
+        })?;
+
+        // SAFETY: `inner` is pinned behind `Arc`
+        let inner = unsafe { Pin::new_unchecked(&queue.inner) };
+        kernel::mutex_init!(inner, "CommandQueue::inner");
+
+        // SAFETY: `changed` is pinned behind `Arc`
+        let changed = unsafe { Pin::new_unchecked(&queue.changed) };
+        kernel::condvar_init!(changed, "CommandQueue::changed");
+
+        // SAFETY: `bufs` is pinned behind `Arc`
+        let bufs = unsafe { Pin::new_unchecked(&queue.bufs) };
+        kernel::mutex_init!(bufs, "CommandQueue::bufs");
+
+        Ok(queue)
+    }
+
+    /// Counters of the reader
+    pub fn stats(&self) -> &Stats {
+        &self.stats
+    }
+
+    /// Talk to the device, with the SPI buffers of the reader. Only the worker does so once it
+    /// started, the lock is only contended by probe
+    pub fn with_dev<T>(&self, f: impl FnOnce(&mut Mfrc522Dev<'_>) -> T) -> T {
+        let mut bufs = self.bufs.lock();
+        let mut dev = Mfrc522Dev {
+            spi: self.spi,
+            stats: &self.stats,
+            bufs: &mut bufs,
+        };
+
+        f(&mut dev)
+    }
+
+    /// Queue a command for the worker. Its result goes to `file`. Fails with EAGAIN instead of
+    /// waiting when the queue is full
+    pub fn submit(&self, cmd: Command, file: &Pin<Arc<FileState>>) -> Result {
+        let mut inner = self.inner.lock();
+
+        if inner.stopping {
+            return Err(Error::ENODEV);
+        }
+
+        if inner.len == QUEUE_DEPTH {
+            return Err(Error::EAGAIN);
+        }
+
+        let tail = (inner.head + inner.len) % QUEUE_DEPTH;
+
+        file.submitted();
+        inner.entries[tail] = Some(Entry {
+            cmd,
+            file: file.clone(),
+        });
+        inner.len += 1;
+
+        drop(inner);
+
+        self.changed.notify_one();
+
+        Ok(())
+    }
+
+    /// Wait for the next command, or return None once the queue is stopping
+    fn next(&self) -> Option<Entry> {
+        let mut inner = self.inner.lock();
+
+        // The worker is a kernel thread, which does not get signals
+        while inner.len == 0 && !inner.stopping {
+            let _ = self.changed.wait(&mut inner);
+        }
+
+        if inner.stopping {
+            return None;
+        }
+
+        let head = inner.head;
+        let entry = inner.entries[head].take();
+
+        inner.head = (head + 1) % QUEUE_DEPTH;
+        inner.len -= 1;
+
+        entry
+    }
+
+    fn execute(&self, entry: Entry) {
+        let mut answer = [0u8; MAX_DATA_LEN];
+        let start = self.stats.cmd_start();
+
+        let result = self.with_dev(|dev| entry.cmd.execute(dev, &mut answer));
+
+        self.stats.cmd_end(start, result.is_err());
+
+        entry.file.complete(&result, &answer);
+    }
+
+    fn stop(&self) {
+        let mut inner = self.inner.lock();
+
+        inner.stopping = true;
+
+        // Readers still waiting for commands left over learn that the device went away
+        while inner.len > 0 {
+            let head = inner.head;
+
+            if let Some(entry) = inner.entries[head].take() {
+                entry.file.cancelled();
+            }
+
+            inner.head = (head + 1) % QUEUE_DEPTH;
+            inner.len -= 1;
+        }
+
+        drop(inner);
+
+        self.changed.notify_all();
+    }
+}
+
+extern "C" fn worker_fn(data: *mut c_void) -> c_int {
+    // SAFETY: `data` comes from the `Arc` held by the `Worker`, which stops this thread before
+    // letting go of it
+    let queue = unsafe { &*(data as *const CommandQueue) };
+
+    while let Some(entry) = queue.next() {
+        queue.execute(entry);
+    }
+
+    // kthread_stop() needs the thread to still exist when it is called, so it sleeps parked until
+    // then. set_current_state() is not part of the bindings, but kthread_parkme() sets the state
+    // before checking for the park request, so the wake up of kthread_stop() is never missed
+    // SAFETY: Called from the kernel thread itself, which may park itself
+    unsafe {
+        bindings::kthread_park(bindings::get_current());
+
+        while !bindings::kthread_should_stop() {
+            bindings::kthread_parkme();
+        }
+    }
+
+    0
+}
+
+/// Kernel thread executing the commands of a `CommandQueue`
+pub struct Worker {
+    task: *mut bindings::task_struct,
+    queue: Pin<Arc<CommandQueue>>,
+}
+
+// SAFETY: The task pointer is only used to stop the thread, which kthread_stop() allows from
+// any context
+unsafe impl Send for Worker {}
+unsafe impl Sync for Worker {}
+
+impl Worker {
+    /// Start the worker of a queue, named after the number of its reader
+    pub fn try_new(queue: Pin<Arc<CommandQueue>>, id: u32) -> Result<Self> {
+        let data = &*queue as *const CommandQueue as *mut c_void;
+
+        // SAFETY: `worker_fn` matches the thread function type, and the name is a valid format
+        // string taking the one argument given. The queue outlives the thread, see `Drop`
+        let task = unsafe {
+            bindings::kthread_create_on_node(
+                Some(worker_fn),
+                data,
+                bindings::NUMA_NO_NODE,
+                c_str!("mfrc522_cmd%u").as_char_ptr(),
+                id as c_uint,
+            )
+        };
+
+        // Open-coded IS_ERR(), which is inline and therefore not part of the bindings
+        if task as usize >= (-(bindings::MAX_ERRNO as isize)) as usize {
+            return Err(Error::from_kernel_errno(task as isize as c_int));
+        }
+
+        // SAFETY: `task` is a thread which was just created
+        unsafe { bindings::wake_up_process(task) };
+
+        Ok(Worker { task, queue })
+    }
+}
+
+impl Drop for Worker {
+    fn drop(&mut self) {
+        self.queue.stop();
+
+        // SAFETY: The thread only returns once kthread_stop() was called, which unparks it
+        unsafe { bindings::kthread_stop(self.task) };
+    }
+}
@@ -0,0 +1,112 @@
+// SPDX-License-Identifier: GPL-2.0
+
+use core::fmt::Write;
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use kernel::bindings;
+
+use crate::command::SliceWriter;
+
+/// Counters of a reader, updated by every command and SPI message. They are named after the sysfs
+/// attributes of the C module, so that both drivers can be compared on the same workload
+pub struct Stats {
+    bytes_read: AtomicU64,
+    bytes_written: AtomicU64,
+    spi_messages: AtomicU64,
+    spi_errors: AtomicU64,
+    commands: AtomicU64,
+    command_errors: AtomicU64,
+    spi_messages_last_cmd: AtomicU64,
+    last_cmd_latency_ns: AtomicU64,
+}
+
+/// Monotonic time in nanoseconds
+pub fn now_ns() -> u64 {
+    // SAFETY: ktime_get() has no precondition
+    unsafe { bindings::ktime_get() as u64 }
+}
+
+/// Start of a command, as returned by `Stats::cmd_start()`
+pub struct CmdStart {
+    ns: u64,
+    spi_messages: u64,
+}
+
+impl Stats {
+    pub const fn new() -> Self {
+        Stats {
+            bytes_read: AtomicU64::new(0),
+            bytes_written: AtomicU64::new(0),
+            spi_messages: AtomicU64::new(0),
+            spi_errors: AtomicU64::new(0),
+            commands: AtomicU64::new(0),
+            command_errors: AtomicU64::new(0),
+            spi_messages_last_cmd: AtomicU64::new(0),
+            last_cmd_latency_ns: AtomicU64::new(0),
+        }
+    }
+
+    /// Account for an SPI message once it went through
+    pub fn spi<T>(&self, result: &kernel::Result<T>) {
+        self.spi_messages.fetch_add(1, Ordering::Relaxed);
+        if result.is_err() {
+            self.spi_errors.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Account for bytes read from the MFRC522's memory
+    pub fn bytes_read(&self, amount: usize) {
+        self.bytes_read.fetch_add(amount as u64, Ordering::Relaxed);
+    }
+
+    /// Account for bytes written to the MFRC522's memory
+    pub fn bytes_written(&self, amount: usize) {
+        self.bytes_written.fetch_add(amount as u64, Ordering::Relaxed);
+    }
+
+    /// Take note of the time and of the amount of SPI messages before a command runs
+    pub fn cmd_start(&self) -> CmdStart {
+        CmdStart {
+            ns: now_ns(),
+            spi_messages: self.spi_messages.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Account for a command once it ran
+    pub fn cmd_end(&self, start: CmdStart, error: bool) {
+        let spi_messages = self.spi_messages.load(Ordering::Relaxed) - start.spi_messages;
+
+        self.commands.fetch_add(1, Ordering::Relaxed);
+        if error {
+            self.command_errors.fetch_add(1, Ordering::Relaxed);
+        }
+
+        self.spi_messages_last_cmd.store(spi_messages, Ordering::Relaxed);
+        self.last_cmd_latency_ns
+            .store(now_ns() - start.ns, Ordering::Relaxed);
+    }
+
+    /// Format every counter as a "<name> <value>" line. Return the length of the text, which is
+    /// cut short if the buffer is too small
+    pub fn show(&self, buf: &mut [u8]) -> usize {
+        let counters = [
+            ("bytes_read", &self.bytes_read),
+            ("bytes_written", &self.bytes_written),
+            ("spi_messages", &self.spi_messages),
+            ("spi_errors", &self.spi_errors),
+            ("commands", &self.commands),
+            ("command_errors", &self.command_errors),
+            ("spi_messages_last_cmd", &self.spi_messages_last_cmd),
+            ("last_cmd_latency_ns", &self.last_cmd_latency_ns),
+        ];
+        let mut writer = SliceWriter::new(buf);
+
+        for &(name, counter) in counters.iter() {
+            if writeln!(writer, "{} {}", name, counter.load(Ordering::Relaxed)).is_err() {
+                break;
+            }
+        }
+
+        writer.len()
+    }
+}
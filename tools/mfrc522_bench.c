@@ -0,0 +1,426 @@
+// SPDX-License-Identifier: GPL-2.0
+
+/*
+ * Measure the throughput and latency of the MFRC522 driver over a set of
+ * workloads, through either the binary or the text interface. For each
+ * workload, report the operations per second, the SPI messages per operation,
+ * the latency percentiles and the errors.
+ *
+ * With a baseline file, exit with an error if any workload needs more SPI
+ * messages per operation, or has a higher 99th percentile latency, than allowed.
+ * Each line of the file is "<workload> <max SPI messages per op> <max p99 us>",
+ * "-" skipping a limit, and '#' starting a comment.
+ *
+ * Along with the mfrc522_emu module, no reader is needed:
+ *	insmod mfrc522_emu.ko picc=ntag216
+ *
+ * gcc -O2 -I../include/uapi -o mfrc522_bench mfrc522_bench.c
+ * ./mfrc522_bench [-t] [-b baseline] [-w workload] [device] [iterations]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/mfrc522.h>
+
+#define DEFAULT_DEVICE "/dev/mfrc522_misc0"
+#define DEFAULT_ITERATIONS 1000
+#define ANSWER_SIZE (MFRC522_IOC_DATA_SIZE + 64)
+
+struct workload {
+	const char *name;
+	uint32_t opcode;
+	const char *payload;
+	const char *text;
+	// Run once before measuring, such as loading a key
+	uint32_t setup_opcode;
+	const char *setup_payload;
+	const char *setup_text;
+};
+
+static const struct workload workloads[] = {
+	{ .name = "version",
+	  .opcode = MFRC522_OP_GET_VERSION,
+	  .payload = "",
+	  .text = "version" },
+	{ .name = "mem_write",
+	  .opcode = MFRC522_OP_MEM_WRITE,
+	  .payload = "0123456789abcdefghijklmno",
+	  .text = "mem_write:25:0123456789abcdefghijklmno" },
+	{ .name = "mem_read",
+	  .opcode = MFRC522_OP_MEM_READ,
+	  .payload = "",
+	  .text = "mem_read" },
+	{ .name = "gen_rand_id",
+	  .opcode = MFRC522_OP_GEN_RANDOM,
+	  .payload = "",
+	  .text = "gen_rand_id" },
+	{ .name = "read_uid",
+	  .opcode = MFRC522_OP_READ_UID,
+	  .payload = "",
+	  .text = "read_uid" },
+	{ .name = "ntag_read",
+	  .opcode = MFRC522_OP_NTAG_READ,
+	  .payload = "0-230",
+	  .text = "ntag_read:0-230" },
+	{ .name = "mf_read",
+	  .opcode = MFRC522_OP_MF_READ,
+	  .payload = "0-15",
+	  .text = "mf_read:0-15",
+	  .setup_opcode = MFRC522_OP_MF_KEY,
+	  .setup_payload = "*,A,FFFFFFFFFFFF",
+	  .setup_text = "mf_key:*,A,FFFFFFFFFFFF" },
+};
+
+#define WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+struct result {
+	unsigned long ops;
+	unsigned long errors;
+	uint64_t elapsed_ns;
+	uint64_t spi_messages;
+	uint64_t *latencies;
+};
+
+struct limit {
+	double max_spi_per_op;
+	double max_p99_us;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * Get a percentile of sorted latencies, in nanoseconds
+ */
+static uint64_t percentile(const uint64_t *sorted, unsigned long count,
+			   unsigned int pct)
+{
+	unsigned long i;
+
+	if (!count)
+		return 0;
+
+	i = (count * pct + 99) / 100;
+
+	return sorted[i ? i - 1 : 0];
+}
+
+/**
+ * Read the total amount of SPI messages sent to the chip, from the sysfs
+ * attribute of the C module's device, or from the "spi_messages" line of the
+ * Rust module's /dev/<device>_stats
+ *
+ * @return The amount, or -1 if it is not available
+ */
+static long long spi_messages(const char *device)
+{
+	char line[128];
+	char path[256];
+	char copy[128];
+	long long value = -1;
+	FILE *f;
+
+	snprintf(copy, sizeof(copy), "%s", device);
+	snprintf(path, sizeof(path), "/sys/class/misc/%s/spi_messages",
+		 basename(copy));
+
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%lld", &value) != 1)
+			value = -1;
+
+		fclose(f);
+
+		return value;
+	}
+
+	snprintf(path, sizeof(path), "%s_stats", device);
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "spi_messages %lld", &value) == 1)
+			break;
+
+	fclose(f);
+
+	return value;
+}
+
+/**
+ * One text round trip: write the command, then read the answer back
+ */
+static int text_exec(int fd, const char *cmd)
+{
+	char answer[ANSWER_SIZE];
+
+	if (write(fd, cmd, strlen(cmd)) < 0)
+		return -errno;
+
+	if (read(fd, answer, sizeof(answer)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * One binary round trip: a single MFRC522_IOC_EXEC call
+ */
+static int ioctl_exec(int fd, struct mfrc522_ioc_cmd *req, uint32_t opcode,
+		      const char *payload)
+{
+	req->opcode = opcode;
+	req->len = strlen(payload);
+	req->reserved = 0;
+	memcpy(req->data, payload, req->len);
+
+	if (ioctl(fd, MFRC522_IOC_EXEC, req) < 0)
+		return -errno;
+
+	return req->status;
+}
+
+static int workload_exec(int fd, struct mfrc522_ioc_cmd *req, bool text,
+			 uint32_t opcode, const char *payload, const char *cmd)
+{
+	return text ? text_exec(fd, cmd) : ioctl_exec(fd, req, opcode, payload);
+}
+
+static int run(int fd, const char *device, const struct workload *w, bool text,
+	       unsigned long iterations, struct result *res)
+{
+	struct mfrc522_ioc_cmd req;
+	long long spi_before;
+	long long spi_after;
+	uint64_t start;
+	uint64_t begin;
+	unsigned long i;
+
+	memset(res, 0, sizeof(*res));
+	res->latencies = calloc(iterations, sizeof(*res->latencies));
+	if (!res->latencies)
+		return -ENOMEM;
+
+	if (w->setup_text &&
+	    workload_exec(fd, &req, text, w->setup_opcode, w->setup_payload,
+			  w->setup_text))
+		fprintf(stderr, "%s: setup failed\n", w->name);
+
+	spi_before = spi_messages(device);
+	begin = now_ns();
+
+	for (i = 0; i < iterations; i++) {
+		start = now_ns();
+		if (workload_exec(fd, &req, text, w->opcode, w->payload,
+				  w->text)) {
+			res->errors++;
+			continue;
+		}
+
+		res->latencies[res->ops++] = now_ns() - start;
+	}
+
+	res->elapsed_ns = now_ns() - begin;
+	spi_after = spi_messages(device);
+	res->spi_messages = spi_before < 0 || spi_after < 0 ?
+				    0 : spi_after - spi_before;
+
+	qsort(res->latencies, res->ops, sizeof(*res->latencies), compare_u64);
+
+	return 0;
+}
+
+static void result_print(const struct workload *w, const struct result *res,
+			 unsigned long iterations)
+{
+	double ops_per_s = res->elapsed_ns ?
+				   res->ops * 1e9 / res->elapsed_ns : 0;
+
+	printf("%-12s %10.1f %8.2f %10.1f %10.1f %10.1f %8lu\n", w->name,
+	       ops_per_s, (double)res->spi_messages / iterations,
+	       percentile(res->latencies, res->ops, 50) / 1e3,
+	       percentile(res->latencies, res->ops, 99) / 1e3,
+	       res->ops ? res->latencies[res->ops - 1] / 1e3 : 0,
+	       res->errors);
+}
+
+static double limit_parse(const char *s)
+{
+	return strcmp(s, "-") ? strtod(s, NULL) : -1;
+}
+
+/**
+ * Load the limits of each workload from a baseline file
+ *
+ * @return 0 on success, -1 on error
+ */
+static int baseline_load(const char *path, struct limit *limits)
+{
+	char line[256];
+	char name[64];
+	char spi[32];
+	char p99[32];
+	unsigned int i;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' ||
+		    sscanf(line, "%63s %31s %31s", name, spi, p99) != 3)
+			continue;
+
+		for (i = 0; i < WORKLOADS; i++) {
+			if (strcmp(name, workloads[i].name))
+				continue;
+
+			limits[i].max_spi_per_op = limit_parse(spi);
+			limits[i].max_p99_us = limit_parse(p99);
+		}
+	}
+
+	fclose(f);
+
+	return 0;
+}
+
+/**
+ * Check a result against its limits
+ *
+ * @return Whether the result is within them
+ */
+static bool baseline_check(const struct workload *w, const struct result *res,
+			   unsigned long iterations, const struct limit *limit)
+{
+	double spi_per_op = (double)res->spi_messages / iterations;
+	double p99_us = percentile(res->latencies, res->ops, 99) / 1e3;
+	bool ok = true;
+
+	if (limit->max_spi_per_op >= 0 && spi_per_op > limit->max_spi_per_op) {
+		fprintf(stderr, "%s: %.2f SPI messages per op, expected at most %.2f\n",
+			w->name, spi_per_op, limit->max_spi_per_op);
+		ok = false;
+	}
+
+	if (limit->max_p99_us >= 0 && p99_us > limit->max_p99_us) {
+		fprintf(stderr, "%s: p99 of %.1fus, expected at most %.1fus\n",
+			w->name, p99_us, limit->max_p99_us);
+		ok = false;
+	}
+
+	return ok;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-t] [-b baseline] [-w workload] [device] [iterations]\n"
+		"  -t  use the text interface instead of MFRC522_IOC_EXEC\n"
+		"  -b  fail if a workload exceeds the limits of a baseline file\n"
+		"  -w  only run one workload\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct limit limits[WORKLOADS];
+	const char *baseline = NULL;
+	const char *only = NULL;
+	const char *device;
+	unsigned long iterations;
+	struct result res;
+	bool text = false;
+	bool ok = true;
+	unsigned int i;
+	int opt;
+	int fd;
+
+	while ((opt = getopt(argc, argv, "tb:w:h")) != -1) {
+		switch (opt) {
+		case 't':
+			text = true;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'w':
+			only = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+
+	device = optind < argc ? argv[optind] : DEFAULT_DEVICE;
+	iterations = optind + 1 < argc ? strtoul(argv[optind + 1], NULL, 10) :
+					 DEFAULT_ITERATIONS;
+	if (!iterations)
+		iterations = DEFAULT_ITERATIONS;
+
+	for (i = 0; i < WORKLOADS; i++)
+		limits[i].max_spi_per_op = limits[i].max_p99_us = -1;
+
+	if (baseline && baseline_load(baseline, limits))
+		return 2;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		return 1;
+	}
+
+	printf("%-12s %10s %8s %10s %10s %10s %8s\n", "workload", "ops/s",
+	       "spi/op", "p50_us", "p99_us", "max_us", "errors");
+
+	for (i = 0; i < WORKLOADS; i++) {
+		if (only && strcmp(only, workloads[i].name))
+			continue;
+
+		if (run(fd, device, &workloads[i], text, iterations, &res)) {
+			perror(workloads[i].name);
+			ok = false;
+			continue;
+		}
+
+		result_print(&workloads[i], &res, iterations);
+		if (!baseline_check(&workloads[i], &res, iterations, &limits[i]))
+			ok = false;
+
+		free(res.latencies);
+	}
+
+	close(fd);
+
+	return ok ? 0 : 1;
+}